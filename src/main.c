@@ -10,6 +10,13 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <errno.h>
 #endif
 
 #include <stdarg.h>
@@ -20,6 +27,7 @@
 #include <getopt.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <limits.h>
 
 /*#define DEBUG_LOOP*/
 
@@ -27,6 +35,8 @@
 // Maximum single sleep duration will be SLEEP_STEPS seconds.
 // Why not just sleeping for g_check_interval seconds? In case
 // a service stop is requested.
+// Under Linux, used only if waiting on file descriptors (see
+// sched_wait) is not available.
 #define SLEEP_STEPS                 5
 // Need a few seconds to stay alive while OS is terminating
 // the service (Windows)
@@ -34,6 +44,16 @@
 
 #define DEFAULT_NB_KEEP_LAST_STATUS 15
 #define DEFAULT_DISPLAY_NAME_WIDTH  20
+#define DEFAULT_CHECK_WORKERS       1
+// Upper limit of check_workers, keeps worker pipes within select() range
+#define MAX_CHECK_WORKERS           64
+#define DEFAULT_CHECK_PROCESSES     1
+#define MAX_CHECK_PROCESSES         64
+#define DEFAULT_PROGRAM_TIMEOUT     60
+#define DEFAULT_PROGRAM_PARALLEL    1
+#define MAX_PROGRAM_PARALLEL        256
+#define DEFAULT_HISTORY_SEGMENT_DURATION 86400
+#define MIN_HISTORY_SEGMENT_DURATION     60
 #define DEFAULT_SMTP_SENDER         (PACKAGE_TARNAME "@localhost")
 #define DEFAULT_SMTP_SELF           PACKAGE_TARNAME
 #define DEFAULT_ALERT_THRESHOLD     3
@@ -53,10 +73,15 @@
 #define DEFAULT_LOOP_ID             "NMNM"
 #define DEFAULT_LOOP_SEND_EVERY     2
 #define LOOP_STATUS_WHEN_SENDING_FAILS ST_UNKNOWN
-#define LOOP_TRIGGER_OPTIMIZE_ARRAY 10
 #define LOOP_PREFIX                 PACKAGE_NAME
 #define LOOP_POSTFIX                PACKAGE_NAME
-#define LOOP_ARRAY_REALLOC_STEP     60
+// Initial number of elements of the ring of loop emails of a check,
+// doubled each time it is full (must be a power of 2)
+#define LOOP_RING_INITIAL_SIZE      16
+// Initial number of elements of checks[] and alerts[], that are doubled
+// each time they are full
+#define CHECK_ARRAY_INITIAL_SIZE    16
+#define ALERT_ARRAY_INITIAL_SIZE    4
 // "subject" is the simplest! It could be
 //      "x-" PACKAGE_NAME
 // but x- headers are not guaranteed to be kept along the way.
@@ -180,11 +205,18 @@ int g_log_level_updated_by_option = FALSE;
 extern char g_log_file[SMALLSTRSIZE];
 extern char g_web_log_file[SMALLSTRSIZE];
 
-struct check_t checks[2000];
+// Sized as per the ini file
+struct check_t *checks = NULL;
+int g_nb_checks_alloc = 0;
+struct check_state_t *check_states = NULL;
 int g_nb_checks = 0;
 int g_nb_valid_checks = 0;
+// Number of levels in the checks dependency graph (level 0 = checks that
+// don't depend on any other)
+int g_nb_dep_levels = 1;
 
-struct alert_t alerts[100];
+struct alert_t *alerts = NULL;
+int g_nb_alerts_alloc = 0;
 int g_nb_alerts = 0;
 int g_nb_valid_alerts = 0;
 
@@ -196,6 +228,37 @@ long int g_check_interval;
 int g_check_interval_set = FALSE;
 long int g_nb_keep_last_status = -1;
 int g_nb_keep_last_status_set = FALSE;
+long int g_check_workers = DEFAULT_CHECK_WORKERS;
+int g_check_workers_set = FALSE;
+long int g_check_processes = DEFAULT_CHECK_PROCESSES;
+int g_check_processes_set = FALSE;
+long int g_program_timeout = DEFAULT_PROGRAM_TIMEOUT;
+int g_program_timeout_set = FALSE;
+long int g_program_parallel = DEFAULT_PROGRAM_PARALLEL;
+int g_program_parallel_set = FALSE;
+char g_history_directory[BIGSTRSIZE];
+int g_history_directory_set = FALSE;
+long int g_history_segment_duration = DEFAULT_HISTORY_SEGMENT_DURATION;
+int g_history_segment_duration_set = FALSE;
+
+char g_state_file[MAX_PATH];
+int g_state_file_set = FALSE;
+
+// --history option
+char g_history_query[SMALLSTRSIZE];
+char g_history_metric[SMALLSTRSIZE];
+long long int g_history_from = 0;
+long long int g_history_to = -1;
+
+// Scheduling statistics
+//   drift = delay between the time a round is due and the time it starts
+//   overrun = a check was not done within its interval, execution(s) skipped
+long int g_sched_nb_rounds = 0;
+long long int g_sched_last_drift = 0;
+long long int g_sched_max_drift = 0;
+long long int g_sched_total_drift = 0;
+long int g_sched_nb_overruns = 0;
+long int g_sched_nb_skipped = 0;
 
 extern long int g_print_subst_error;
 int g_print_subst_error_set = FALSE;
@@ -208,6 +271,12 @@ extern long int g_connect_timeout;
 int g_connect_timeout_set = FALSE;
 extern long int g_netio_timeout;
 int g_netio_timeout_set = FALSE;
+extern long int g_dns_timeout;
+int g_dns_timeout_set = FALSE;
+extern long int g_dns_cache_ttl;
+int g_dns_cache_ttl_set = FALSE;
+extern long int g_dns_negative_ttl;
+int g_dns_negative_ttl_set = FALSE;
 int telnet_log = FALSE;
 
 extern int g_print_log;
@@ -220,6 +289,7 @@ int g_html_directory_set = FALSE;
 extern char g_html_file[SMALLSTRSIZE];
 int g_html_file_set = FALSE;
 char g_html_complete_file_name[BIGSTRSIZE];
+char g_metrics_complete_file_name[BIGSTRSIZE];
 extern char g_css_file[BIGSTRSIZE];
 
 #define CFGK_LIST_SEPARATOR ','
@@ -246,17 +316,20 @@ enum {
     CM_UNDEF = FIND_STRING_NOT_FOUND,
     CM_TCP = 0,
     CM_PROGRAM = 1,
-    CM_LOOP = 2
+    CM_LOOP = 2,
+    CM_PLUGIN = 3
 };
 const char *l_check_methods[] = {
     "tcp",      // CM_TCP
     "program",  // CM_PROGRAM
-    "loop"      // CM_LOOP
+    "loop",     // CM_LOOP
+    "plugin"    // CM_PLUGIN
 };
 int (*check_func[]) (struct check_t *, const struct subst_t *, int) = {
     perform_check_tcp,      // CM_TCP
     perform_check_program,  // CM_PROGRAM
-    perform_check_loop      // CM_LOOP
+    perform_check_loop,     // CM_LOOP
+    perform_check_plugin    // CM_PLUGIN
 };
 
 enum {ID_YES = 0, ID_NO = 1};
@@ -291,6 +364,14 @@ const char *l_date_formats[] = {
     "english" // DF_ENGLISH
 };
 
+enum {TE_BLOCKING = 0, TE_EPOLL = 1};
+long int g_tcp_engine = TE_BLOCKING;
+int g_tcp_engine_set = FALSE;
+const char *l_tcp_engines[] = {
+    "blocking", // TE_BLOCKING
+    "epoll"     // TE_EPOLL
+};
+
 
 //
 // All variables found in the ini file
@@ -372,6 +453,29 @@ const struct readcfg_var_t readcfg_vars[] = {
         "program_command", V_STR, CS_CHECK, NULL, &(chk00.prg_command), NULL, 0,
         &(chk00.prg_command_set), FALSE, NULL, 0, CM_PROGRAM
     },
+    {
+        "program_timeout", V_INT, CS_CHECK, &chk00.prg_timeout, NULL, NULL, 0,
+        &chk00.prg_timeout_set, FALSE, NULL, 0, CM_PROGRAM
+    },
+
+// CHECKS -> PLUGIN method
+
+    {
+        "plugin_file", V_STR, CS_CHECK, NULL, &chk00.plg_file, NULL, 0,
+        &chk00.plg_file_set, FALSE, NULL, 0, CM_PLUGIN
+    },
+    {
+        "plugin_args", V_STR, CS_CHECK, NULL, &chk00.plg_args, NULL, 0,
+        &chk00.plg_args_set, TRUE, NULL, 0, CM_PLUGIN
+    },
+    {
+        "plugin_isolate", V_YESNO, CS_CHECK, &chk00.plg_isolate, NULL, NULL, 0,
+        &chk00.plg_isolate_set, FALSE, NULL, 0, CM_PLUGIN
+    },
+    {
+        "plugin_timeout", V_INT, CS_CHECK, &chk00.plg_timeout, NULL, NULL, 0,
+        &chk00.plg_timeout_set, FALSE, NULL, 0, CM_PLUGIN
+    },
 
 // CHECKS -> LOOP method
 
@@ -459,6 +563,15 @@ const struct readcfg_var_t readcfg_vars[] = {
         &chk00.loop_pop3.srv.netio_timeout_set, FALSE, NULL, 0, CM_LOOP
     },
 
+    {
+        "interval", V_INT, CS_CHECK, &(chk00.interval), NULL,
+        NULL, 0, &(chk00.interval_set), TRUE, NULL, 0, -1
+    },
+    {
+        "depends_on", V_STR, CS_CHECK, NULL, &(chk00.depends_on), NULL, 0,
+        &(chk00.depends_on_set), FALSE, NULL, 0, -1
+    },
+
 // CHECKS -> alerts
 
     {
@@ -506,6 +619,40 @@ const struct readcfg_var_t readcfg_vars[] = {
         "check_interval", V_INT, CS_GENERAL, &g_check_interval, NULL,
         NULL, 0, &g_check_interval_set, TRUE, NULL, 0, -1
     },
+    {
+        "check_workers", V_INT, CS_GENERAL, &g_check_workers, NULL,
+        NULL, 0, &g_check_workers_set, FALSE, NULL, 0, -1
+    },
+    {
+        "check_processes", V_INT, CS_GENERAL, &g_check_processes, NULL,
+        NULL, 0, &g_check_processes_set, FALSE, NULL, 0, -1
+    },
+    {
+        "program_timeout", V_INT, CS_GENERAL, &g_program_timeout, NULL,
+        NULL, 0, &g_program_timeout_set, FALSE, NULL, 0, -1
+    },
+    {
+        "program_parallel", V_INT, CS_GENERAL, &g_program_parallel, NULL,
+        NULL, 0, &g_program_parallel_set, FALSE, NULL, 0, -1
+    },
+    {
+        "history_directory", V_STR, CS_GENERAL, NULL, NULL, g_history_directory,
+        sizeof(g_history_directory), &g_history_directory_set, FALSE, NULL, 0, -1
+    },
+    {
+        "history_segment_duration", V_INT, CS_GENERAL,
+        &g_history_segment_duration, NULL, NULL, 0,
+        &g_history_segment_duration_set, FALSE, NULL, 0, -1
+    },
+    {
+        "state_file", V_STR, CS_GENERAL, NULL, NULL, g_state_file,
+        sizeof(g_state_file), &g_state_file_set, FALSE, NULL, 0, -1
+    },
+    {
+        "tcp_engine", V_STRKEY, CS_GENERAL, &g_tcp_engine, NULL,
+        NULL, 0, &g_tcp_engine_set, FALSE, l_tcp_engines,
+        sizeof(l_tcp_engines) / sizeof(*l_tcp_engines), -1
+    },
     {
         "connect_timeout", V_INT, CS_GENERAL, &g_connect_timeout, NULL,
         NULL, 0, &g_connect_timeout_set, FALSE, NULL, 0, -1
@@ -514,6 +661,18 @@ const struct readcfg_var_t readcfg_vars[] = {
         "netio_timeout", V_INT, CS_GENERAL, &g_netio_timeout, NULL,
         NULL, 0, &g_netio_timeout_set, FALSE, NULL, 0, -1
     },
+    {
+        "dns_timeout", V_INT, CS_GENERAL, &g_dns_timeout, NULL,
+        NULL, 0, &g_dns_timeout_set, FALSE, NULL, 0, -1
+    },
+    {
+        "dns_cache_ttl", V_INT, CS_GENERAL, &g_dns_cache_ttl, NULL,
+        NULL, 0, &g_dns_cache_ttl_set, FALSE, NULL, 0, -1
+    },
+    {
+        "dns_negative_ttl", V_INT, CS_GENERAL, &g_dns_negative_ttl, NULL,
+        NULL, 0, &g_dns_negative_ttl_set, FALSE, NULL, 0, -1
+    },
     {
         "keep_last_status", V_INT, CS_GENERAL, &g_nb_keep_last_status, NULL,
         NULL, 0, &g_nb_keep_last_status_set, TRUE, NULL, 0, -1
@@ -627,6 +786,10 @@ const struct readcfg_var_t readcfg_vars[] = {
         "program_command", V_STR, CS_ALERT, NULL, &alrt00.prg_command, NULL, 0,
         &alrt00.prg_command_set, FALSE, NULL, 0, AM_PROGRAM
     },
+    {
+        "program_timeout", V_INT, CS_ALERT, &alrt00.prg_timeout, NULL, NULL, 0,
+        &alrt00.prg_timeout_set, FALSE, NULL, 0, AM_PROGRAM
+    },
 
 // ALERTS -> LOG method
 
@@ -652,12 +815,6 @@ const char *LE_NAMES[] = {
     "Received"  // LE_RECEIVED
 };
 
-// Used to store the status of Email-Loop emails sent
-struct loop_t *loops = NULL;
-int first_loop = 0;
-int last_loop = -1;
-int loops_nb_alloc = 0;
-
 // Shall we print network traffic to the log?
 // For very high level debugging only.
 int g_trace_network_traffic;
@@ -666,6 +823,20 @@ int g_trace_network_traffic;
 /*int quitting = FALSE;*/
 
 int service_stop_requested = FALSE;
+// Set when all checks are to be done right away (SIGUSR1, or URL_RUN_NOW
+// of the web server)
+volatile sig_atomic_t run_now_requested = FALSE;
+// Set when the ini file is to be reloaded (SIGHUP)
+volatile sig_atomic_t reload_requested = FALSE;
+
+#ifdef MY_LINUX
+// The main loop waits for the next check to be due on these file descriptors,
+// so that it wakes up as soon as a signal or a run now request comes in.
+int g_wait_timer_fd = -1;
+int g_wait_signal_fd = -1;
+int g_run_now_fd = -1;
+sigset_t g_wait_sigmask;
+#endif
 
 #ifdef MY_WINDOWS
 
@@ -761,6 +932,197 @@ void pop3_account_t_destroy(struct pop3_account_t *p) {
         MYFREE(p->password);
 }
 
+//
+// Status history
+//
+void status_hist_create(struct status_hist_t *h, const int size) {
+    h->size = (size >= 1 ? size : 0);
+    h->head = 0;
+    h->bits = NULL;
+    if (h->size >= 1) {
+        size_t nb_bytes = ((size_t)h->size + 3) / 4;
+        h->bits = (unsigned char *)MYMALLOC(nb_bytes, h->bits);
+        // Filled with ST_UNDEF (0)
+        memset(h->bits, 0, nb_bytes);
+    }
+}
+
+void status_hist_destroy(struct status_hist_t *h) {
+    if (h->bits != NULL)
+        MYFREE(h->bits);
+    h->bits = NULL;
+    h->size = 0;
+}
+
+//
+// Record a status, replacing the oldest one
+//
+void status_hist_push(struct status_hist_t *h, const int status) {
+    if (h->size < 1)
+        return;
+    int shift = (h->head % 4) * 2;
+    unsigned char *b = &h->bits[h->head / 4];
+    *b = (unsigned char)((*b & ~(3 << shift)) | ((status & 3) << shift));
+    if (++h->head == h->size)
+        h->head = 0;
+}
+
+//
+// Status number i, from the oldest (0) to the latest (size - 1)
+//
+int status_hist_get(const struct status_hist_t *h, const int i) {
+    int pos = h->head + i;
+    if (pos >= h->size)
+        pos -= h->size;
+    return (h->bits[pos / 4] >> ((pos % 4) * 2)) & 3;
+}
+
+//
+// Loop emails ring
+//
+void loop_ring_create(struct loop_ring_t *ring) {
+    ring->entries = NULL;
+    ring->size = 0;
+    ring->first = 0;
+    ring->nb = 0;
+    ring->nb_sent = 0;
+    ring->nb_lost = 0;
+    ring->index = NULL;
+    ring->index_mask = 0;
+}
+
+void loop_ring_destroy(struct loop_ring_t *ring) {
+    if (ring->entries != NULL)
+        MYFREE(ring->entries);
+    if (ring->index != NULL)
+        MYFREE(ring->index);
+    loop_ring_create(ring);
+}
+
+//
+// Entry number i, from the oldest (0) to the latest (nb - 1)
+//
+struct loop_t *loop_ring_get(const struct loop_ring_t *ring, const int i) {
+    return &ring->entries[(ring->first + i) & (ring->size - 1)];
+}
+
+static void loop_ring_index_add(struct loop_ring_t *ring, const int pos) {
+    unsigned int h = ring->entries[pos].hash & ring->index_mask;
+    while (ring->index[h] >= 0)
+        h = (h + 1) & ring->index_mask;
+    ring->index[h] = pos;
+}
+
+//
+// Make room for one more entry: the ring and its index double in size
+//
+static void loop_ring_grow(struct loop_ring_t *ring) {
+    int size = (ring->size == 0 ? LOOP_RING_INITIAL_SIZE : ring->size * 2);
+    struct loop_t *entries = (struct loop_t *)MYMALLOC(sizeof(struct loop_t) *
+                             (size_t)size, entries);
+    int i;
+    for (i = 0; i < ring->nb; ++i)
+        entries[i] = *loop_ring_get(ring, i);
+    if (ring->entries != NULL)
+        MYFREE(ring->entries);
+    ring->entries = entries;
+    ring->size = size;
+    ring->first = 0;
+
+    if (ring->index != NULL)
+        MYFREE(ring->index);
+    ring->index = (int *)MYMALLOC(sizeof(int) * (size_t)size * 2, ring->index);
+    for (i = 0; i < size * 2; ++i)
+        ring->index[i] = -1;
+    ring->index_mask = (unsigned int)size * 2 - 1;
+    for (i = 0; i < ring->nb; ++i)
+        loop_ring_index_add(ring, i);
+}
+
+//
+// Add a sent email as the latest entry
+//
+struct loop_t *loop_ring_push(struct loop_ring_t *ring, const char *loop_ref,
+                              const time_t sent_time) {
+    if (ring->nb == ring->size)
+        loop_ring_grow(ring);
+    int pos = (ring->first + ring->nb) & (ring->size - 1);
+    struct loop_t *le = &ring->entries[pos];
+    le->status = LE_SENT;
+    strncpy(le->loop_ref, loop_ref, sizeof(le->loop_ref));
+    le->loop_ref[sizeof(le->loop_ref) - 1] = '\0';
+    le->hash = fnv1a_hash(le->loop_ref);
+    le->sent_time = sent_time;
+    le->received_time = 0;
+    loop_ring_index_add(ring, pos);
+    ++ring->nb;
+    ++ring->nb_sent;
+    return le;
+}
+
+struct loop_t *loop_ring_find(const struct loop_ring_t *ring,
+                              const char *loop_ref) {
+    if (ring->nb == 0)
+        return NULL;
+    unsigned int h = fnv1a_hash(loop_ref) & ring->index_mask;
+    int pos;
+    while ((pos = ring->index[h]) >= 0) {
+        if (!strcmp(ring->entries[pos].loop_ref, loop_ref))
+            return &ring->entries[pos];
+        h = (h + 1) & ring->index_mask;
+    }
+    return NULL;
+}
+
+//
+// Remove the oldest entry. Its index slot is emptied by shifting back the
+// slots that follow it in the same cluster, so that no tombstone is needed.
+//
+void loop_ring_pop(struct loop_ring_t *ring) {
+    int pos = ring->first;
+    unsigned int i = ring->entries[pos].hash & ring->index_mask;
+    while (ring->index[i] != pos)
+        i = (i + 1) & ring->index_mask;
+    unsigned int j = i;
+    for (;;) {
+        j = (j + 1) & ring->index_mask;
+        if (ring->index[j] < 0)
+            break;
+        unsigned int k = ring->entries[ring->index[j]].hash & ring->index_mask;
+        // Slot j can move to i if its home slot k is not in ]i, j]
+        if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+            ring->index[i] = ring->index[j];
+            i = j;
+        }
+    }
+    ring->index[i] = -1;
+
+    if (ring->entries[pos].status == LE_SENT) {
+        --ring->nb_sent;
+        ++ring->nb_lost;
+    } else {
+        ring->nb_lost = 0;
+    }
+    ring->first = (ring->first + 1) & (ring->size - 1);
+    --ring->nb;
+}
+
+//
+// Metrics of program checks
+//
+void check_metrics_destroy(struct check_t *chk) {
+    if (chk->metrics == NULL)
+        return;
+#ifdef MY_LINUX
+    int i;
+    for (i = 0; i < chk->nb_metrics; ++i)
+        ts_segment_close(&chk->metrics[i].ts_seg);
+#endif
+    MYFREE(chk->metrics);
+    chk->metrics = NULL;
+    chk->nb_metrics = 0;
+}
+
 void check_t_destroy(struct check_t *chk) {
     if (chk->display_name != NULL)
         MYFREE(chk->display_name);
@@ -776,17 +1138,33 @@ void check_t_destroy(struct check_t *chk) {
     if (chk->prg_command != NULL)
         MYFREE(chk->prg_command);
 
+    plugin_check_stop(chk);
+    if (chk->plg_file != NULL)
+        MYFREE(chk->plg_file);
+    if (chk->plg_args != NULL)
+        MYFREE(chk->plg_args);
+
     rfc821_enveloppe_t_destroy(&chk->loop_smtp);
     if (chk->loop_id != NULL)
         MYFREE(chk->loop_id);
     pop3_account_t_destroy(&chk->loop_pop3);
+    loop_ring_destroy(&chk->loop_ring);
 
     if (chk->alerts != NULL)
         MYFREE(chk->alerts);
-    if (chk->str_prev_status != NULL)
-        MYFREE(chk->str_prev_status);
+    status_hist_destroy(&chk->hist);
+#ifdef MY_LINUX
+    ts_segment_close(&chk->ts_seg);
+#endif
+    check_metrics_destroy(chk);
     if (chk->alert_ctrl != NULL)
         MYFREE(chk->alert_ctrl);
+    if (chk->depends_on != NULL)
+        MYFREE(chk->depends_on);
+    if (chk->parents != NULL)
+        MYFREE(chk->parents);
+    if (chk->loop_uids != NULL)
+        MYFREE(chk->loop_uids);
 }
 
 //
@@ -849,6 +1227,17 @@ void check_t_create(struct check_t *chk) {
 
     chk->prg_command = NULL;
     chk->prg_command_set = FALSE;
+    chk->prg_timeout = 0;
+    chk->prg_timeout_set = FALSE;
+
+    chk->plg_file = NULL;
+    chk->plg_file_set = FALSE;
+    chk->plg_args = NULL;
+    chk->plg_args_set = FALSE;
+    chk->plg_isolate = FALSE;
+    chk->plg_isolate_set = FALSE;
+    chk->plg_timeout = 0;
+    chk->plg_timeout_set = FALSE;
 
     rfc821_enveloppe_t_create(&chk->loop_smtp);
     chk->loop_id = NULL;
@@ -858,6 +1247,19 @@ void check_t_create(struct check_t *chk) {
     chk->loop_fail_timeout_set = FALSE;
     chk->loop_send_every_set = FALSE;
     chk->loop_send_countdown = -1;
+    loop_ring_create(&chk->loop_ring);
+
+    chk->interval = 0;
+    chk->interval_set = FALSE;
+
+    chk->depends_on = NULL;
+    chk->depends_on_set = FALSE;
+    chk->nb_parents = 0;
+    chk->parents = NULL;
+    chk->dep_level = 0;
+
+    chk->shard = 0;
+    chk->def_hash = fnv1a_hash("");
 
     chk->alerts = NULL;
     chk->alerts_set = FALSE;
@@ -871,9 +1273,60 @@ void check_t_create(struct check_t *chk) {
     chk->alert_repeat_max_set = FALSE;
     chk->alert_recovery_set = FALSE;
 
-    chk->status = ST_UNDEF;
-    chk->prev_status = ST_UNDEF;
-    chk->str_prev_status = NULL;
+    chk->hist.bits = NULL;
+    chk->hist.size = 0;
+#ifdef MY_LINUX
+    ts_segment_init(&chk->ts_seg, (int)sizeof(struct ts_record_t));
+#endif
+    chk->hist.head = 0;
+
+    chk->loop_uids = NULL;
+    chk->loop_nb_uids = 0;
+
+    chk->prg_output[0] = '\0';
+    chk->metrics = NULL;
+    chk->nb_metrics = 0;
+
+    chk->plugin = NULL;
+    chk->plg_ready = FALSE;
+    chk->plg_state = NULL;
+#ifdef MY_LINUX
+    chk->plg_pid = -1;
+    chk->plg_cmd_fd = -1;
+    chk->plg_res_fd = -1;
+#endif
+}
+
+//
+// State of a check
+//
+struct check_state_t *check_state_of(const struct check_t *chk) {
+    return &check_states[chk - checks];
+}
+
+//
+// Create check_states[], once checks[] is complete
+//
+void check_states_create() {
+    check_states =
+        (struct check_state_t *)MYMALLOC(sizeof(struct check_state_t) *
+                                         (unsigned long int)(g_nb_checks + 1), check_states);
+    int i;
+    for (i = 0; i < g_nb_checks; ++i) {
+        struct check_state_t *st = &check_states[i];
+        st->is_valid = checks[i].is_valid;
+        st->dep_level = checks[i].dep_level;
+        st->status = ST_UNDEF;
+        st->prev_status = ST_UNDEF;
+        st->nb_consecutive_notok = 0;
+        st->trigger_sequence = 0;
+        st->next_due = 0;
+        st->is_due = FALSE;
+        st->is_suppressed = FALSE;
+        st->suppressed_by = -1;
+        st->duration_ms = 0;
+        st->value = TS_VALUE_NONE;
+    }
 }
 
 //
@@ -882,19 +1335,10 @@ void check_t_create(struct check_t *chk) {
 void check_t_getready(struct check_t *chk) {
     if (!chk->is_valid)
         return;
-    chk->nb_consecutive_notok = 0;
-    if (chk->str_prev_status != NULL)
+    if (chk->hist.bits != NULL)
         return;
-    if (g_nb_keep_last_status >= 1) {
-        chk->str_prev_status =
-            (char *)MYMALLOC((unsigned long)g_nb_keep_last_status + 1,
-                             chk->str_prev_status);
-        memset(chk->str_prev_status, ST_TO_CHAR[ST_UNDEF],
-               (unsigned long int)g_nb_keep_last_status);
-        chk->str_prev_status[g_nb_keep_last_status] = '\0';
-    }
+    status_hist_create(&chk->hist, (int)g_nb_keep_last_status);
     chk->last_status_change_flag = FALSE;
-    chk->trigger_sequence = 0;
     int i;
     for (i = 0; i < chk->nb_alerts; ++i) {
         chk->alert_ctrl[i].alert_status = AS_NOTHING;
@@ -903,6 +1347,367 @@ void check_t_getready(struct check_t *chk) {
     }
 }
 
+//
+// State file
+//
+// Runtime state (statuses, counters, alert control, history, loop emails
+// not yet back) is saved at the end of every round, and reloaded at
+// startup, so that a restart goes unnoticed by alerts.
+// The file is written under a temporary name, then renamed.
+// Checks are identified by their display name, alerts by their name: a
+// check or an alert that is no longer defined is skipped.
+//
+
+#define STATE_MAGIC     "NMST"
+#define STATE_VERSION   2
+#define STATE_TMP_EXT   ".tmp"
+
+struct state_header_t {
+    char magic[4];
+    int version;
+    long long int saved_time;
+    int nb_checks;
+};
+
+// Fixed part of the record of a check, followed by the history (one byte
+// per status, oldest first), by the alert control records and by the loop
+// email records.
+struct state_check_t {
+    int status;
+    int prev_status;
+    int nb_consecutive_notok;
+    int trigger_sequence;
+    int last_status_change_flag;
+    int loop_send_countdown;
+    long long int last_status_change;
+    long long int alert_info;
+    int hist_size;
+    int nb_alert_ctrl;
+    int nb_loops;
+};
+
+struct state_alert_ctrl_t {
+    int alert_status;
+    int trigger_sequence;
+    int nb_failures;
+};
+
+struct state_loop_t {
+    int status;
+    char loop_ref[LOOP_REF_SIZE];
+    long long int sent_time;
+    long long int received_time;
+};
+
+static int state_write_str(FILE *F, const char *str) {
+    int len = (int)strlen(str);
+    return fwrite(&len, sizeof(len), 1, F) == 1
+           && fwrite(str, 1, (size_t)len, F) == (size_t)len;
+}
+
+static int state_read_str(FILE *F, char *buf, const size_t buf_len) {
+    int len;
+    if (fread(&len, sizeof(len), 1, F) != 1 || len < 0
+            || (size_t)len >= buf_len)
+        return FALSE;
+    if (fread(buf, 1, (size_t)len, F) != (size_t)len)
+        return FALSE;
+    buf[len] = '\0';
+    return TRUE;
+}
+
+static int state_write_check(FILE *F, struct check_t *chk) {
+    const struct check_state_t *st = check_state_of(chk);
+    struct state_check_t sc;
+    memset(&sc, 0, sizeof(sc));
+    sc.status = st->status;
+    sc.prev_status = st->prev_status;
+    sc.nb_consecutive_notok = st->nb_consecutive_notok;
+    sc.trigger_sequence = st->trigger_sequence;
+    sc.last_status_change_flag = chk->last_status_change_flag;
+    sc.loop_send_countdown = chk->loop_send_countdown;
+    sc.last_status_change = (long long int)mktime(&chk->last_status_change);
+    sc.alert_info = (long long int)mktime(&chk->alert_info);
+    sc.hist_size = chk->hist.size;
+    sc.nb_alert_ctrl = chk->nb_alerts;
+    sc.nb_loops = chk->loop_ring.nb;
+
+    if (!state_write_str(F, chk->display_name)
+            || fwrite(&sc, sizeof(sc), 1, F) != 1)
+        return FALSE;
+    int i;
+    for (i = 0; i < chk->hist.size; ++i) {
+        if (fputc(status_hist_get(&chk->hist, i), F) == EOF)
+            return FALSE;
+    }
+    for (i = 0; i < chk->nb_alerts; ++i) {
+        const struct alert_ctrl_t *ctrl = &chk->alert_ctrl[i];
+        struct state_alert_ctrl_t sa;
+        sa.alert_status = ctrl->alert_status;
+        sa.trigger_sequence = ctrl->trigger_sequence;
+        sa.nb_failures = ctrl->nb_failures;
+        if (!state_write_str(F, alerts[ctrl->idx].name)
+                || fwrite(&sa, sizeof(sa), 1, F) != 1)
+            return FALSE;
+    }
+    for (i = 0; i < chk->loop_ring.nb; ++i) {
+        const struct loop_t *le = loop_ring_get(&chk->loop_ring, i);
+        struct state_loop_t sl;
+        memset(&sl, 0, sizeof(sl));
+        sl.status = le->status;
+        memcpy(sl.loop_ref, le->loop_ref, sizeof(sl.loop_ref));
+        sl.sent_time = (long long int)le->sent_time;
+        sl.received_time = (long long int)le->received_time;
+        if (fwrite(&sl, sizeof(sl), 1, F) != 1)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+//
+// Save runtime state in g_state_file
+//
+void state_save() {
+    char tmp[MAX_PATH + sizeof(STATE_TMP_EXT)];
+    snprintf(tmp, sizeof(tmp), "%s%s", g_state_file, STATE_TMP_EXT);
+
+    FILE *F = my_fopen(tmp, "wb", 1, 0);
+    if (F == NULL) {
+        char s_err[ERR_STR_BUFSIZE];
+        my_logf(LL_ERROR, LP_DATETIME, "Unable to open state file %s, %s", tmp,
+                os_last_err_desc(s_err, sizeof(s_err)));
+        return;
+    }
+
+    struct state_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, STATE_MAGIC, sizeof(h.magic));
+    h.version = STATE_VERSION;
+    h.saved_time = (long long int)time(NULL);
+    int i;
+    for (i = 0; i < g_nb_checks; ++i) {
+        if (checks[i].is_valid)
+            ++h.nb_checks;
+    }
+
+    int ok = (fwrite(&h, sizeof(h), 1, F) == 1);
+    for (i = 0; i < g_nb_checks && ok; ++i) {
+        if (checks[i].is_valid)
+            ok = state_write_check(F, &checks[i]);
+    }
+    if (ok)
+        ok = (fflush(F) == 0);
+#ifdef MY_LINUX
+    if (ok)
+        ok = (fsync(fileno(F)) == 0);
+#endif
+    if (fclose(F) != 0)
+        ok = FALSE;
+
+    if (ok) {
+#ifdef MY_WINDOWS
+        // rename() does not replace an existing file under Windows
+        remove(g_state_file);
+#endif
+        ok = (rename(tmp, g_state_file) == 0);
+    }
+    if (!ok) {
+        char s_err[ERR_STR_BUFSIZE];
+        my_logf(LL_ERROR, LP_DATETIME, "Unable to write state file %s, %s",
+                g_state_file, os_last_err_desc(s_err, sizeof(s_err)));
+        remove(tmp);
+    }
+}
+
+//
+// Index of the valid checks of an array by display name, used to load the
+// state file and to reload the configuration.
+// Open addressing, nb_slots is a power of 2. As with find_check(), names
+// are not case sensitive.
+//
+struct check_index_t {
+    const struct check_t *chks;
+    int *slots;
+    unsigned int mask;
+};
+
+static unsigned int check_index_hash(const char *name) {
+    unsigned int h = 2166136261U;
+    const unsigned char *p;
+    for (p = (const unsigned char *)name; *p != '\0'; ++p) {
+        h ^= (unsigned int)tolower(*p);
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void check_index_create(struct check_index_t *ix,
+                               const struct check_t *chks, const int nb) {
+    unsigned int nb_slots = 16;
+    while (nb_slots < (unsigned int)nb * 2)
+        nb_slots *= 2;
+    ix->chks = chks;
+    ix->mask = nb_slots - 1;
+    ix->slots = (int *)MYMALLOC(sizeof(int) * nb_slots, ix->slots);
+    unsigned int j;
+    for (j = 0; j < nb_slots; ++j)
+        ix->slots[j] = -1;
+    int i;
+    for (i = 0; i < nb; ++i) {
+        if (!chks[i].is_valid)
+            continue;
+        j = check_index_hash(chks[i].display_name) & ix->mask;
+        while (ix->slots[j] != -1)
+            j = (j + 1) & ix->mask;
+        ix->slots[j] = i;
+    }
+}
+
+static void check_index_destroy(struct check_index_t *ix) {
+    MYFREE(ix->slots);
+    ix->slots = NULL;
+}
+
+static int check_index_find(const struct check_index_t *ix, const char *name) {
+    unsigned int j = check_index_hash(name) & ix->mask;
+    while (ix->slots[j] != -1) {
+        if (strcasecmp(ix->chks[ix->slots[j]].display_name, name) == 0)
+            return ix->slots[j];
+        j = (j + 1) & ix->mask;
+    }
+    return -1;
+}
+
+static int state_is_status(const int status) {
+    return status >= 0 && status <= _ST_LAST;
+}
+
+//
+// Read the record of a check, and apply it to chk if chk is not NULL
+//
+static int state_read_check(FILE *F, struct check_t *chk) {
+    struct state_check_t sc;
+    if (fread(&sc, sizeof(sc), 1, F) != 1 || sc.hist_size < 0
+            || sc.nb_alert_ctrl < 0 || sc.nb_loops < 0
+            || !state_is_status(sc.status)
+            || !state_is_status(sc.prev_status))
+        return FALSE;
+
+    if (chk != NULL) {
+        struct check_state_t *st = check_state_of(chk);
+        st->status = sc.status;
+        st->prev_status = sc.prev_status;
+        st->nb_consecutive_notok = sc.nb_consecutive_notok;
+        st->trigger_sequence = sc.trigger_sequence;
+        chk->last_status_change_flag = sc.last_status_change_flag;
+        chk->loop_send_countdown = sc.loop_send_countdown;
+        time_t t = (time_t)sc.last_status_change;
+        chk->last_status_change = *localtime(&t);
+        t = (time_t)sc.alert_info;
+        chk->alert_info = *localtime(&t);
+    }
+
+    // History is replayed, so that keep_last_status can change
+    int i;
+    for (i = 0; i < sc.hist_size; ++i) {
+        int c = fgetc(F);
+        if (!state_is_status(c))
+            return FALSE;
+        if (chk != NULL)
+            status_hist_push(&chk->hist, c);
+    }
+
+    for (i = 0; i < sc.nb_alert_ctrl; ++i) {
+        char name[SMALLSTRSIZE];
+        struct state_alert_ctrl_t sa;
+        if (!state_read_str(F, name, sizeof(name))
+                || fread(&sa, sizeof(sa), 1, F) != 1)
+            return FALSE;
+        if (chk == NULL)
+            continue;
+        int j;
+        for (j = 0; j < chk->nb_alerts; ++j) {
+            struct alert_ctrl_t *ctrl = &chk->alert_ctrl[j];
+            if (strcmp(alerts[ctrl->idx].name, name) == 0) {
+                ctrl->alert_status = sa.alert_status;
+                ctrl->trigger_sequence = sa.trigger_sequence;
+                ctrl->nb_failures = sa.nb_failures;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < sc.nb_loops; ++i) {
+        struct state_loop_t sl;
+        if (fread(&sl, sizeof(sl), 1, F) != 1)
+            return FALSE;
+        if (chk == NULL || (sl.status != LE_SENT && sl.status != LE_RECEIVED))
+            continue;
+        sl.loop_ref[sizeof(sl.loop_ref) - 1] = '\0';
+        struct loop_t *le = loop_ring_push(&chk->loop_ring, sl.loop_ref,
+                                           (time_t)sl.sent_time);
+        if (sl.status == LE_RECEIVED) {
+            le->status = LE_RECEIVED;
+            le->received_time = (time_t)sl.received_time;
+            --chk->loop_ring.nb_sent;
+        }
+    }
+    return TRUE;
+}
+
+//
+// Load runtime state from g_state_file, if it exists.
+// Must be called once checks are ready (check_t_getready).
+//
+void state_load() {
+    FILE *F = my_fopen(g_state_file, "rb", 1, 0);
+    if (F == NULL) {
+        my_logf(LL_NORMAL, LP_DATETIME, "No state file %s, starting afresh",
+                g_state_file);
+        return;
+    }
+
+    struct state_header_t h;
+    if (fread(&h, sizeof(h), 1, F) != 1
+            || memcmp(h.magic, STATE_MAGIC, sizeof(h.magic)) != 0
+            || h.version != STATE_VERSION || h.nb_checks < 0) {
+        my_logf(LL_ERROR, LP_DATETIME, "%s is not a state file, ignored",
+                g_state_file);
+        fclose(F);
+        return;
+    }
+
+    struct check_index_t ix;
+    check_index_create(&ix, checks, g_nb_checks);
+
+    int ok = TRUE;
+    int nb_restored = 0;
+    int nb_loops = 0;
+    int i;
+    for (i = 0; i < h.nb_checks && ok; ++i) {
+        char name[SMALLSTRSIZE];
+        ok = state_read_str(F, name, sizeof(name));
+        if (ok) {
+            int idx = check_index_find(&ix, name);
+            ok = state_read_check(F, idx >= 0 ? &checks[idx] : NULL);
+            if (ok && idx >= 0) {
+                ++nb_restored;
+                nb_loops += checks[idx].loop_ring.nb;
+            }
+        }
+    }
+    check_index_destroy(&ix);
+
+    fclose(F);
+
+    if (!ok)
+        my_logf(LL_ERROR, LP_DATETIME, "State file %s is truncated or corrupt",
+                g_state_file);
+    my_logf(LL_NORMAL, LP_DATETIME,
+            "State restored from %s: %i check(s), %i loop email(s)",
+            g_state_file, nb_restored, nb_loops);
+}
+
 //
 // Free pointers in the checks variables
 //
@@ -911,6 +1716,14 @@ void destroy_checks() {
     for (i = 0; i < g_nb_checks; ++i) {
         check_t_destroy(&checks[i]);
     }
+    if (checks != NULL)
+        MYFREE(checks);
+    checks = NULL;
+    if (check_states != NULL)
+        MYFREE(check_states);
+    check_states = NULL;
+    g_nb_checks = 0;
+    g_nb_checks_alloc = 0;
 }
 
 void alert_t_destroy(struct alert_t *alrt) {
@@ -962,6 +1775,8 @@ void alert_t_create(struct alert_t *alrt) {
 
     alrt->prg_command = NULL;
     alrt->prg_command_set = FALSE;
+    alrt->prg_timeout = 0;
+    alrt->prg_timeout_set = FALSE;
 
     // LOG
     alrt->log_file = NULL;
@@ -978,6 +1793,11 @@ void destroy_alerts() {
     for (i = 0; i < g_nb_alerts; ++i) {
         alert_t_destroy(&alerts[i]);
     }
+    if (alerts != NULL)
+        MYFREE(alerts);
+    alerts = NULL;
+    g_nb_alerts = 0;
+    g_nb_alerts_alloc = 0;
 }
 
 //
@@ -1036,6 +1856,17 @@ void get_str_alert_info(char *s, size_t s_len, const struct tm *ts) {
 //
 //
 //
+//
+// Status of a TCP check given the result of the connection
+//
+static int tcp_status_of_connres(const int cr) {
+    if (cr == CONNRES_OK)
+        return ST_OK;
+    if (cr == CONNRES_RESOLVE_ERROR || cr == CONNRES_SOCKET_ERROR)
+        return ST_UNKNOWN;
+    return ST_FAIL;
+}
+
 int perform_check_tcp(struct check_t *chk, const struct subst_t *subst,
                       int subst_len) {
     UNUSED(subst);
@@ -1050,10 +1881,12 @@ int perform_check_tcp(struct check_t *chk, const struct subst_t *subst,
                                        chk->tcp_expect_set ? chk->tcp_expect : NULL,
                                        prefix, g_trace_network_traffic);
     int backup_cr = cr;
+    if (cr == CONNRES_OK && conn.handshake_ms >= 0)
+        check_state_of(chk)->value = conn.handshake_ms;
 
     if (cr == CONNRES_OK && chk->tcp_close_set) {
         if (conn_line_sendf(my_logf, &conn, g_trace_network_traffic, "%s",
-                            chk->tcp_close)) {
+                            chk->tcp_close) || conn_flush(my_logf, &conn)) {
             cr = CONNRES_NETIO;
         }
     }
@@ -1065,46 +1898,162 @@ int perform_check_tcp(struct check_t *chk, const struct subst_t *subst,
         my_logf(LL_VERBOSE, LP_DATETIME, "%s disconnected from %s:%li", prefix,
                 chk->srv.server, chk->srv.port);
 
-    if (cr == CONNRES_OK)
-        return ST_OK;
-    if (cr == CONNRES_RESOLVE_ERROR)
-        return ST_UNKNOWN;
-    return ST_FAIL;
+    return tcp_status_of_connres(cr);
 }
 
+#ifdef MY_LINUX
 //
-//
-//
-int perform_check_program(struct check_t *chk, const struct subst_t *subst,
-                          int subst_len) {
-    char prefix[SMALLSTRSIZE];
-    snprintf(prefix, sizeof(prefix), "Program check(%s):", chk->display_name);
+// Perform TCP checks of a given dependency level all at once, using
+// conn_probe_multi. Status of check number i is stored in statuses[i].
+// Checks that cannot be multiplexed (SSL connections) are left to ST_UNDEF.
+//
+void perform_checks_tcp_multiplexed(int *statuses, const int level) {
+    conn_probe_t *probes =
+        (conn_probe_t *)MYMALLOC(sizeof(conn_probe_t) * (unsigned long int)(
+                                     g_nb_checks + 1), probes);
+    int *probe_idx = (int *)MYMALLOC(sizeof(int) * (unsigned long int)(
+                                         g_nb_checks + 1), probe_idx);
+    int nb = 0;
+    int i;
 
-    char *s_substitued = dollar_subst_alloc(chk->prg_command, subst,
-                                            subst_len);
-    my_logf(LL_VERBOSE, LP_DATETIME, "%s will execute the command:", prefix);
-    my_logs(LL_VERBOSE, LP_INDENT, s_substitued);
+    for (i = 0; i < g_nb_checks; ++i) {
+        const struct check_state_t *st = &check_states[i];
+        if (!st->is_valid || !st->is_due || st->dep_level != level
+                || st->is_suppressed)
+            continue;
+        struct check_t *chk = &checks[i];
+        if (chk->method != CM_TCP)
+            continue;
 
-    int r1 = system(s_substitued);
-    int r2 = os_wexitstatus(r1);
-    my_logf(r2 == NAGIOS_OK ? LL_VERBOSE : LL_ERROR, LP_DATETIME,
-            "%s return code: %i", prefix, r2);
-    MYFREE(s_substitued);
-    if (r2 < _NAGIOS_FIRST)
-        r2 = NAGIOS_UNKNOWN;
-    else if (r2 > _NAGIOS_LAST)
-        r2 = NAGIOS_UNKNOWN;
-    if (r2 == NAGIOS_OK)
+        my_logf(LL_VERBOSE, LP_DATETIME, "Performing check %s(%s)",
+                l_check_methods[chk->method], chk->display_name);
+
+        conn_probe_t *probe = &probes[nb];
+        probe->srv = &chk->srv;
+        probe->expect = (chk->tcp_expect_set ? chk->tcp_expect : NULL);
+        probe->close = (chk->tcp_close_set ? chk->tcp_close : NULL);
+        snprintf(probe->prefix, sizeof(probe->prefix), "TCP check(%s):",
+                 chk->display_name);
+        probe_idx[nb++] = i;
+    }
+
+    conn_probe_multi(probes, nb, g_trace_network_traffic);
+
+    for (i = 0; i < nb; ++i) {
+        if (probes[i].multiplexed) {
+            statuses[probe_idx[i]] = tcp_status_of_connres(probes[i].cr);
+            check_states[probe_idx[i]].duration_ms = probes[i].duration_ms;
+            check_states[probe_idx[i]].value = TS_VALUE_NONE;
+        }
+    }
+
+    MYFREE(probe_idx);
+    MYFREE(probes);
+}
+#endif
+
+//
+// Log the output of a program, one log line per output line
+//
+static void log_program_output(const char *output) {
+    char line[PRG_OUTPUT_SIZE];
+    const char *p = output;
+    while (*p != '\0') {
+        size_t l = strcspn(p, "\n");
+        size_t n = l;
+        if (n >= 1 && p[n - 1] == '\r')
+            --n;
+        memcpy(line, p, n);
+        line[n] = '\0';
+        my_logs(LL_VERBOSE, LP_INDENT, line);
+        p += l;
+        if (*p == '\n')
+            ++p;
+    }
+}
+
+//
+// Prepare the run of the command of a program check (the command being
+// already substituted)
+//
+static void program_check_run_init(const struct check_t *chk,
+                                   prg_run_t *run, const char *command) {
+    run->command = command;
+    run->timeout_ms = (chk->prg_timeout_set ? chk->prg_timeout :
+                       g_program_timeout) * 1000;
+}
+
+//
+// Keep the first line of the output of a program or a plugin, where
+// performance data are found
+//
+static void check_output_keep(struct check_t *chk, const char *output) {
+    size_t l = strcspn(output, "\n");
+    if (l >= sizeof(chk->prg_output))
+        l = sizeof(chk->prg_output) - 1;
+    memcpy(chk->prg_output, output, l);
+    chk->prg_output[l] = '\0';
+}
+
+//
+// Status corresponding to the return code of a Nagios plugin
+//
+static int nagios_code_to_status(const int code) {
+    if (code == NAGIOS_OK)
         return ST_OK;
-    if (r2 == NAGIOS_WARNING)
+    if (code == NAGIOS_WARNING)
         return ST_FAIL;
-    if (r2 == NAGIOS_CRITICAL)
+    if (code == NAGIOS_CRITICAL)
         return ST_FAIL;
-    if (r2 == NAGIOS_UNKNOWN)
-        return ST_UNKNOWN;
     return ST_UNKNOWN;
 }
 
+//
+// Get the status of a program check out of the run of its command
+//
+static int program_check_status(struct check_t *chk, const prg_run_t *run) {
+    char prefix[SMALLSTRSIZE];
+    snprintf(prefix, sizeof(prefix), "Program check(%s):", chk->display_name);
+
+    log_program_output(run->out);
+    log_program_output(run->err);
+    check_output_keep(chk, run->out);
+    if (run->timed_out) {
+        check_state_of(chk)->value = TS_VALUE_NONE;
+        my_logf(LL_ERROR, LP_DATETIME,
+                "%s timeout after %li second(s), process group killed", prefix,
+                run->timeout_ms / 1000);
+        return ST_FAIL;
+    }
+    int r2 = run->exit_code;
+    check_state_of(chk)->value = r2;
+    my_logf(r2 == NAGIOS_OK ? LL_VERBOSE : LL_ERROR, LP_DATETIME,
+            "%s return code: %i", prefix, r2);
+    return nagios_code_to_status(r2);
+}
+
+//
+//
+//
+int perform_check_program(struct check_t *chk, const struct subst_t *subst,
+                          int subst_len) {
+    char prefix[SMALLSTRSIZE];
+    snprintf(prefix, sizeof(prefix), "Program check(%s):", chk->display_name);
+
+    char *s_substitued = dollar_subst_alloc(chk->prg_command, subst,
+                                            subst_len);
+    my_logf(LL_VERBOSE, LP_DATETIME, "%s will execute the command:", prefix);
+    my_logs(LL_VERBOSE, LP_INDENT, s_substitued);
+
+    prg_run_t *run = (prg_run_t *)MYMALLOC(sizeof(prg_run_t), run);
+    program_check_run_init(chk, run, s_substitued);
+    prg_run(run);
+    int status = program_check_status(chk, run);
+    MYFREE(run);
+    MYFREE(s_substitued);
+    return status;
+}
+
 //
 // Construct a reference for email loops
 //
@@ -1155,6 +2104,71 @@ char *smtp_address(char *a) {
     return trim(a);
 }
 
+//
+// Tell whether an EHLO answer line (with the reply code removed) announces
+// the extension keyword kw
+//
+static int smtp_ehlo_keyword_is(const char *line, const char *kw) {
+    size_t l = strlen(kw);
+    return strncasecmp(line, kw, l) == 0 && (line[l] == '\0' || line[l] == ' ');
+}
+
+//
+// Read the answers to MAIL FROM, RCPT TO and DATA commands sent in one
+// batch (SMTP PIPELINING), in the order the commands were sent.
+// Returns ERR_SMTP_* constants, like smtp_email_sending_pre.
+//
+static int smtp_pipelined_answers(struct rfc821_enveloppe_t *env,
+                                  const char *prefix, connection_t *conn) {
+    int res_from;
+    if ((res_from = conn_expect(my_logf, conn, "250 ",
+                                g_trace_network_traffic)) == CONNRES_NETIO)
+        return ERR_SMTP_NETIO;
+
+    int i;
+    for (i = 0; i < env->nb_recipients_wanted; ++i) {
+        int res = conn_expect(my_logf, conn, "250 ", g_trace_network_traffic);
+        if (res == CONNRES_NETIO)
+            return ERR_SMTP_NETIO;
+        if (res == CONNRES_OK)
+            env->nb_recipients_ok++;
+    }
+
+    int res_data;
+    if ((res_data = conn_expect(my_logf, conn, "354 ",
+                                g_trace_network_traffic)) == CONNRES_NETIO)
+        return ERR_SMTP_NETIO;
+
+    if (res_from == CONNRES_OK && env->nb_recipients_ok >= 1
+            && res_data == CONNRES_OK)
+        return ERR_SMTP_OK;
+
+    if (res_data == CONNRES_OK) {
+        // The server accepted DATA though the transaction failed: it now
+        // waits for a message, send an empty one (RFC 2920, section 3.1).
+        if (conn_line_sendf(my_logf, conn, g_trace_network_traffic, ".")
+                || conn_expect(my_logf, conn, "", g_trace_network_traffic)
+                == CONNRES_NETIO)
+            return ERR_SMTP_NETIO;
+    }
+
+    if (res_from != CONNRES_OK) {
+        conn_line_sendf(my_logf, conn, g_trace_network_traffic, "QUIT");
+        my_logf(LL_ERROR, LP_DATETIME,
+                "%s sender not accepted, closing connection", prefix);
+        return ERR_SMTP_SENDER_REJECTED;
+    }
+    if (env->nb_recipients_ok == 0) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "%s no recipient accepted, closing connection", prefix);
+        conn_line_sendf(my_logf, conn, g_trace_network_traffic, "QUIT");
+        return ERR_SMTP_NO_RECIPIENT_ACCEPTED;
+    }
+    my_logf(LL_ERROR, LP_DATETIME,
+            "%s DATA command not accepted, closing connection", prefix);
+    return ERR_SMTP_DATA_COMMAND_REJECTED;
+}
+
 //
 // Perform an SMTP transaction up to the DATA command (inclusive)
 // Returns ERR_SMTP_* constants
@@ -1166,10 +2180,16 @@ int smtp_email_sending_pre(struct rfc821_enveloppe_t *env,
     env->nb_recipients_ok = -1;
 
     int cr = conn_establish_connection(conn, &env->srv, DEFAULT_SMTP_PORT,
-                                       "220 ", prefix, g_trace_network_traffic);
+                                       NULL, prefix, g_trace_network_traffic);
     if (cr != CONNRES_OK)
         return (cr == CONNRES_RESOLVE_ERROR ? ERR_SMTP_RESOLVE_ERROR :
                 ERR_SMTP_NETIO);
+    // The greeting can be a multi-line reply
+    if (conn_expect(my_logf, conn, "220 ", g_trace_network_traffic) != CONNRES_OK) {
+        my_logf(LL_ERROR, LP_DATETIME, "%s unexpected greeting from server",
+                prefix);
+        return ERR_SMTP_NETIO;
+    }
 
     if (conn_line_sendf(my_logf, conn, g_trace_network_traffic, "EHLO %s",
                         env->self_set ? env->self : DEFAULT_SMTP_SELF)) {
@@ -1178,11 +2198,15 @@ int smtp_email_sending_pre(struct rfc821_enveloppe_t *env,
 
     char *response = NULL;
     size_t response_size;
+    int pipelining = FALSE;
     do {
         if (conn_read_line_alloc(my_logf, conn, &response, g_trace_network_traffic,
                                  &response_size) < 0) {
             return ERR_SMTP_NETIO;
         }
+        if ((s_begins_with(response, "250-") || s_begins_with(response, "250 "))
+                && smtp_ehlo_keyword_is(response + 4, "PIPELINING"))
+            pipelining = TRUE;
     } while (s_begins_with(response, "250-"));
     if (!s_begins_with(response, "250 ")) {
         my_logf(LL_ERROR, LP_DATETIME, "%s unexpected answer from server '%s'",
@@ -1191,14 +2215,25 @@ int smtp_email_sending_pre(struct rfc821_enveloppe_t *env,
         return ERR_SMTP_BAD_ANSWER_TO_EHLO;
     }
     MYFREE(response);
+    if (pipelining)
+        my_logf(LL_DEBUG, LP_DATETIME, "%s server supports PIPELINING", prefix);
+
     env->from_orig = env->sender_set ? env->sender : DEFAULT_SMTP_SENDER;
     strncpy(from_buf, env->from_orig, from_buf_len);
     from_buf[from_buf_len - 1] = '\0';
     env->from = from_buf;
     env->from = smtp_address(env->from);
-    if (conn_round_trip(my_logf, conn, "250 ",
-                        g_trace_network_traffic, "MAIL FROM: <%s>", env->from
-                       ) != CONNRES_OK) {
+
+    // With PIPELINING (RFC 2920), MAIL, RCPT and DATA commands are only
+    // buffered here, the answers are read once DATA is sent, that is, the
+    // whole batch goes in one flight.
+    if (pipelining) {
+        if (conn_line_sendf(my_logf, conn, g_trace_network_traffic,
+                            "MAIL FROM: <%s>", env->from))
+            return ERR_SMTP_NETIO;
+    } else if (conn_round_trip(my_logf, conn, "250 ",
+                               g_trace_network_traffic, "MAIL FROM: <%s>", env->from
+                              ) != CONNRES_OK) {
         conn_line_sendf(my_logf, conn, g_trace_network_traffic, "QUIT");
         my_logf(LL_ERROR, LP_DATETIME,
                 "%s sender not accepted, closing connection", prefix);
@@ -1220,11 +2255,17 @@ int smtp_email_sending_pre(struct rfc821_enveloppe_t *env,
         r = smtp_address(r);
         if (strlen(r) >= 1) {
             env->nb_recipients_wanted++;
-            int res = conn_round_trip(my_logf, conn, "250 ", g_trace_network_traffic,
+            int res;
+            if (pipelining) {
+                res = conn_line_sendf(my_logf, conn, g_trace_network_traffic,
+                                      "RCPT TO: <%s>", r) ? CONNRES_NETIO : CONNRES_OK;
+            } else {
+                res = conn_round_trip(my_logf, conn, "250 ", g_trace_network_traffic,
                                       "RCPT TO: <%s>", r);
-            if (res == CONNRES_OK)
-                env->nb_recipients_ok++;
-            else if (res != CONNRES_OK && res != CONNRES_UNEXPECTED_ANSWER) {
+                if (res == CONNRES_OK)
+                    env->nb_recipients_ok++;
+            }
+            if (res != CONNRES_OK && res != CONNRES_UNEXPECTED_ANSWER) {
                 MYFREE(recipients);
                 return ERR_SMTP_NETIO;
             }
@@ -1234,6 +2275,12 @@ int smtp_email_sending_pre(struct rfc821_enveloppe_t *env,
     }
     MYFREE(recipients);
 
+    if (pipelining) {
+        if (conn_line_sendf(my_logf, conn, g_trace_network_traffic, "DATA"))
+            return ERR_SMTP_NETIO;
+        return smtp_pipelined_answers(env, prefix, conn);
+    }
+
     if (env->nb_recipients_ok == 0) {
         my_logf(LL_ERROR, LP_DATETIME,
                 "%s no recipient accepted, closing connection", prefix);
@@ -1265,12 +2312,15 @@ int smtp_mail_sending_post(connection_t *conn, const char *prefix,
 
     char *response = NULL;
     size_t response_size;
-    if (conn_read_line_alloc(my_logf, conn, &response, g_trace_network_traffic,
-                             &response_size) < 0) {
-        MYFREE(response);
-        conn_close(conn);
-        return ERR_SMTP_NETIO;
-    }
+    // Of a multi-line reply, the last line gives the queue reference
+    do {
+        if (conn_read_line_alloc(my_logf, conn, &response, g_trace_network_traffic,
+                                 &response_size) < 0) {
+            MYFREE(response);
+            conn_close(conn);
+            return ERR_SMTP_NETIO;
+        }
+    } while (conn_is_continuation_line(response));
     if (!s_begins_with(response, "250 ")) {
         MYFREE(response);
         my_logf(LL_ERROR, LP_DATETIME,
@@ -1366,7 +2416,7 @@ int smtp_mail_sending_stdheaders(connection_t *conn,
 //
 //
 //
-int loop_send_email(const struct check_t *chk,
+int loop_send_email(struct check_t *chk,
                     const struct subst_t *subst, int subst_len, const char *prefix) {
     UNUSED(subst);
     UNUSED(subst_len);
@@ -1396,26 +2446,18 @@ int loop_send_email(const struct check_t *chk,
         }
     }
 
-    ++last_loop;
-    if (last_loop >= loops_nb_alloc) {
-        loops_nb_alloc += LOOP_ARRAY_REALLOC_STEP;
-        loops = (struct loop_t *)MYREALLOC(loops,
-                                           (unsigned long int)loops_nb_alloc * sizeof(struct loop_t));
-    }
-
-    struct loop_t *loop = &loops[last_loop];
-    loop->status = LE_NONE;
+    char loop_ref[LOOP_REF_SIZE];
 
     struct tm now;
     time_t ltime = time(NULL);
     now = *localtime(&ltime);
 
-    build_email_ref(chk, ltime, loop->loop_ref, sizeof(loop->loop_ref));
+    build_email_ref(chk, ltime, loop_ref, sizeof(loop_ref));
 
     if (g_test_mode == 0) {
         // Corresponds to LOOP_HEADER_REF
         conn_line_sendf(my_logf, &conn, g_trace_network_traffic, "subject: %s",
-                        loop->loop_ref);
+                        loop_ref);
 
         conn_line_sendf(my_logf, &conn, g_trace_network_traffic,
                         "MIME-Version: 1.0");
@@ -1435,7 +2477,7 @@ int loop_send_email(const struct check_t *chk,
         conn_line_sendf(my_logf, &conn, g_trace_network_traffic, "Sent: %s",
                         strnow);
         conn_line_sendf(my_logf, &conn, g_trace_network_traffic, "Refrence: '%s'",
-                        loop->loop_ref);
+                        loop_ref);
         conn_line_sendf(my_logf, &conn, g_trace_network_traffic, "%s", "");
 
         // Email end
@@ -1443,15 +2485,13 @@ int loop_send_email(const struct check_t *chk,
         char email_ref[SMALLSTRSIZE];
         if ((r = smtp_mail_sending_post(&conn, prefix, email_ref,
                                         sizeof(email_ref))) == ERR_SMTP_OK) {
-            loop->status = LE_SENT;
-            loop->sent_time = ltime;
+            loop_ring_push(&chk->loop_ring, loop_ref, ltime);
         }
 
         assert(conn_is_closed(&conn));
 
     } else {
-        loop->status = LE_SENT;
-        loop->sent_time = ltime;
+        loop_ring_push(&chk->loop_ring, loop_ref, ltime);
         r = ERR_SMTP_OK;
     }
 
@@ -1486,25 +2526,25 @@ int does_this_email_belong_to_me(const char *s1, const char *s2) {
 //
 //
 //
-void loop_manage_retrieved_email(const char *reference,
+void loop_manage_retrieved_email(struct check_t *chk, const char *reference,
                                  const char *prefix) {
-    int i;
-    for (i = last_loop; i >= first_loop; --i) {
-        if (loops[i].status != LE_NONE && !strcmp(reference, loops[i].loop_ref)) {
-            if (loops[i].status == LE_RECEIVED) {
-                my_logf(LL_WARNING, LP_DATETIME,
-                        "%s loop email already retrieved, email loop ref = '%s'", prefix,
-                        reference);
-            }
-            loops[i].received_time = time(NULL);
-            long int duration = (signed long int)loops[i].received_time -
-                                (signed long int)loops[i].sent_time;
-            my_logf(LL_VERBOSE, LP_DATETIME,
-                    "%s loop email retrieved, delay = %lis, email loop ref = '%s'",
-                    prefix, duration, reference);
-            loops[i].status = LE_RECEIVED;
-            return;
+    struct loop_t *le = loop_ring_find(&chk->loop_ring, reference);
+    if (le != NULL) {
+        if (le->status == LE_RECEIVED) {
+            my_logf(LL_WARNING, LP_DATETIME,
+                    "%s loop email already retrieved, email loop ref = '%s'", prefix,
+                    reference);
+        } else {
+            --chk->loop_ring.nb_sent;
         }
+        le->received_time = time(NULL);
+        long int duration = (signed long int)le->received_time -
+                            (signed long int)le->sent_time;
+        my_logf(LL_VERBOSE, LP_DATETIME,
+                "%s loop email retrieved, delay = %lis, email loop ref = '%s'",
+                prefix, duration, reference);
+        le->status = LE_RECEIVED;
+        return;
     }
     my_logf(LL_WARNING, LP_DATETIME,
             "%s loop email found without internal match, email loop ref = '%s'",
@@ -1512,69 +2552,109 @@ void loop_manage_retrieved_email(const char *reference,
             reference);
 }
 
-//
-//
-//
-int loop_receive_emails(const struct check_t *chk,
-                        const struct subst_t *subst, int subst_len, const char *prefix) {
-    UNUSED(subst);
-    UNUSED(subst_len);
-
-    my_logf(LL_VERBOSE, LP_DATETIME, "%s retrieving probe email(s)", prefix);
-
-    const struct pop3_account_t *pop3 = &chk->loop_pop3;
+// Maximum number of TOP commands sent ahead of answers when the POP3
+// server supports PIPELINING
+#define POP3_PIPELINE_DEPTH 32
+
+enum {PM_KNOWN, PM_TO_FETCH, PM_MINE, PM_NOT_MINE};
+struct pop3_msg_t {
+    int num;
+    int state;
+    // Empty if the server does not support UIDL
+    struct pop3_uid_t id;
+    // Loop reference of emails found to be ours
+    char *ref;
+};
 
-    if (g_test_mode != 0)
-        return ERR_POP3_OK;
+static int pop3_uid_cmp(const void *a, const void *b) {
+    return strcmp(((const struct pop3_uid_t *)a)->uid,
+                  ((const struct pop3_uid_t *)b)->uid);
+}
 
-    connection_t conn;
+//
+// Read the lines of a multi-line answer up to the terminating ".",
+// calling f on each line (f can be NULL).
+// Returns CONNRES_OK or CONNRES_NETIO.
+//
+static int pop3_read_multiline(connection_t *conn,
+                               void (*f)(char *line, void *data), void *data) {
+    char *line;
+    size_t line_len;
+    for (;;) {
+        int rl = conn_read_line(my_logf, conn, &line, &line_len,
+                                g_trace_network_traffic);
+        if (rl <= 0) {
+            // Connection is closed by conn_read_line in case of error
+            if (rl == 0)
+                conn_close(conn);
+            return CONNRES_NETIO;
+        }
+        if (!strcmp(line, "."))
+            return CONNRES_OK;
+        if (f != NULL)
+            f(line, data);
+    }
+}
 
-    int r;
+static void pop3_capa_line(char *line, void *data) {
+    if (!strcasecmp(line, "PIPELINING"))
+        *(int *)data = TRUE;
+}
 
-    int cr = conn_establish_connection(&conn, &pop3->srv, DEFAULT_POP3_PORT,
-                                       "+OK",
-                                       prefix, g_trace_network_traffic);
-    if (cr != CONNRES_OK)
-        return (cr == CONNRES_RESOLVE_ERROR ? ERR_POP3_RESOLVE_ERROR :
-                ERR_POP3_NETIO);
+struct pop3_uidl_t {
+    struct pop3_msg_t *msgs;
+    int nb;
+    int nb_alloc;
+};
 
-    if ((r = conn_round_trip(my_logf, &conn, "+OK", g_trace_network_traffic,
-                             "USER %s",
-                             pop3->user)) != CONNRES_OK) {
-        if (r != CONNRES_NETIO) {
-            conn_line_sendf(my_logf, &conn, g_trace_network_traffic, "QUIT");
-            my_logf(LL_ERROR, LP_DATETIME, "%s user not accepted, closing connection",
-                    prefix);
-            conn_close(&conn);
-            return ERR_POP3_USER_REJECTED;
-        } else {
-            return ERR_POP3_NETIO;
-        }
+static void pop3_uidl_line(char *line, void *data) {
+    struct pop3_uidl_t *u = (struct pop3_uidl_t *)data;
+    char *uid;
+    long int num = strtol(line, &uid, 10);
+    if (num <= 0 || uid == line || *uid != ' ')
+        return;
+    uid = trim(uid);
+    if (u->nb >= u->nb_alloc) {
+        u->nb_alloc = (u->nb_alloc == 0 ? 64 : u->nb_alloc * 2);
+        u->msgs = (struct pop3_msg_t *)MYREALLOC(u->msgs,
+                  sizeof(struct pop3_msg_t) * (size_t)u->nb_alloc);
     }
+    struct pop3_msg_t *m = &u->msgs[u->nb++];
+    m->num = (int)num;
+    m->state = PM_TO_FETCH;
+    m->ref = NULL;
+    // A UID too long is not valid, such an email is fetched every time
+    if (strlen(uid) < sizeof(m->id.uid))
+        strcpy(m->id.uid, uid);
+    else
+        m->id.uid[0] = '\0';
+}
 
-    if ((r = conn_round_trip(my_logf, &conn, "+OK", g_trace_network_traffic,
-                             "PASS %s",
-                             pop3->password)) != CONNRES_OK) {
-        if (r != CONNRES_NETIO) {
-            conn_line_sendf(my_logf, &conn, g_trace_network_traffic, "QUIT");
-            my_logf(LL_ERROR, LP_DATETIME, "%s user not accepted, closing connection",
-                    prefix);
-            conn_close(&conn);
-            return ERR_POP3_PASSWORD_REJECTED;
-        } else {
-            return ERR_POP3_NETIO;
-        }
+static void pop3_top_line(char *line, void *data) {
+    char **header_value = (char **)data;
+    if (*header_value == NULL && s_begins_with(line, LOOP_HEADER_REF)) {
+        // Found the header we are interested in!
+        char *hv = line + strlen(LOOP_HEADER_REF);
+        hv = trim(hv);
+        size_t l = strlen(hv) + 1;
+        *header_value = (char *)MYMALLOC(l, *header_value);
+        strncpy(*header_value, hv, l);
+        (*header_value)[l - 1] = '\0';
     }
+}
 
-    if (conn_line_sendf(my_logf, &conn, g_trace_network_traffic, "STAT")) {
+//
+// Get the number of emails with STAT, for servers that do not support
+// UIDL
+//
+static int pop3_stat(connection_t *conn, const char *prefix, int *N) {
+    if (conn_line_sendf(my_logf, conn, g_trace_network_traffic, "STAT")) {
         return ERR_POP3_NETIO;
     }
-    char *response = NULL;
-    size_t response_size;
-    if (conn_read_line_alloc(my_logf, &conn, &response,
-                             g_trace_network_traffic,
-                             &response_size) < 0) {
-        MYFREE(response);
+    char *response;
+    size_t response_len;
+    if (conn_read_line(my_logf, conn, &response, &response_len,
+                       g_trace_network_traffic) < 0) {
         return ERR_POP3_NETIO;
     }
     char *space = NULL;
@@ -1585,8 +2665,7 @@ int loop_receive_emails(const struct check_t *chk,
         my_logf(LL_ERROR, LP_DATETIME, "%s unexpected answer from server '%s'",
                 prefix,
                 response);
-        MYFREE(response);
-        conn_close(&conn);
+        conn_close(conn);
         return ERR_POP3_STAT_ERROR;
     }
     *space = '\0';
@@ -1600,54 +2679,73 @@ int loop_receive_emails(const struct check_t *chk,
             my_logf(LL_ERROR, LP_DATETIME,
                     "%s unable to analyze answer from server: '%s'",
                     prefix, response);
-            MYFREE(response);
-            conn_close(&conn);
+            conn_close(conn);
             return ERR_POP3_STAT_ERROR;
         }
     }
-    int N = atoi(strN);
-
-    my_logf(LL_DEBUG, LP_DATETIME, "%s number of emails: %d", prefix, N);
+    *N = atoi(strN);
+    return ERR_POP3_OK;
+}
 
-    time_t ltime = time(NULL);
-    char refex[LOOP_REF_SIZE];
-    build_email_ref(chk, ltime, refex, sizeof(refex));
+static void pop3_msgs_destroy(struct pop3_msg_t *msgs, int nb) {
+    int i;
+    for (i = 0; i < nb; ++i) {
+        if (msgs[i].ref != NULL)
+            MYFREE(msgs[i].ref);
+    }
+    if (msgs != NULL)
+        MYFREE(msgs);
+}
 
-    int I;
-    for (I = 1; I <= N; ++I) {
+//
+// Retrieve headers of emails in state PM_TO_FETCH with TOP, then set their
+// state to PM_MINE or PM_NOT_MINE. With PIPELINING, up to
+// POP3_PIPELINE_DEPTH TOP commands are sent ahead of answers.
+//
+static int pop3_fetch_headers(struct check_t *chk, connection_t *conn,
+                              const char *prefix, const char *refex, struct pop3_msg_t *msgs, int nb,
+                              int pipelining) {
+    int depth = (pipelining ? POP3_PIPELINE_DEPTH : 1);
+    int next_to_send = 0;
+    int nb_pending = 0;
+    int i;
+    for (i = 0; i < nb; ++i) {
+        if (msgs[i].state != PM_TO_FETCH)
+            continue;
 
 // 1. Retrieve email headers
 
-        if ((r = conn_round_trip(my_logf, &conn, "+OK", g_trace_network_traffic,
-                                 "TOP %d 0",
-                                 I)) == CONNRES_NETIO) {
-            MYFREE(response);
+        // Refill by batches rather than one command per answer, to limit
+        // the number of small segments sent
+        while (nb_pending <= depth / 2 && next_to_send < nb) {
+            for (; next_to_send < nb && nb_pending < depth; ++next_to_send) {
+                if (msgs[next_to_send].state != PM_TO_FETCH)
+                    continue;
+                if (conn_line_sendf(my_logf, conn, g_trace_network_traffic,
+                                    "TOP %d 0", msgs[next_to_send].num))
+                    return ERR_POP3_NETIO;
+                ++nb_pending;
+            }
+        }
+
+        --nb_pending;
+        int r;
+        if ((r = conn_expect(my_logf, conn, "+OK",
+                             g_trace_network_traffic)) == CONNRES_NETIO) {
             return ERR_POP3_NETIO;
         } else if (r == CONNRES_UNEXPECTED_ANSWER) {
             my_logf(LL_ERROR, LP_DATETIME, "%s unable to analyze email #%d", prefix,
-                    I);
+                    msgs[i].num);
             continue;
         }
 
         char *header_value = NULL;
-        do {
-            if (conn_read_line_alloc(my_logf, &conn, &response,
-                                     g_trace_network_traffic,
-                                     &response_size) < 0) {
-                MYFREE(response);
-                return ERR_POP3_NETIO;
-            }
-
-            if (s_begins_with(response, LOOP_HEADER_REF)) {
-                // Found the header we are interested in!
-                char *hv = response + strlen(LOOP_HEADER_REF);
-                hv = trim(hv);
-                size_t l = strlen(hv) + 1;
-                header_value = (char *)MYMALLOC(l, header_value);
-                strncpy(header_value, hv, l);
-                header_value[l - 1] = '\0';
-            }
-        } while (strcmp(response, "."));
+        if (pop3_read_multiline(conn, pop3_top_line,
+                                &header_value) != CONNRES_OK) {
+            if (header_value != NULL)
+                MYFREE(header_value);
+            return ERR_POP3_NETIO;
+        }
 
 // 2. Check the email loop reference
 
@@ -1655,177 +2753,312 @@ int loop_receive_emails(const struct check_t *chk,
                 && does_this_email_belong_to_me(refex, header_value)) {
             my_logf(LL_DEBUG, LP_DATETIME, "%s email %d of reference '%s' is mine",
                     prefix,
-                    I, header_value);
-            loop_manage_retrieved_email(header_value, prefix);
-
-            if ((r = conn_round_trip(my_logf, &conn, "+OK", g_trace_network_traffic,
-                                     "DELE %d",
-                                     I)) == CONNRES_NETIO) {
-                MYFREE(header_value);
-                MYFREE(response);
-                return ERR_POP3_NETIO;
-            } else if (r == CONNRES_UNEXPECTED_ANSWER) {
-                my_logf(LL_ERROR, LP_DATETIME,
-                        "%s cannot delete email %d of reference '%s'",
-                        prefix, I, header_value);
-            } else if (r == CONNRES_OK) {
-                my_logf(LL_VERBOSE, LP_DATETIME, "%s deleted email %d of reference '%s'",
-                        prefix, I, header_value);
-            } else {
-                assert(FALSE);
-            }
+                    msgs[i].num, header_value);
+            loop_manage_retrieved_email(chk, header_value, prefix);
+            msgs[i].state = PM_MINE;
+            msgs[i].ref = header_value;
         } else {
             my_logf(LL_DEBUG, LP_DATETIME,
-                    "%s Email %d of reference '%s' is not mine, ignoring", prefix, I,
-                    header_value);
+                    "%s Email %d of reference '%s' is not mine, ignoring", prefix,
+                    msgs[i].num, header_value);
+            msgs[i].state = PM_NOT_MINE;
+            if (header_value != NULL)
+                MYFREE(header_value);
         }
-        if (header_value != NULL)
-            MYFREE(header_value);
     }
-
-    MYFREE(response);
-
-    conn_line_sendf(my_logf, &conn, g_trace_network_traffic, "QUIT");
-    my_logf(LL_DEBUG, LP_DATETIME, "%s closing POP3 connection", prefix);
-    conn_close(&conn);
-
     return ERR_POP3_OK;
 }
 
 //
+// Retrieve probe emails from the POP3 mailbox.
+// When the server supports UIDL, the UIDs of emails that are not ours are
+// remembered, so that next time, only new emails are fetched.
 //
-//
-int perform_check_loop(struct check_t *chk, const struct subst_t *subst,
-                       int subst_len) {
-    char prefix[SMALLSTRSIZE];
-    snprintf(prefix, sizeof(prefix), "Loop check(%s):", chk->display_name);
+int loop_receive_emails(struct check_t *chk,
+                        const struct subst_t *subst, int subst_len, const char *prefix) {
+    UNUSED(subst);
+    UNUSED(subst_len);
 
-// 1. Send & received probe emails
+    my_logf(LL_VERBOSE, LP_DATETIME, "%s retrieving probe email(s)", prefix);
 
-    int r = ST_OK;
-#ifdef DEBUG_LOOP
-    if (loop_count % 2 == 0) {
-        loop_receive_emails(chk, subst, subst_len, prefix);
-        r = loop_send_email(chk, subst, subst_len, prefix);
-    } else {
-#endif
+    const struct pop3_account_t *pop3 = &chk->loop_pop3;
 
-// loop send & receive emails -> production code below
+    if (g_test_mode != 0)
+        return ERR_POP3_OK;
 
-        if (--chk->loop_send_countdown <= 0) {
-            r = loop_send_email(chk, subst, subst_len, prefix);
-            chk->loop_send_countdown = (int)(chk->loop_send_every_set ?
-                                             chk->loop_send_every : DEFAULT_LOOP_SEND_EVERY);
-        } else {
-            my_logf(LL_VERBOSE, LP_DATETIME,
-                    "%s skipping email sending, countdown = %d",
-                    prefix, chk->loop_send_countdown);
-            r = chk->status;
-        }
-        loop_receive_emails(chk, subst, subst_len, prefix);
+    connection_t conn;
 
-// loop send & receive emails -> production code above
+    int r;
 
-#ifdef DEBUG_LOOP
-    }
-#endif
+    int cr = conn_establish_connection(&conn, &pop3->srv, DEFAULT_POP3_PORT,
+                                       "+OK",
+                                       prefix, g_trace_network_traffic);
+    if (cr != CONNRES_OK)
+        return (cr == CONNRES_RESOLVE_ERROR ? ERR_POP3_RESOLVE_ERROR :
+                ERR_POP3_NETIO);
+
+    if ((r = conn_round_trip(my_logf, &conn, "+OK", g_trace_network_traffic,
+                             "USER %s",
+                             pop3->user)) != CONNRES_OK) {
+        if (r != CONNRES_NETIO) {
+            conn_line_sendf(my_logf, &conn, g_trace_network_traffic, "QUIT");
+            my_logf(LL_ERROR, LP_DATETIME, "%s user not accepted, closing connection",
+                    prefix);
+            conn_close(&conn);
+            return ERR_POP3_USER_REJECTED;
+        } else {
+            return ERR_POP3_NETIO;
+        }
+    }
+
+    if ((r = conn_round_trip(my_logf, &conn, "+OK", g_trace_network_traffic,
+                             "PASS %s",
+                             pop3->password)) != CONNRES_OK) {
+        if (r != CONNRES_NETIO) {
+            conn_line_sendf(my_logf, &conn, g_trace_network_traffic, "QUIT");
+            my_logf(LL_ERROR, LP_DATETIME, "%s user not accepted, closing connection",
+                    prefix);
+            conn_close(&conn);
+            return ERR_POP3_PASSWORD_REJECTED;
+        } else {
+            return ERR_POP3_NETIO;
+        }
+    }
+
+    // Capabilities (RFC 2449), a server not supporting CAPA answers -ERR
+    int pipelining = FALSE;
+    if ((r = conn_round_trip(my_logf, &conn, "+OK", g_trace_network_traffic,
+                             "CAPA")) == CONNRES_NETIO) {
+        return ERR_POP3_NETIO;
+    } else if (r == CONNRES_OK
+               && pop3_read_multiline(&conn, pop3_capa_line,
+                                      &pipelining) != CONNRES_OK) {
+        return ERR_POP3_NETIO;
+    }
+
+    struct pop3_uidl_t u;
+    u.msgs = NULL;
+    u.nb = 0;
+    u.nb_alloc = 0;
+    if ((r = conn_round_trip(my_logf, &conn, "+OK", g_trace_network_traffic,
+                             "UIDL")) == CONNRES_NETIO) {
+        return ERR_POP3_NETIO;
+    } else if (r == CONNRES_OK) {
+        if (pop3_read_multiline(&conn, pop3_uidl_line, &u) != CONNRES_OK) {
+            pop3_msgs_destroy(u.msgs, u.nb);
+            return ERR_POP3_NETIO;
+        }
+    } else {
+        my_logf(LL_DEBUG, LP_DATETIME,
+                "%s UIDL not supported, all emails will be fetched", prefix);
+        int N;
+        if ((r = pop3_stat(&conn, prefix, &N)) != ERR_POP3_OK)
+            return r;
+        if (N >= 1) {
+            u.msgs = (struct pop3_msg_t *)MYMALLOC(sizeof(struct pop3_msg_t) *
+                                                   (size_t)N, u.msgs);
+        }
+        for (u.nb = 0; u.nb < N; ++u.nb) {
+            u.msgs[u.nb].num = u.nb + 1;
+            u.msgs[u.nb].state = PM_TO_FETCH;
+            u.msgs[u.nb].id.uid[0] = '\0';
+            u.msgs[u.nb].ref = NULL;
+        }
+    }
+
+    int nb_known = 0;
+    int i;
+    for (i = 0; i < u.nb; ++i) {
+        if (u.msgs[i].id.uid[0] != '\0' && chk->loop_nb_uids >= 1
+                && bsearch(&u.msgs[i].id, chk->loop_uids, (size_t)chk->loop_nb_uids,
+                           sizeof(struct pop3_uid_t), pop3_uid_cmp) != NULL) {
+            u.msgs[i].state = PM_KNOWN;
+            ++nb_known;
+        }
+    }
+
+    my_logf(LL_DEBUG, LP_DATETIME,
+            "%s number of emails: %d, already known: %d, pipelining: %s", prefix,
+            u.nb, nb_known, pipelining ? "yes" : "no");
+
+    time_t ltime = time(NULL);
+    char refex[LOOP_REF_SIZE];
+    build_email_ref(chk, ltime, refex, sizeof(refex));
+
+    if ((r = pop3_fetch_headers(chk, &conn, prefix, refex, u.msgs, u.nb,
+                                pipelining)) != ERR_POP3_OK) {
+        pop3_msgs_destroy(u.msgs, u.nb);
+        return r;
+    }
+
+    for (i = 0; i < u.nb; ++i) {
+        if (u.msgs[i].state != PM_MINE)
+            continue;
+        if ((r = conn_round_trip(my_logf, &conn, "+OK", g_trace_network_traffic,
+                                 "DELE %d",
+                                 u.msgs[i].num)) == CONNRES_NETIO) {
+            pop3_msgs_destroy(u.msgs, u.nb);
+            return ERR_POP3_NETIO;
+        } else if (r == CONNRES_UNEXPECTED_ANSWER) {
+            my_logf(LL_ERROR, LP_DATETIME,
+                    "%s cannot delete email %d of reference '%s'",
+                    prefix, u.msgs[i].num, u.msgs[i].ref);
+        } else if (r == CONNRES_OK) {
+            my_logf(LL_VERBOSE, LP_DATETIME, "%s deleted email %d of reference '%s'",
+                    prefix, u.msgs[i].num, u.msgs[i].ref);
+        } else {
+            assert(FALSE);
+        }
+    }
+
+    // Remember the emails that are not ours and still in the mailbox.
+    // Emails that could not be analyzed are not, to try them again next time.
+    int nb_uids = 0;
+    for (i = 0; i < u.nb; ++i) {
+        if (u.msgs[i].id.uid[0] != '\0'
+                && (u.msgs[i].state == PM_KNOWN || u.msgs[i].state == PM_NOT_MINE))
+            ++nb_uids;
+    }
+    if (chk->loop_uids != NULL)
+        MYFREE(chk->loop_uids);
+    chk->loop_uids = NULL;
+    chk->loop_nb_uids = 0;
+    if (nb_uids >= 1) {
+        chk->loop_uids = (struct pop3_uid_t *)MYMALLOC(sizeof(struct pop3_uid_t) *
+                         (size_t)nb_uids, chk->loop_uids);
+        for (i = 0; i < u.nb; ++i) {
+            if (u.msgs[i].id.uid[0] != '\0'
+                    && (u.msgs[i].state == PM_KNOWN || u.msgs[i].state == PM_NOT_MINE))
+                chk->loop_uids[chk->loop_nb_uids++] = u.msgs[i].id;
+        }
+        qsort(chk->loop_uids, (size_t)chk->loop_nb_uids, sizeof(struct pop3_uid_t),
+              pop3_uid_cmp);
+    }
+
+    pop3_msgs_destroy(u.msgs, u.nb);
+
+    conn_line_sendf(my_logf, &conn, g_trace_network_traffic, "QUIT");
+    my_logf(LL_DEBUG, LP_DATETIME, "%s closing POP3 connection", prefix);
+    conn_close(&conn);
+
+    return ERR_POP3_OK;
+}
+
+//
+//
+//
+int perform_check_loop(struct check_t *chk, const struct subst_t *subst,
+                       int subst_len) {
+    char prefix[SMALLSTRSIZE];
+    snprintf(prefix, sizeof(prefix), "Loop check(%s):", chk->display_name);
+
+// 1. Send & received probe emails
+
+    int r = ST_OK;
+#ifdef DEBUG_LOOP
+    if (loop_count % 2 == 0) {
+        loop_receive_emails(chk, subst, subst_len, prefix);
+        r = loop_send_email(chk, subst, subst_len, prefix);
+    } else {
+#endif
+
+// loop send & receive emails -> production code below
+
+        if (--chk->loop_send_countdown <= 0) {
+            r = loop_send_email(chk, subst, subst_len, prefix);
+            chk->loop_send_countdown = (int)(chk->loop_send_every_set ?
+                                             chk->loop_send_every : DEFAULT_LOOP_SEND_EVERY);
+        } else {
+            my_logf(LL_VERBOSE, LP_DATETIME,
+                    "%s skipping email sending, countdown = %d",
+                    prefix, chk->loop_send_countdown);
+            r = check_state_of(chk)->status;
+        }
+        loop_receive_emails(chk, subst, subst_len, prefix);
+
+// loop send & receive emails -> production code above
+
+#ifdef DEBUG_LOOP
+    }
+#endif
 
     if (g_test_mode == 3)
         os_sleep(1);
 
-// 2. Remove entries beyond timeout
+// 2. Remove entries beyond timeout, then, from the oldest ones, entries
+//    that are "received" (email went back)
 
+    struct loop_ring_t *ring = &chk->loop_ring;
     time_t ltime = time(NULL);
     signed long int timeout = chk->loop_fail_timeout_set ?
                               chk->loop_fail_timeout :
                               DEFAULT_LOOP_FAIL_TIMEOUT;
-    int i;
-    for (i = first_loop; i <= last_loop; ++i) {
-        if (loops[i].status != LE_NONE) {
+    while (ring->nb >= 1) {
+        struct loop_t *le = loop_ring_get(ring, 0);
+        if (le->status == LE_SENT) {
             signed long int age =  (signed long int)ltime - (signed long int)
-                                   loops[i].sent_time;
+                                   le->sent_time;
 
             dbg_write("age = %li, timeout = %li\n", age, timeout);
 
             if (age < timeout)
-                // Entries are created in chronological order, if one is below timeout,
+                // Entries are in chronological order, if one is below timeout,
                 // next ones will be, too -> no need to continue
                 break;
+            // The email is numbered among the ones lost in a row
             if (g_test_mode) {
                 my_logf(LL_VERBOSE, LP_DATETIME,
                         "%s removing loop email %d of reference '%s' "
                         "(run to timeout), age = %li > timeout = %li",
-                        prefix, i,
+                        prefix, ring->nb_lost,
                         "netmon:MYLOOP:1371397278-137861-187807:netmon",
                         age, timeout);
             } else {
                 my_logf(LL_VERBOSE, LP_DATETIME,
                         "%s removing loop email %d of reference '%s' "
                         "(run to timeout), age = %li > timeout = %li",
-                        prefix, i,
-                        "netmon:MYLOOP:1371397278-137861-187807:netmon",
-                        age, timeout);
+                        prefix, ring->nb_lost, le->loop_ref, age, timeout);
             }
-            loops[i].status = LE_NONE;
         }
-    }
-
-// 3. Cleaning list: first entries that are "received" (email went back)
-//      or "none" (timeout) are to be deleted.
-
-    while (first_loop <= last_loop && loops[first_loop].status != LE_SENT)
-        ++first_loop;
-    if (first_loop > last_loop) {
-        dbg_write("No more email in the list, restarting from zero\n");
-        first_loop = 0;
-        last_loop = -1;
+        loop_ring_pop(ring);
     }
 
 #ifdef DEBUG_LOOP
     dbg_write("------\n");
-    for (i = first_loop; i <= last_loop; ++i) {
+    int i;
+    for (i = 0; i < ring->nb; ++i) {
+        struct loop_t *le = loop_ring_get(ring, i);
         char sent[STR_NOW] = "n/a";
         char received[STR_NOW] = "n/a";
-        if (loops[i].status == LE_SENT || loops[i].status == LE_RECEIVED) {
-            struct tm t_sent = *localtime(&loops[i].sent_time);
-            get_str_now(sent, sizeof(sent), &t_sent);
-        }
-        if (loops[i].status == LE_RECEIVED) {
-            struct tm t_received = *localtime(&loops[i].received_time);
+        struct tm t_sent = *localtime(&le->sent_time);
+        get_str_now(sent, sizeof(sent), &t_sent);
+        if (le->status == LE_RECEIVED) {
+            struct tm t_received = *localtime(&le->received_time);
             get_str_now(received, sizeof(received), &t_received);
         }
-        dbg_write("#%05d - %-10s    %-16s %-16s %s\n", i,
-                  LE_NAMES[loops[i].status],
-                  sent, received, loops[i].loop_ref);
+        dbg_write("#%05d - %-10s    %-16s %-16s %s\n",
+                  (ring->first + i) & (ring->size - 1), LE_NAMES[le->status],
+                  sent, received, le->loop_ref);
     }
     dbg_write("------\n");
-    dbg_write("first_loop = %d, last_loop = %d, loops_nb_alloc = %d, loops = %lu\n",
-              first_loop, last_loop, loops_nb_alloc, (long unsigned int)loops);
+    dbg_write("first = %d, nb = %d, nb_sent = %d, size = %d\n",
+              ring->first, ring->nb, ring->nb_sent, ring->size);
     dbg_write("------\n");
 #endif
 
-// 4. Optimize memory: when first_loop becomes too big, move elements
-
-    if (first_loop >= LOOP_TRIGGER_OPTIMIZE_ARRAY) {
-        for (i = first_loop; i <= last_loop; ++i)
-            loops[i - first_loop] = loops[i];
-        last_loop -= first_loop;
-        first_loop = 0;
-    }
+// 3. Check whether there are entries beyond "delay" => fail condition
+//    The oldest entry, if any, is "sent" and is the first to reach it.
 
-// 5. Check whether there are entries beyond "delay" => fail condition
     signed long int delay = chk->loop_fail_delay_set ? chk->loop_fail_delay :
                             DEFAULT_LOOP_FAIL_DELAY;
-    for (i = first_loop; i <= last_loop; ++i) {
-        if (loops[i].status == LE_SENT) {
-            signed long int age =  (signed long int)ltime - (signed long int)
-                                   loops[i].sent_time;
-            if (age < timeout && age >= delay) {
-                r = ST_FAIL;
-                break;
-            }
-        }
+    if (ring->nb >= 1) {
+        signed long int age = (signed long int)ltime - (signed long int)
+                              loop_ring_get(ring, 0)->sent_time;
+        if (age >= delay)
+            r = ST_FAIL;
     }
+    int nb_pending = ring->nb_sent;
+    check_state_of(chk)->value = nb_pending;
 
     return r;
 }
@@ -1848,14 +3081,11 @@ void loop_count_to_str(char *lcstr, size_t lcstr_len) {
 //
 //
 //
-int perform_check(struct check_t *chk) {
-    my_logf(LL_VERBOSE, LP_DATETIME, "Performing check %s(%s)",
-            l_check_methods[chk->method], chk->display_name);
-
-    struct tm my_now;
-    set_current_tm(&my_now);
-
-    // NOW substitutions
+//
+// Substitutions available in the parameters of a check
+//
+#define CHECK_SUBST_NB 12
+struct check_subst_t {
     char now_ts[STR_LOG_TIMESTAMP];
     char now_date[30];
     char now_y[12];
@@ -1864,37 +3094,118 @@ int perform_check(struct check_t *chk) {
     char now_h[12];
     char now_mi[12];
     char now_s[12];
-    set_log_timestamp(now_ts, sizeof(now_ts), my_now.tm_year + 1900,
+    char lcstr[12];
+    struct subst_t subst[CHECK_SUBST_NB];
+};
+
+static void check_subst_fill(struct check_subst_t *cs,
+                             const struct check_t *chk) {
+    struct tm my_now;
+    set_current_tm(&my_now);
+
+    // NOW substitutions
+    set_log_timestamp(cs->now_ts, sizeof(cs->now_ts), my_now.tm_year + 1900,
                       my_now.tm_mon + 1, my_now.tm_mday,
                       my_now.tm_hour, my_now.tm_min, my_now.tm_sec, -1);
-    snprintf(now_date, sizeof(now_date), "%04d%02d%02d", my_now.tm_year + 1900,
-             my_now.tm_mon + 1, my_now.tm_mday);
-    snprintf(now_y, sizeof(now_y), "%04d", my_now.tm_year + 1900);
-    snprintf(now_m, sizeof(now_m), "%02d", my_now.tm_mon + 1);
-    snprintf(now_d, sizeof(now_d), "%02d", my_now.tm_mday);
-    snprintf(now_h, sizeof(now_h), "%02d", my_now.tm_hour);
-    snprintf(now_mi, sizeof(now_mi), "%02d", my_now.tm_min);
-    snprintf(now_s, sizeof(now_s), "%02d", my_now.tm_sec);
+    snprintf(cs->now_date, sizeof(cs->now_date), "%04d%02d%02d",
+             my_now.tm_year + 1900, my_now.tm_mon + 1, my_now.tm_mday);
+    snprintf(cs->now_y, sizeof(cs->now_y), "%04d", my_now.tm_year + 1900);
+    snprintf(cs->now_m, sizeof(cs->now_m), "%02d", my_now.tm_mon + 1);
+    snprintf(cs->now_d, sizeof(cs->now_d), "%02d", my_now.tm_mday);
+    snprintf(cs->now_h, sizeof(cs->now_h), "%02d", my_now.tm_hour);
+    snprintf(cs->now_mi, sizeof(cs->now_mi), "%02d", my_now.tm_min);
+    snprintf(cs->now_s, sizeof(cs->now_s), "%02d", my_now.tm_sec);
 
-    char lcstr[12];
-    loop_count_to_str(lcstr, sizeof(lcstr));
+    loop_count_to_str(cs->lcstr, sizeof(cs->lcstr));
 
     struct subst_t subst[] = {
         {"DISPLAY_NAME", chk->display_name},
         {"HOST_NAME", chk->srv.server},
-        {"NOW_TIMESTAMP", now_ts},
-        {"NOW_YMD", now_date},
-        {"NOW_YEAR", now_y},
-        {"NOW_MONTH", now_m},
-        {"NOW_DAY", now_d},
-        {"NOW_HOUR", now_h},
-        {"NOW_MINUTE", now_mi},
-        {"NOW_SECOND", now_s},
-        {"LOOP_COUNT", lcstr},
+        {"NOW_TIMESTAMP", cs->now_ts},
+        {"NOW_YMD", cs->now_date},
+        {"NOW_YEAR", cs->now_y},
+        {"NOW_MONTH", cs->now_m},
+        {"NOW_DAY", cs->now_d},
+        {"NOW_HOUR", cs->now_h},
+        {"NOW_MINUTE", cs->now_mi},
+        {"NOW_SECOND", cs->now_s},
+        {"LOOP_COUNT", cs->lcstr},
         {"TAB", "\t"}
     };
-    return check_func[chk->method](chk, subst, sizeof(subst) / sizeof(*subst));
+    assert(sizeof(subst) == sizeof(cs->subst));
+    memcpy(cs->subst, subst, sizeof(subst));
+}
+
+int perform_check(struct check_t *chk) {
+    my_logf(LL_VERBOSE, LP_DATETIME, "Performing check %s(%s)",
+            l_check_methods[chk->method], chk->display_name);
+
+    struct check_subst_t cs;
+    check_subst_fill(&cs, chk);
+
+    struct check_state_t *st = check_state_of(chk);
+    st->value = TS_VALUE_NONE;
+    chk->prg_output[0] = '\0';
+    long long int start = os_monotonic_ms();
+    int status = check_func[chk->method](chk, cs.subst, CHECK_SUBST_NB);
+    st->duration_ms = (int)(os_monotonic_ms() - start);
+    return status;
+}
+
+#ifdef MY_LINUX
+//
+// Perform all program checks due at the given dependency level, running
+// their commands at the same time (at most g_program_parallel at once).
+// statuses[i] is set for each check performed.
+//
+void perform_checks_program_parallel(int *statuses, const int level) {
+    prg_run_t *runs = (prg_run_t *)MYMALLOC(sizeof(prg_run_t) *
+                                            (unsigned long int)(g_nb_checks + 1), runs);
+    int *run_idx = (int *)MYMALLOC(sizeof(int) * (unsigned long int)(
+                                       g_nb_checks + 1), run_idx);
+    char **commands = (char **)MYMALLOC(sizeof(char *) * (unsigned long int)(
+                                            g_nb_checks + 1), commands);
+    int nb = 0;
+    int i;
+
+    for (i = 0; i < g_nb_checks; ++i) {
+        const struct check_state_t *st = &check_states[i];
+        if (!st->is_valid || !st->is_due || st->dep_level != level
+                || st->is_suppressed || statuses[i] != ST_UNDEF)
+            continue;
+        struct check_t *chk = &checks[i];
+        if (chk->method != CM_PROGRAM)
+            continue;
+
+        my_logf(LL_VERBOSE, LP_DATETIME, "Performing check %s(%s)",
+                l_check_methods[chk->method], chk->display_name);
+
+        struct check_subst_t cs;
+        check_subst_fill(&cs, chk);
+        commands[nb] = dollar_subst_alloc(chk->prg_command, cs.subst,
+                                          CHECK_SUBST_NB);
+        my_logf(LL_VERBOSE, LP_DATETIME,
+                "Program check(%s): will execute the command:",
+                chk->display_name);
+        my_logs(LL_VERBOSE, LP_INDENT, commands[nb]);
+        program_check_run_init(chk, &runs[nb], commands[nb]);
+        run_idx[nb++] = i;
+    }
+
+    prg_run_multi(runs, nb, (int)g_program_parallel);
+
+    for (i = 0; i < nb; ++i) {
+        struct check_t *chk = &checks[run_idx[i]];
+        statuses[run_idx[i]] = program_check_status(chk, &runs[i]);
+        check_states[run_idx[i]].duration_ms = runs[i].duration_ms;
+        MYFREE(commands[i]);
+    }
+
+    MYFREE(commands);
+    MYFREE(run_idx);
+    MYFREE(runs);
 }
+#endif
 
 //
 // Used by execute_alert_smtp
@@ -2044,9 +3355,22 @@ int execute_alert_program(const struct exec_alert_t *exec_alert) {
                                             exec_alert->subst_len);
     my_logf(LL_VERBOSE, LP_DATETIME, "%s will execute the command:", prefix);
     my_logs(LL_VERBOSE, LP_INDENT, s_substitued);
-    int r1 = system(s_substitued);
-    int r2 = os_wexitstatus(r1);
-    my_logf(LL_VERBOSE, LP_DATETIME, "%s return code: %i", prefix, r2);
+
+    prg_run_t *run = (prg_run_t *)MYMALLOC(sizeof(prg_run_t), run);
+    run->command = s_substitued;
+    run->timeout_ms = (alrt->prg_timeout_set ? alrt->prg_timeout :
+                       g_program_timeout) * 1000;
+    prg_run(run);
+    log_program_output(run->out);
+    log_program_output(run->err);
+    int r2 = run->exit_code;
+    if (run->timed_out)
+        my_logf(LL_ERROR, LP_DATETIME,
+                "%s timeout after %li second(s), process group killed", prefix,
+                run->timeout_ms / 1000);
+    else
+        my_logf(LL_VERBOSE, LP_DATETIME, "%s return code: %i", prefix, r2);
+    MYFREE(run);
     MYFREE(s_substitued);
     return r2;
 }
@@ -2204,10 +3528,114 @@ int execute_alert(struct exec_alert_t *exec_alert) {
     return alert_func[exec_alert->alrt->method](exec_alert);
 }
 
+//
+// Write s to the HTML page, escaping characters with a meaning in HTML
+//
+static void html_fputs(const char *s, FILE *H) {
+    for (; *s != '\0'; ++s) {
+        if (*s == '&')
+            fputs("&amp;", H);
+        else if (*s == '<')
+            fputs("&lt;", H);
+        else if (*s == '>')
+            fputs("&gt;", H);
+        else if (*s == '"')
+            fputs("&quot;", H);
+        else if (*s == '\'')
+            fputs("&#39;", H);
+        else
+            fputc(*s, H);
+    }
+}
+
+//
+// Write s as a JSON string
+//
+static void json_fputs(const char *s, FILE *F) {
+    fputc('"', F);
+    for (; *s != '\0'; ++s) {
+        if (*s == '"' || *s == '\\')
+            fprintf(F, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(F, "\\u%04x", (unsigned int)(unsigned char)*s);
+        else
+            fputc(*s, F);
+    }
+    fputc('"', F);
+}
+
+//
+// Write status and current metrics of checks in g_metrics_complete_file_name,
+// for programs to read what the HTML page displays. The file is written
+// under another name then renamed, so that it is never read half-written.
+//
+static void metrics_save() {
+    char tmp[BIGSTRSIZE + sizeof(STATE_TMP_EXT)];
+    snprintf(tmp, sizeof(tmp), "%s%s", g_metrics_complete_file_name,
+             STATE_TMP_EXT);
+
+    FILE *F = my_fopen(tmp, "w", 3, 1000);
+    if (F == NULL) {
+        my_logf(LL_ERROR, LP_DATETIME, "Unable to open metrics file %s", tmp);
+        return;
+    }
+    fprintf(F, "{\n  \"time\": %lli,\n  \"checks\": [", (long long int)time(NULL));
+    int nb = 0;
+    int i;
+    for (i = 0; i < g_nb_checks; ++i) {
+        const struct check_t *chk = &checks[i];
+        if (!chk->is_valid)
+            continue;
+        fputs(nb++ == 0 ? "\n    {\"name\": " : ",\n    {\"name\": ", F);
+        json_fputs(chk->display_name, F);
+        fprintf(F, ", \"status\": \"%s\", \"metrics\": [",
+                ST_TO_LONGSTR_SIMPLE[check_states[i].status]);
+        int nb_current = 0;
+        int j;
+        for (j = 0; j < chk->nb_metrics; ++j) {
+            const struct check_metric_t *m = &chk->metrics[j];
+            if (!m->is_current)
+                continue;
+            fputs(nb_current++ == 0 ? "{\"label\": " : ", {\"label\": ", F);
+            json_fputs(m->label, F);
+            // JSON has no infinity nor NaN
+            if (m->value == m->value && m->value - m->value == 0)
+                fprintf(F, ", \"value\": %.15g", m->value);
+            else
+                fputs(", \"value\": null", F);
+            fputs(", \"uom\": ", F);
+            json_fputs(m->uom, F);
+            fputs("}", F);
+        }
+        fputs("]}", F);
+    }
+    fputs(nb == 0 ? "]\n}\n" : "\n  ]\n}\n", F);
+
+    int ok = (fclose(F) == 0);
+    if (ok) {
+#ifdef MY_WINDOWS
+        // rename() does not replace an existing file under Windows
+        remove(g_metrics_complete_file_name);
+#endif
+        ok = (rename(tmp, g_metrics_complete_file_name) == 0);
+    }
+    if (!ok) {
+        char s_err[ERR_STR_BUFSIZE];
+        my_logf(LL_ERROR, LP_DATETIME, "Unable to write metrics file %s, %s",
+                g_metrics_complete_file_name, os_last_err_desc(s_err, sizeof(s_err)));
+        remove(tmp);
+        return;
+    }
+    add_reader_access_right(g_metrics_complete_file_name);
+}
+
 //
 // After checks, render result
 //
 void manage_output(const struct tm *now_done, float elapsed) {
+    long long int avg_drift = (g_sched_nb_rounds >= 1 ? g_sched_total_drift /
+                               g_sched_nb_rounds : 0);
+
     if (g_print_status) {
         const char *LC_PREFIX = "Last check: ";
         char now[STR_NOW];
@@ -2229,6 +3657,9 @@ void manage_output(const struct tm *now_done, float elapsed) {
             printf(", range = %li min",
                    (g_check_interval * g_nb_keep_last_status) / 60);
         printf("\n");
+        printf("    Drift last/avg/max = %lli/%lli/%lli ms, overruns = %li (%li skipped)\n",
+               g_sched_last_drift, avg_drift, g_sched_max_drift,
+               g_sched_nb_overruns, g_sched_nb_skipped);
         printf("    . = ok, X = fail, ? = unknown, <space> = undefined\n");
     }
 
@@ -2302,6 +3733,11 @@ void manage_output(const struct tm *now_done, float elapsed) {
                     g_check_interval, g_check_interval >= 2 ? "s" : "",
                     (g_check_interval * g_nb_keep_last_status) / 60);
         }
+        fprintf(H,
+                "Scheduling drift (last / average / max) = %lli / %lli / %lli ms, overruns = %li (%li execution%s skipped)<br>\n",
+                g_sched_last_drift, avg_drift, g_sched_max_drift,
+                g_sched_nb_overruns, g_sched_nb_skipped,
+                g_sched_nb_skipped >= 2 ? "s" : "");
         fputs("</p>", H);
         fputs("<table cellpadding=\"2\" cellspacing=\"1\" border=\"1\">\n", H);
         fputs("<tr>\n", H);
@@ -2315,12 +3751,21 @@ void manage_output(const struct tm *now_done, float elapsed) {
         fputs("</tr>\n", H);
     }
 
+    // History of a check, as displayed in the terminal
+    char *str_hist = NULL;
+    if (g_print_status && g_nb_keep_last_status >= 1) {
+        str_hist = (char *)MYMALLOC((unsigned long int)g_nb_keep_last_status + 1,
+                                    str_hist);
+        str_hist[g_nb_keep_last_status] = '\0';
+    }
+
     int counter = 0;
     int II;
     for (II = 0; II < g_nb_checks; ++II) {
         struct check_t *chk = &checks[II];
         if (!chk->is_valid)
             continue;
+        const struct check_state_t *st = &check_states[II];
 
         char lsc[STR_LASTSTATUS_CHANGE];
         strncpy(lsc, "", sizeof(lsc));
@@ -2337,35 +3782,47 @@ void manage_output(const struct tm *now_done, float elapsed) {
             if (g_nb_keep_last_status >= 1) {
                 snprintf(f, sizeof(f), "%%-%lis %%s |%%s| %%s\n",
                          g_display_name_width);
-                printf(f, short_display_name, ST_TO_STR2[chk->status],
-                       chk->str_prev_status,
+                int i;
+                for (i = 0; i < g_nb_keep_last_status; ++i)
+                    str_hist[i] = ST_TO_CHAR[status_hist_get(&chk->hist, i)];
+                printf(f, short_display_name, ST_TO_STR2[st->status], str_hist,
                        lsc);
             } else {
                 snprintf(f, sizeof(f), "%%-%lis %%s %%s\n", g_display_name_width);
-                printf(f, short_display_name, ST_TO_STR2[chk->status], lsc);
+                printf(f, short_display_name, ST_TO_STR2[st->status], lsc);
             }
         }
 
         if (H != NULL) {
             if (counter % g_html_nb_columns == 0)
                 fputs("<tr>\n", H);
-            fprintf(H, "<td>%s</td><td style=\"background-color:%s\";text-align:center>%s</td>\n",
-                    chk->display_name, ST_TO_BGCOLOR_FORHTML[chk->status],
-                    ST_TO_LONGSTR_SIMPLE[chk->status]);
+            fprintf(H, "<td>%s", chk->display_name);
+            int i;
+            int nb_current = 0;
+            for (i = 0; i < chk->nb_metrics; ++i) {
+                const struct check_metric_t *m = &chk->metrics[i];
+                if (!m->is_current)
+                    continue;
+                // Labels and units come from the output of the check
+                fputs(nb_current == 0 ?
+                      "<br><span style=\"color:#666; font-size:smaller\">" : " ",
+                      H);
+                html_fputs(m->label, H);
+                fprintf(H, "=%g", m->value);
+                html_fputs(m->uom, H);
+                ++nb_current;
+            }
+            if (nb_current >= 1)
+                fputs("</span>", H);
+            fprintf(H, "</td><td style=\"background-color:%s\";text-align:center>%s</td>\n",
+                    ST_TO_BGCOLOR_FORHTML[st->status],
+                    ST_TO_LONGSTR_SIMPLE[st->status]);
             fprintf(H, "<td style=\"text-align:center\">%s</td>", lsc);
             if (g_nb_keep_last_status >= 1) {
                 fputs("<td>", H);
-                int i;
                 for (i = 0; i < g_nb_keep_last_status; ++i) {
-                    char c = chk->str_prev_status[i];
-                    int j;
-                    for (j = 0; j <= _ST_LAST; ++j) {
-                        if (ST_TO_CHAR[j] == c)
-                            break;
-                    }
-                    if (j > _ST_LAST)
-                        j = ST_UNKNOWN;
-                    fprintf(H, "<img src=\"%s\">\n", img_files[j].file_name);
+                    fprintf(H, "<img src=\"%s\">\n",
+                            img_files[status_hist_get(&chk->hist, i)].file_name);
                 }
                 fprintf(H, "</td>\n");
             }
@@ -2384,6 +3841,8 @@ void manage_output(const struct tm *now_done, float elapsed) {
         }
         ++counter;
     }
+    if (str_hist != NULL)
+        MYFREE(str_hist);
 
     if (H != NULL) {
         fputs("</table>\n", H);
@@ -2397,6 +3856,13 @@ void manage_output(const struct tm *now_done, float elapsed) {
         fprintf(H, "<td>"
                    "<a href=\"" URL_MAN_EN "\" target=\"_blank\">"
                    "manual (english)</a></td>\n");
+#ifdef MY_LINUX
+        if (g_run_now_fd >= 0) {
+            fprintf(H, "<td>"
+                       "<a href=\"" URL_RUN_NOW "\">"
+                       "do checks now</a></td>\n");
+        }
+#endif
         fprintf(H, "</tr></table>\n");
         fputs("</body>\n", H);
         fputs("</html>\n", H);
@@ -2404,285 +3870,1959 @@ void manage_output(const struct tm *now_done, float elapsed) {
         add_reader_access_right(g_html_complete_file_name);
     }
 
+    if (g_test_mode == 0)
+        metrics_save();
 }
 
 //
-// Main loop
+// Scheduler
+//
+// Checks are kept in a binary min-heap ordered by due time, then by position
+// in the ini file, so that checks due at the same time are performed in the
+// order they are defined. Times are in milliseconds of the monotonic clock,
+// and due times are absolute (next due = previous due + interval), so that
+// wall clock changes don't disturb scheduling and rounds don't drift.
 //
-void almost_neverending_loop() {
 
-    if (g_test_mode == 3) {
-        my_logf(LL_DEBUG, LP_DATETIME,
-                "Test mode 3: waiting to be at the middle of a second elapse to start");
-        int wday;
-        int year;
-        int month;
-        int day;
-        int hour;
-        int minute;
-        int second;
-        long int usec;
-        long int gmtoff;
-        while (usec >= 500000)
-            get_datetime_of_day(&wday, &year, &month, &day, &hour, &minute, &second,
-                                &usec,
-                                &gmtoff);
-        while (usec < 500000)
-            get_datetime_of_day(&wday, &year, &month, &day, &hour, &minute, &second,
-                                &usec,
-                                &gmtoff);
-    }
+int *sched_heap = NULL;
+int sched_heap_len = 0;
+// In test mode, time does not elapse while sleeping: it jumps to the next
+// due time instead, so that tests run fast and reproducibly.
+long long int sched_virtual_now = 0;
+
+static long long int sched_now() {
+    if (g_test_mode >= 1)
+        return sched_virtual_now;
+    return os_monotonic_ms();
+}
+
+//
+// Interval of a check, in seconds
+//
+static long int check_get_interval(const struct check_t *chk) {
+    return chk->interval_set ? chk->interval : g_check_interval;
+}
+
+static int sched_is_before(const int a, const int b) {
+    if (check_states[a].next_due != check_states[b].next_due)
+        return check_states[a].next_due < check_states[b].next_due;
+    return a < b;
+}
+
+static void sched_push(const int idx) {
+    int i = sched_heap_len++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!sched_is_before(idx, sched_heap[parent]))
+            break;
+        sched_heap[i] = sched_heap[parent];
+        i = parent;
+    }
+    sched_heap[i] = idx;
+}
+
+static int sched_pop() {
+    assert(sched_heap_len >= 1);
+
+    int top = sched_heap[0];
+    int last = sched_heap[--sched_heap_len];
+    int i = 0;
+    int child;
+    while ((child = 2 * i + 1) < sched_heap_len) {
+        if (child + 1 < sched_heap_len
+                && sched_is_before(sched_heap[child + 1], sched_heap[child]))
+            ++child;
+        if (!sched_is_before(sched_heap[child], last))
+            break;
+        sched_heap[i] = sched_heap[child];
+        i = child;
+    }
+    if (sched_heap_len >= 1)
+        sched_heap[i] = last;
+    return top;
+}
+
+//
+// All valid checks are due at startup
+//
+void sched_init() {
+    sched_heap = (int *)MYMALLOC(sizeof(int) * (unsigned long int)(
+                                     g_nb_checks + 1), sched_heap);
+    sched_heap_len = 0;
+
+    long long int now = sched_now();
+    int i;
+    for (i = 0; i < g_nb_checks; ++i) {
+        if (!check_states[i].is_valid)
+            continue;
+        check_states[i].next_due = now;
+        sched_push(i);
+    }
+}
+
+//
+// Set next due time of a check that has just been done
+//
+static void sched_set_next_due(struct check_t *chk, const long long int now) {
+    struct check_state_t *st = check_state_of(chk);
+    long long int interval = (long long int)check_get_interval(chk) * 1000;
+    if (interval <= 0) {
+        st->next_due = now;
+        return;
+    }
+
+    st->next_due += interval;
+    if (st->next_due >= now)
+        return;
+
+    // Missed its slot: it'll be done right away, skipping slots that are
+    // entirely in the past to keep the cadence.
+    long int skipped = 0;
+    while (st->next_due + interval <= now) {
+        st->next_due += interval;
+        ++skipped;
+    }
+    ++g_sched_nb_overruns;
+    g_sched_nb_skipped += skipped;
+    my_logf(LL_WARNING, LP_DATETIME,
+            "Check %s overran its interval (%li s), %li execution(s) skipped",
+            chk->display_name, check_get_interval(chk), skipped);
+}
+
+//
+// Record the drift of a round that starts now, while it was due at 'due'
+//
+static void sched_record_drift(const long long int due,
+                               const long long int now) {
+    long long int drift = (now > due ? now - due : 0);
+    ++g_sched_nb_rounds;
+    g_sched_last_drift = drift;
+    g_sched_total_drift += drift;
+    if (drift > g_sched_max_drift)
+        g_sched_max_drift = drift;
+}
+
+//
+// Make all checks due now
+//
+static void sched_all_due_now(const long long int now) {
+    sched_heap_len = 0;
+    int i;
+    for (i = 0; i < g_nb_checks; ++i) {
+        if (!check_states[i].is_valid)
+            continue;
+        check_states[i].next_due = now;
+        sched_push(i);
+    }
+}
+
+#ifdef MY_LINUX
+
+//
+// Create file descriptors used to wait. To be called before the web server
+// is forked, as it inherits g_run_now_fd.
+//
+void sched_wait_init() {
+    char s_err[ERR_STR_BUFSIZE];
+
+    if ((g_run_now_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        my_logf(LL_ERROR, LP_DATETIME, "eventfd() error, %s",
+                os_last_err_desc(s_err, sizeof(s_err)));
+
+    if ((g_wait_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                          TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        my_logf(LL_ERROR, LP_DATETIME, "timerfd_create() error, %s",
+                os_last_err_desc(s_err, sizeof(s_err)));
+
+    sigemptyset(&g_wait_sigmask);
+    sigaddset(&g_wait_sigmask, SIGTERM);
+    sigaddset(&g_wait_sigmask, SIGINT);
+    sigaddset(&g_wait_sigmask, SIGHUP);
+    sigaddset(&g_wait_sigmask, SIGUSR1);
+    if ((g_wait_signal_fd = signalfd(-1, &g_wait_sigmask,
+                                     SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        my_logf(LL_ERROR, LP_DATETIME, "signalfd() error, %s",
+                os_last_err_desc(s_err, sizeof(s_err)));
+}
+
+void sched_wait_destroy() {
+    if (g_wait_timer_fd >= 0)
+        close(g_wait_timer_fd);
+    if (g_wait_signal_fd >= 0)
+        close(g_wait_signal_fd);
+    if (g_run_now_fd >= 0)
+        close(g_run_now_fd);
+    g_wait_timer_fd = -1;
+    g_wait_signal_fd = -1;
+    g_run_now_fd = -1;
+}
+
+//
+// Ask the main loop to do all checks now. Can be called from a child process
+// (web server).
+// Return 0 if OK, -1 if error.
+//
+int sched_request_run_now() {
+    uint64_t one = 1;
+    if (g_run_now_fd < 0)
+        return -1;
+    if (write(g_run_now_fd, &one, sizeof(one)) != sizeof(one))
+        return -1;
+    return 0;
+}
+
+//
+// Wait until due time (monotonic clock, in milliseconds), unless a signal or
+// a run now request comes first.
+// Signals are blocked only during the wait, so that they are received
+// through g_wait_signal_fd. The rest of the time, they are managed by regular
+// signal handlers.
+//
+static void sched_wait(const long long int due) {
+    sigset_t prev_sigmask;
+    sigprocmask(SIG_BLOCK, &g_wait_sigmask, &prev_sigmask);
+
+    if (!run_now_requested && !reload_requested) {
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = (time_t)(due / 1000);
+        its.it_value.tv_nsec = (long int)(due % 1000) * 1000000;
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+            its.it_value.tv_nsec = 1;
+        timerfd_settime(g_wait_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+
+        struct pollfd fds[3];
+        fds[0].fd = g_wait_timer_fd;
+        fds[1].fd = g_wait_signal_fd;
+        fds[2].fd = g_run_now_fd;
+        int i;
+        for (i = 0; i < 3; ++i) {
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        if (poll(fds, 3, -1) >= 1) {
+            uint64_t u;
+            if (fds[0].revents & POLLIN) {
+                // Only drain the timer expiration counter
+                ssize_t r = read(g_wait_timer_fd, &u, sizeof(u));
+                UNUSED(r);
+            }
+            if (fds[2].revents & POLLIN) {
+                if (read(g_run_now_fd, &u, sizeof(u)) == sizeof(u))
+                    run_now_requested = TRUE;
+            }
+            struct signalfd_siginfo si;
+            while ((fds[1].revents & POLLIN)
+                    && read(g_wait_signal_fd, &si, sizeof(si)) == sizeof(si)) {
+                int sig = (int)si.ssi_signo;
+                if (sig == SIGTERM || sig == SIGINT) {
+                    sigprocmask(SIG_SETMASK, &prev_sigmask, NULL);
+                    raise(sig);
+                } else if (sig == SIGHUP) {
+                    reload_requested = TRUE;
+                } else {
+                    run_now_requested = TRUE;
+                }
+            }
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &prev_sigmask, NULL);
+}
+
+#endif
+
+void sched_destroy() {
+    if (sched_heap != NULL) {
+        MYFREE(sched_heap);
+        sched_heap = NULL;
+    }
+    sched_heap_len = 0;
+}
+
+//
+// Rebuild the heap once checks[] has been replaced (configuration reload),
+// keeping next due times.
+//
+static void sched_reload() {
+    sched_destroy();
+    sched_heap = (int *)MYMALLOC(sizeof(int) * (unsigned long int)(
+                                     g_nb_checks + 1), sched_heap);
+    int i;
+    for (i = 0; i < g_nb_checks; ++i) {
+        if (check_states[i].is_valid)
+            sched_push(i);
+    }
+}
+
+#ifdef MY_LINUX
+
+//
+// Worker processes
+//
+// When check_workers is 2 or more, checks are performed by child processes,
+// at most g_check_workers at a time. Each child performs one check and
+// writes the resulting status in a pipe. The parent process then records
+// statuses (and triggers alerts) in checks[] order, as if checks had been
+// performed one after the other.
+//
+
+struct worker_t {
+    pid_t pid;
+    int fd;
+    int idx;
+};
+
+// Sent by a worker through its pipe
+struct worker_result_t {
+    int status;
+    int duration_ms;
+    int value;
+    // Lookups done by the check, the cache of the worker is lost with it
+    unsigned long int dns_hits;
+    unsigned long int dns_misses;
+    // SSL handshakes done by the check
+    unsigned long int ssl_full;
+    unsigned long int ssl_resumed;
+    char output[CHECK_OUTPUT_SIZE];
+};
+
+//
+// Loop checks keep track of sent emails in the memory of the main process,
+// and plugin checks keep there the state of their plugin, therefore they
+// cannot be performed by a worker.
+//
+static int check_can_use_worker(const struct check_t *chk) {
+    return chk->method != CM_LOOP && chk->method != CM_PLUGIN;
+}
+
+//
+// Code executed by the child process
+//
+static void worker_run(struct check_t *chk, int fd) {
+    struct worker_result_t res;
+    unsigned long int hits0;
+    unsigned long int misses0;
+    unsigned long int full0;
+    unsigned long int resumed0;
+    int nb_names;
+    dns_get_stats(&hits0, &misses0, &nb_names);
+    ssl_get_stats(&full0, &resumed0);
+    res.status = perform_check(chk);
+    res.duration_ms = check_state_of(chk)->duration_ms;
+    res.value = check_state_of(chk)->value;
+    dns_get_stats(&res.dns_hits, &res.dns_misses, &nb_names);
+    res.dns_hits -= hits0;
+    res.dns_misses -= misses0;
+    ssl_get_stats(&res.ssl_full, &res.ssl_resumed);
+    res.ssl_full -= full0;
+    res.ssl_resumed -= resumed0;
+    strncpy(res.output, chk->prg_output, sizeof(res.output));
+    if (write(fd, &res, sizeof(res)) != sizeof(res))
+        my_logf(LL_ERROR, LP_DATETIME, "Check '%s': unable to write status to pipe",
+                chk->display_name);
+    close(fd);
+    fflush(NULL);
+    _exit(EXIT_SUCCESS);
+}
+
+//
+// Read the status sent by a worker and wait for its termination
+//
+static void worker_collect(const struct worker_t *w, int *statuses) {
+    struct worker_result_t res;
+    ssize_t n;
+    do {
+        n = read(w->fd, &res, sizeof(res));
+    } while (n < 0 && errno == EINTR);
+
+    struct check_state_t *st = &check_states[w->idx];
+    if (n != sizeof(res) || res.status < 0 || res.status > _ST_LAST) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "Check '%s': no status received from worker process (pid %lu)",
+                checks[w->idx].display_name, (long unsigned)w->pid);
+        res.status = ST_UNKNOWN;
+        res.duration_ms = 0;
+        res.value = TS_VALUE_NONE;
+        res.dns_hits = 0;
+        res.dns_misses = 0;
+        res.ssl_full = 0;
+        res.ssl_resumed = 0;
+        res.output[0] = '\0';
+    }
+    statuses[w->idx] = res.status;
+    dns_add_stats(res.dns_hits, res.dns_misses);
+    ssl_add_stats(res.ssl_full, res.ssl_resumed);
+    st->duration_ms = res.duration_ms;
+    st->value = res.value;
+    strncpy(checks[w->idx].prg_output, res.output,
+            sizeof(checks[w->idx].prg_output));
+    checks[w->idx].prg_output[sizeof(checks[w->idx].prg_output) - 1] = '\0';
+
+    close(w->fd);
+    while (waitpid(w->pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+}
+
+//
+// Perform the checks of a given dependency level that can be performed by a
+// worker. Status of check number i is stored in statuses[i], checks for
+// which statuses[i] is not ST_UNDEF are considered already done.
+//
+void perform_checks_with_workers(int *statuses, const int level) {
+    struct worker_t workers[MAX_CHECK_WORKERS];
+    int nb_running = 0;
+    int next = 0;
+    int i;
+
+    while (TRUE) {
+        while (nb_running < g_check_workers && next < g_nb_checks
+                && !service_stop_requested) {
+            int idx = next++;
+            const struct check_state_t *st = &check_states[idx];
+            if (!st->is_valid || !st->is_due || st->dep_level != level
+                    || st->is_suppressed || statuses[idx] != ST_UNDEF)
+                continue;
+            struct check_t *chk = &checks[idx];
+            if (!check_can_use_worker(chk))
+                continue;
+
+            int fds[2];
+            if (os_pipe_cloexec(fds) != 0) {
+                my_logf(LL_ERROR, LP_DATETIME,
+                        "Unable to create pipe, check '%s' performed by main process",
+                        chk->display_name);
+                statuses[idx] = perform_check(chk);
+                continue;
+            }
+
+            // Don't let child processes inherit unflushed output
+            fflush(NULL);
+
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(fds[0]);
+                for (i = 0; i < nb_running; ++i)
+                    close(workers[i].fd);
+                child_after_fork(NULL);
+                worker_run(chk, fds[1]);
+            }
+            close(fds[1]);
+            if (pid < 0) {
+                my_logf(LL_ERROR, LP_DATETIME,
+                        "Unable to fork, check '%s' performed by main process",
+                        chk->display_name);
+                close(fds[0]);
+                statuses[idx] = perform_check(chk);
+                continue;
+            }
+
+            workers[nb_running].pid = pid;
+            workers[nb_running].fd = fds[0];
+            workers[nb_running].idx = idx;
+            ++nb_running;
+        }
+
+        if (nb_running == 0)
+            break;
+
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        int maxfd = -1;
+        for (i = 0; i < nb_running; ++i) {
+            FD_SET(workers[i].fd, &rfds);
+            if (workers[i].fd > maxfd)
+                maxfd = workers[i].fd;
+        }
+        if (select(maxfd + 1, &rfds, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            fatal_error("File %s, line %i, select() error", __FILE__, __LINE__);
+        }
+
+        i = 0;
+        while (i < nb_running) {
+            if (FD_ISSET(workers[i].fd, &rfds)) {
+                worker_collect(&workers[i], statuses);
+                workers[i] = workers[--nb_running];
+            } else {
+                ++i;
+            }
+        }
+    }
+}
+
+//
+// Check processes
+//
+// When check_processes is 2 or more, checks are split between as many
+// long-lived child processes, a given check always going to the same
+// process. Unlike workers, these processes are forked once, then receive the
+// checks to perform in a pipe, and send statuses back in another pipe. As
+// with workers, the parent process records statuses, triggers alerts and
+// produces output.
+// A process that does not send the status of a check in time (see
+// shard_check_max_ms) is killed and started again.
+//
+
+// Time given to a check process beyond the longest duration of a check
+#define SHARD_ANSWER_MARGIN_MS  5000
+
+struct shard_t {
+    pid_t pid;
+    // Parent -> child: struct shard_cmd_t
+    int cmd_fd;
+    // Child -> parent: struct shard_result_t
+    int res_fd;
+    // Check being performed by the process, -1 if none
+    int busy_idx;
+    // When the status of the check is expected at the latest, -1 if no limit
+    long long int deadline;
+    // Names in the DNS cache of the process
+    int dns_nb_names;
+    // Where to look for the next check to give to the process
+    int next;
+};
+
+// The loop count goes along with the check as the child process memory is
+// not updated by the main loop.
+struct shard_cmd_t {
+    int idx;
+    long int loop_count;
+};
+
+// Must not be larger than PIPE_BUF, for the result to be read at once
+struct shard_result_t {
+    int idx;
+    int status;
+    int duration_ms;
+    int value;
+    // Lookups and SSL handshakes done by the check, counted by the main
+    // process
+    unsigned long int dns_hits;
+    unsigned long int dns_misses;
+    int dns_nb_names;
+    unsigned long int ssl_full;
+    unsigned long int ssl_resumed;
+    char output[CHECK_OUTPUT_SIZE];
+};
+
+struct shard_t shards[MAX_CHECK_PROCESSES];
+int nb_shards = 0;
+
+//
+// Process in charge of a check: FNV-1a hash of the display name, so that
+// the outcome does not depend on the other checks defined.
+//
+static int check_shard_of(const struct check_t *chk, const int n) {
+    return (int)(fnv1a_hash(chk->display_name) % (unsigned int)n);
+}
+
+//
+// Longest duration of a check performed by a check process, in
+// milliseconds, -1 if there is no limit (program_timeout set to 0)
+//
+static long long int shard_check_max_ms(const struct check_t *chk) {
+    if (chk->method == CM_PROGRAM) {
+        long int t = (chk->prg_timeout_set ? chk->prg_timeout : g_program_timeout);
+        return t >= 1 ? (long long int)t * 1000 : -1;
+    }
+    long int conn_to = (chk->srv.connect_timeout_set ? chk->srv.connect_timeout :
+                        g_connect_timeout);
+    long int netio_to = (chk->srv.netio_timeout_set ? chk->srv.netio_timeout :
+                         g_netio_timeout);
+    // Lookup, connection, server answer, then closing line
+    return ((long long int)g_dns_timeout + conn_to + 2 * netio_to) * 1000;
+}
+
+//
+// Code executed by the child process
+//
+static void shard_run(int cmd_fd, int res_fd) {
+    while (TRUE) {
+        struct shard_cmd_t cmd;
+        ssize_t n;
+        do {
+            n = read(cmd_fd, &cmd, sizeof(cmd));
+        } while (n < 0 && errno == EINTR);
+        // End of file: the parent process wants us to stop
+        if (n != sizeof(cmd) || cmd.idx < 0 || cmd.idx >= g_nb_checks)
+            break;
+
+        loop_count = cmd.loop_count;
+        struct shard_result_t res;
+        unsigned long int hits0;
+        unsigned long int misses0;
+        unsigned long int full0;
+        unsigned long int resumed0;
+        dns_get_stats(&hits0, &misses0, &res.dns_nb_names);
+        ssl_get_stats(&full0, &resumed0);
+        res.idx = cmd.idx;
+        res.status = perform_check(&checks[cmd.idx]);
+        res.duration_ms = check_states[cmd.idx].duration_ms;
+        res.value = check_states[cmd.idx].value;
+        dns_get_stats(&res.dns_hits, &res.dns_misses, &res.dns_nb_names);
+        res.dns_hits -= hits0;
+        res.dns_misses -= misses0;
+        ssl_get_stats(&res.ssl_full, &res.ssl_resumed);
+        res.ssl_full -= full0;
+        res.ssl_resumed -= resumed0;
+        strncpy(res.output, checks[cmd.idx].prg_output, sizeof(res.output));
+        // Log of the check must come before the status recorded by parent
+        fflush(NULL);
+        if (write(res_fd, &res, sizeof(res)) != sizeof(res))
+            break;
+    }
+    close(cmd_fd);
+    close(res_fd);
+    fflush(NULL);
+    _exit(EXIT_SUCCESS);
+}
+
+//
+// Fork check process number i
+// Returns TRUE if successful, FALSE otherwise
+//
+static int shard_start(const int i) {
+    struct shard_t *sh = &shards[i];
+    int cmd[2];
+    int res[2];
+
+    if (os_pipe_cloexec(cmd) != 0)
+        return FALSE;
+    if (os_pipe_cloexec(res) != 0) {
+        close(cmd[0]);
+        close(cmd[1]);
+        return FALSE;
+    }
+
+    // Don't let child processes inherit unflushed output
+    fflush(NULL);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(cmd[1]);
+        close(res[0]);
+        child_after_fork(NULL);
+        shard_run(cmd[0], res[1]);
+    }
+    close(cmd[0]);
+    close(res[1]);
+    if (pid < 0) {
+        close(cmd[1]);
+        close(res[0]);
+        return FALSE;
+    }
+
+    sh->pid = pid;
+    sh->cmd_fd = cmd[1];
+    sh->res_fd = res[0];
+    sh->busy_idx = -1;
+    sh->dns_nb_names = 0;
+    my_logf(LL_DEBUG, LP_DATETIME, "Started check process #%i (pid %lu)", i,
+            (long unsigned)pid);
+    return TRUE;
+}
+
+//
+// Stop check process number i: closing the command pipe tells the process
+// to terminate.
+//
+static void shard_stop(const int i) {
+    struct shard_t *sh = &shards[i];
+    if (sh->pid <= 0)
+        return;
+    close(sh->cmd_fd);
+    close(sh->res_fd);
+    while (waitpid(sh->pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+    sh->pid = -1;
+    sh->busy_idx = -1;
+}
+
+//
+// Split checks between check processes and start them
+//
+void shards_start() {
+    int i;
+    nb_shards = (int)g_check_processes;
+    for (i = 0; i < nb_shards; ++i)
+        shards[i].pid = -1;
+    for (i = 0; i < g_nb_checks; ++i) {
+        if (checks[i].is_valid)
+            checks[i].shard = check_shard_of(&checks[i], nb_shards);
+    }
+    for (i = 0; i < nb_shards; ++i) {
+        if (!shard_start(i)) {
+            my_logf(LL_ERROR, LP_DATETIME,
+                    "Unable to start check process #%i, its checks will be performed by main process",
+                    i);
+        }
+    }
+}
+
+void shards_stop() {
+    int i;
+    for (i = 0; i < nb_shards; ++i)
+        shard_stop(i);
+    nb_shards = 0;
+}
+
+//
+// Used when terminating on a signal
+//
+void shards_kill() {
+    int i;
+    for (i = 0; i < nb_shards; ++i) {
+        if (shards[i].pid > 0)
+            kill(shards[i].pid, SIGTERM);
+    }
+}
+
+//
+// Number of names in the DNS caches of check processes
+//
+static int shards_dns_nb_names() {
+    int i;
+    int n = 0;
+    for (i = 0; i < nb_shards; ++i) {
+        if (shards[i].pid > 0)
+            n += shards[i].dns_nb_names;
+    }
+    return n;
+}
+
+//
+// The check being performed by a check process is lost: its status is
+// unknown
+//
+static void shard_check_lost(const int i, int *statuses) {
+    int idx = shards[i].busy_idx;
+    shards[i].busy_idx = -1;
+    statuses[idx] = ST_UNKNOWN;
+    check_states[idx].duration_ms = 0;
+    check_states[idx].value = TS_VALUE_NONE;
+    checks[idx].prg_output[0] = '\0';
+}
+
+//
+// Read the status sent by a check process. If the process does not answer,
+// it is stopped, to be restarted later.
+//
+static void shard_collect(const int i, int *statuses) {
+    struct shard_t *sh = &shards[i];
+    struct shard_result_t res;
+    ssize_t n;
+    do {
+        n = read(sh->res_fd, &res, sizeof(res));
+    } while (n < 0 && errno == EINTR);
+
+    int idx = sh->busy_idx;
+    if (n != sizeof(res) || res.idx != idx || res.status < 0
+            || res.status > _ST_LAST) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "Check '%s': no status received from check process #%i (pid %lu)",
+                checks[idx].display_name, i, (long unsigned)sh->pid);
+        shard_check_lost(i, statuses);
+        shard_stop(i);
+        return;
+    }
+    sh->busy_idx = -1;
+    sh->dns_nb_names = res.dns_nb_names;
+    dns_add_stats(res.dns_hits, res.dns_misses);
+    ssl_add_stats(res.ssl_full, res.ssl_resumed);
+    statuses[idx] = res.status;
+    check_states[idx].duration_ms = res.duration_ms;
+    check_states[idx].value = res.value;
+    strncpy(checks[idx].prg_output, res.output, sizeof(checks[idx].prg_output));
+    checks[idx].prg_output[sizeof(checks[idx].prg_output) - 1] = '\0';
+}
+
+//
+// Perform the checks of a given dependency level, by check processes.
+// Status of check number i is stored in statuses[i], checks for which
+// statuses[i] is not ST_UNDEF are considered already done.
+// Checks of a process that could not be (re)started are left to ST_UNDEF.
+//
+void perform_checks_with_shards(int *statuses, const int level) {
+    int nb_busy = 0;
+    int i;
+
+    for (i = 0; i < nb_shards; ++i) {
+        shards[i].next = 0;
+        if (shards[i].pid <= 0 && shard_start(i))
+            my_logf(LL_WARNING, LP_DATETIME, "Restarted check process #%i", i);
+    }
+
+    while (TRUE) {
+        for (i = 0; i < nb_shards; ++i) {
+            struct shard_t *sh = &shards[i];
+            while (sh->pid > 0 && sh->busy_idx < 0 && sh->next < g_nb_checks
+                    && !service_stop_requested) {
+                int idx = sh->next++;
+                const struct check_state_t *st = &check_states[idx];
+                if (!st->is_valid || !st->is_due || st->dep_level != level
+                        || st->is_suppressed || statuses[idx] != ST_UNDEF)
+                    continue;
+                struct check_t *chk = &checks[idx];
+                if (chk->shard != i || !check_can_use_worker(chk))
+                    continue;
+
+                struct shard_cmd_t cmd;
+                cmd.idx = idx;
+                cmd.loop_count = loop_count;
+                if (write(sh->cmd_fd, &cmd, sizeof(cmd)) != sizeof(cmd)) {
+                    my_logf(LL_ERROR, LP_DATETIME,
+                            "Check process #%i (pid %lu) not responding, stopping it",
+                            i, (long unsigned)sh->pid);
+                    shard_stop(i);
+                    break;
+                }
+                sh->busy_idx = idx;
+                long long int max_ms = shard_check_max_ms(chk);
+                sh->deadline = (max_ms >= 0 ? os_monotonic_ms() + max_ms
+                                + SHARD_ANSWER_MARGIN_MS : -1);
+                ++nb_busy;
+            }
+        }
+
+        if (nb_busy == 0)
+            break;
+
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        int maxfd = -1;
+        long long int deadline = -1;
+        for (i = 0; i < nb_shards; ++i) {
+            if (shards[i].busy_idx < 0)
+                continue;
+            FD_SET(shards[i].res_fd, &rfds);
+            if (shards[i].res_fd > maxfd)
+                maxfd = shards[i].res_fd;
+            if (shards[i].deadline >= 0
+                    && (deadline < 0 || shards[i].deadline < deadline))
+                deadline = shards[i].deadline;
+        }
+        struct timeval tv;
+        if (deadline >= 0) {
+            long long int left = deadline - os_monotonic_ms();
+            if (left < 0)
+                left = 0;
+            tv.tv_sec = (time_t)(left / 1000);
+            tv.tv_usec = (suseconds_t)(left % 1000) * 1000;
+        }
+        int r = select(maxfd + 1, &rfds, NULL, NULL, deadline >= 0 ? &tv : NULL);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            fatal_error("File %s, line %i, select() error", __FILE__, __LINE__);
+        }
+
+        long long int now = os_monotonic_ms();
+        for (i = 0; i < nb_shards; ++i) {
+            struct shard_t *sh = &shards[i];
+            if (sh->busy_idx < 0)
+                continue;
+            if (r >= 1 && FD_ISSET(sh->res_fd, &rfds)) {
+                shard_collect(i, statuses);
+                --nb_busy;
+            } else if (sh->deadline >= 0 && now >= sh->deadline) {
+                my_logf(LL_ERROR, LP_DATETIME,
+                        "Check '%s': no status received in time from check process #%i (pid %lu), killing it",
+                        checks[sh->busy_idx].display_name, i, (long unsigned)sh->pid);
+                shard_check_lost(i, statuses);
+                --nb_busy;
+                kill(sh->pid, SIGKILL);
+                shard_stop(i);
+                if (shard_start(i))
+                    my_logf(LL_WARNING, LP_DATETIME, "Restarted check process #%i", i);
+            }
+        }
+    }
+}
+
+#endif
+
+//
+// Plugins
+//
+// A library is loaded once, when a check that uses it is read in the
+// configuration, and is not unloaded before netmon terminates: after a
+// configuration reload, checks that did not change keep the state created
+// by the plugin.
+// Plugin checks are performed by the main process, the state created by the
+// plugin (or the helper process of the check) being in its memory.
+//
+
+struct plugin_lib_t {
+    char *file;
+    void *lib;
+    const struct netmon_plugin_t *plugin;
+};
+
+struct plugin_lib_t *plugin_libs = NULL;
+int nb_plugin_libs = 0;
+
+//
+// Find the plugin of a library, loading the library if not already done.
+// Returns NULL if an error occured, err being then set.
+//
+static const struct netmon_plugin_t *plugin_load(const char *file, char *err,
+                                                const size_t err_len) {
+    int i;
+    for (i = 0; i < nb_plugin_libs; ++i) {
+        if (strcmp(plugin_libs[i].file, file) == 0)
+            return plugin_libs[i].plugin;
+    }
+
+    void *lib = os_lib_open(file, err, err_len);
+    if (lib == NULL)
+        return NULL;
+    netmon_plugin_entry_t entry = (netmon_plugin_entry_t)os_lib_symbol(lib,
+                                  NETMON_PLUGIN_ENTRY);
+    const struct netmon_plugin_t *plugin = (entry != NULL ? entry() : NULL);
+    if (entry == NULL) {
+        snprintf(err, err_len, "function %s not found", NETMON_PLUGIN_ENTRY);
+    } else if (plugin == NULL) {
+        snprintf(err, err_len, "no plugin returned by %s", NETMON_PLUGIN_ENTRY);
+    } else if (plugin->abi_version != NETMON_PLUGIN_ABI_VERSION) {
+        snprintf(err, err_len, "plugin interface version %i, expected %i",
+                 plugin->abi_version, NETMON_PLUGIN_ABI_VERSION);
+    } else if (plugin->run == NULL) {
+        snprintf(err, err_len, "no run function");
+    } else {
+        plugin_libs = (struct plugin_lib_t *)MYREALLOC(plugin_libs,
+                      sizeof(struct plugin_lib_t) * (unsigned long int)(nb_plugin_libs + 1));
+        struct plugin_lib_t *pl = &plugin_libs[nb_plugin_libs++];
+        pl->file = (char *)MYMALLOC(strlen(file) + 1, pl->file);
+        strcpy(pl->file, file);
+        pl->lib = lib;
+        pl->plugin = plugin;
+        return plugin;
+    }
+    os_lib_close(lib);
+    return NULL;
+}
+
+//
+// To be called once all checks are destroyed
+//
+static void plugin_libs_destroy() {
+    int i;
+    for (i = 0; i < nb_plugin_libs; ++i) {
+        os_lib_close(plugin_libs[i].lib);
+        MYFREE(plugin_libs[i].file);
+    }
+    if (plugin_libs != NULL)
+        MYFREE(plugin_libs);
+    plugin_libs = NULL;
+    nb_plugin_libs = 0;
+}
+
+//
+// Call the init function of the plugin of a check
+// Returns TRUE if successful, FALSE otherwise
+//
+static int plugin_init(const struct check_t *chk, void **state) {
+    *state = NULL;
+    if (chk->plugin->init == NULL)
+        return TRUE;
+    int r = chk->plugin->init(chk->plg_args_set ? chk->plg_args : NULL, state);
+    if (r != 0) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "Plugin check(%s): initialization of plugin failed, code %i",
+                chk->display_name, r);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void plugin_destroy(const struct check_t *chk, void *state) {
+    if (chk->plugin->destroy != NULL)
+        chk->plugin->destroy(state);
+}
+
+//
+// Call the run function of the plugin of a check, the text written by the
+// plugin being put in output
+//
+static int plugin_run(const struct check_t *chk, void *state,
+                      const struct subst_t *subst, const int subst_len,
+                      char *output, const size_t output_size) {
+    struct netmon_plugin_check_t pchk;
+    pchk.display_name = chk->display_name;
+    pchk.host_name = (chk->srv.server_set && chk->srv.server != NULL ?
+                      chk->srv.server : "");
+    pchk.args = (chk->plg_args_set ? chk->plg_args : NULL);
+
+    struct netmon_plugin_subst_t psubst[CHECK_SUBST_NB];
+    int n = (subst_len <= CHECK_SUBST_NB ? subst_len : CHECK_SUBST_NB);
+    int i;
+    for (i = 0; i < n; ++i) {
+        psubst[i].name = subst[i].find;
+        psubst[i].value = subst[i].replace;
+    }
+
+    output[0] = '\0';
+    int code = chk->plugin->run(state, &pchk, psubst, n, output, output_size);
+    output[output_size - 1] = '\0';
+    return code;
+}
+
+//
+// Get the status of a plugin check out of the code returned by the plugin
+//
+static int plugin_check_status(struct check_t *chk, const int code,
+                               const char *output) {
+    log_program_output(output);
+    check_output_keep(chk, output);
+    check_state_of(chk)->value = code;
+    my_logf(code == NAGIOS_OK ? LL_VERBOSE : LL_ERROR, LP_DATETIME,
+            "Plugin check(%s): return code: %i", chk->display_name, code);
+    return nagios_code_to_status(code);
+}
+
+#ifdef MY_LINUX
+
+//
+// Helper processes (plugin_isolate=yes)
+//
+// The plugin of the check is run by a long-lived child process, so that a
+// plugin that crashes or does not return does not affect netmon. The helper
+// is started when the check is first performed, and again after it
+// terminated.
+// The helper receives a struct plugin_cmd_t each time the check is to be
+// performed, and answers with a struct plugin_result_t. Closing the command
+// pipe tells it to call the destroy function of the plugin and terminate.
+//
+
+// As with check processes, the loop count goes along with the request.
+struct plugin_cmd_t {
+    long int loop_count;
+};
+
+// Larger than PIPE_BUF, read with plugin_read
+struct plugin_result_t {
+    int code;
+    int duration_ms;
+    char output[PRG_OUTPUT_SIZE];
+};
+
+//
+// Read len bytes in fd, waiting at most until deadline (monotonic time in
+// milliseconds, 0 for no limit).
+// Returns 1 if successful, 0 at end of file or on error, -1 on timeout
+//
+static int plugin_read(int fd, void *buf, const size_t len,
+                       const long long int deadline) {
+    char *p = (char *)buf;
+    size_t got = 0;
+    while (got < len) {
+        int wait_ms = -1;
+        if (deadline > 0) {
+            long long int d = deadline - os_monotonic_ms();
+            if (d <= 0)
+                return -1;
+            wait_ms = (int)d;
+        }
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        int r = poll(&pfd, 1, wait_ms);
+        if (r < 0 && errno != EINTR)
+            return 0;
+        if (r <= 0)
+            continue;
+        ssize_t n = read(fd, p + got, len - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        got += (size_t)n;
+    }
+    return 1;
+}
+
+//
+// Close the pipes of the helper processes inherited by a child process, so
+// that closing them in the main process still tells helpers to terminate.
+// except is the check of which the child process is the helper, if any.
+//
+static void plugin_helpers_forget(const struct check_t *except) {
+    int i;
+    for (i = 0; i < g_nb_checks; ++i) {
+        struct check_t *chk = &checks[i];
+        if (chk == except || chk->plg_pid <= 0)
+            continue;
+        close(chk->plg_cmd_fd);
+        close(chk->plg_res_fd);
+        chk->plg_pid = -1;
+        chk->plg_cmd_fd = -1;
+        chk->plg_res_fd = -1;
+    }
+}
+
+//
+// To be called by a child process right after fork(). Check processes,
+// plugin helpers, lookups in progress and the spawn server belong to the
+// main process, except is the check of which the child process is the
+// plugin helper, if any.
+// SIGHUP and SIGUSR1 are meant for the main process, that can be signaled
+// along with its children (killall -HUP netmon).
+//
+void child_after_fork(const struct check_t *except) {
+    int j;
+    for (j = 0; j < nb_shards; ++j) {
+        if (shards[j].pid > 0) {
+            close(shards[j].cmd_fd);
+            close(shards[j].res_fd);
+        }
+    }
+    nb_shards = 0;
+    plugin_helpers_forget(except);
+    dns_after_fork();
+    prg_server_after_fork();
+
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGABRT, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+}
+
+//
+// Code executed by the helper process
+//
+static void plugin_helper_run(struct check_t *chk, int cmd_fd, int res_fd) {
+    void *state;
+    if (!plugin_init(chk, &state)) {
+        fflush(NULL);
+        _exit(EXIT_FAILURE);
+    }
+
+    struct plugin_result_t *res = (struct plugin_result_t *)MYMALLOC(sizeof(
+                                      struct plugin_result_t), res);
+    while (TRUE) {
+        struct plugin_cmd_t cmd;
+        ssize_t n;
+        do {
+            n = read(cmd_fd, &cmd, sizeof(cmd));
+        } while (n < 0 && errno == EINTR);
+        // End of file: the parent process wants us to stop
+        if (n != sizeof(cmd))
+            break;
+
+        loop_count = cmd.loop_count;
+        struct check_subst_t cs;
+        check_subst_fill(&cs, chk);
+        long long int start = os_monotonic_ms();
+        res->code = plugin_run(chk, state, cs.subst, CHECK_SUBST_NB, res->output,
+                               sizeof(res->output));
+        res->duration_ms = (int)(os_monotonic_ms() - start);
+        fflush(NULL);
+        if (write(res_fd, res, sizeof(*res)) != sizeof(*res))
+            break;
+    }
+    MYFREE(res);
+    plugin_destroy(chk, state);
+    close(cmd_fd);
+    close(res_fd);
+    fflush(NULL);
+    _exit(EXIT_SUCCESS);
+}
+
+//
+// Fork the helper process of a check
+// Returns TRUE if successful, FALSE otherwise
+//
+static int plugin_helper_start(struct check_t *chk) {
+    int cmd[2];
+    int res[2];
+
+    // Programs run by netmon must not inherit the pipes, or the helper would
+    // not see the end of file of the command pipe
+    if (os_pipe_cloexec(cmd) != 0)
+        return FALSE;
+    if (os_pipe_cloexec(res) != 0) {
+        close(cmd[0]);
+        close(cmd[1]);
+        return FALSE;
+    }
+
+    // Don't let child processes inherit unflushed output
+    fflush(NULL);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(cmd[1]);
+        close(res[0]);
+        child_after_fork(chk);
+        plugin_helper_run(chk, cmd[0], res[1]);
+    }
+    close(cmd[0]);
+    close(res[1]);
+    if (pid < 0) {
+        close(cmd[1]);
+        close(res[0]);
+        return FALSE;
+    }
+
+    chk->plg_pid = pid;
+    chk->plg_cmd_fd = cmd[1];
+    chk->plg_res_fd = res[0];
+    my_logf(LL_DEBUG, LP_DATETIME, "Plugin check(%s): started helper process",
+            chk->display_name);
+    return TRUE;
+}
+
+//
+// Stop the helper process of a check. If kill_it is TRUE the process is
+// killed, otherwise closing the command pipe tells it to terminate.
+// Returns the status of the process, as returned by waitpid.
+//
+static int plugin_helper_stop(struct check_t *chk, const int kill_it) {
+    int wstatus = 0;
+    if (chk->plg_pid <= 0)
+        return wstatus;
+    if (kill_it)
+        kill(chk->plg_pid, SIGKILL);
+    close(chk->plg_cmd_fd);
+    close(chk->plg_res_fd);
+    while (waitpid(chk->plg_pid, &wstatus, 0) < 0 && errno == EINTR)
+        ;
+    chk->plg_pid = -1;
+    chk->plg_cmd_fd = -1;
+    chk->plg_res_fd = -1;
+    return wstatus;
+}
+
+//
+// Ask the helper process of a check to perform the check, starting the
+// helper if needed
+// Returns TRUE if successful, FALSE otherwise
+//
+static int plugin_helper_send(struct check_t *chk) {
+    if (chk->plg_pid <= 0 && !plugin_helper_start(chk)) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "Plugin check(%s): unable to start helper process",
+                chk->display_name);
+        return FALSE;
+    }
+    struct plugin_cmd_t cmd;
+    cmd.loop_count = loop_count;
+    if (write(chk->plg_cmd_fd, &cmd, sizeof(cmd)) != sizeof(cmd)) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "Plugin check(%s): helper process (pid %lu) not responding, stopping it",
+                chk->display_name, (long unsigned)chk->plg_pid);
+        plugin_helper_stop(chk, TRUE);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//
+// Get the status of a check out of the answer of its helper process, the
+// request having been sent at time start (monotonic time in milliseconds)
+//
+static int plugin_helper_status(struct check_t *chk,
+                                const long long int start) {
+    char prefix[SMALLSTRSIZE];
+    snprintf(prefix, sizeof(prefix), "Plugin check(%s):", chk->display_name);
+
+    long int timeout = (chk->plg_timeout_set ? chk->plg_timeout :
+                        g_program_timeout);
+    struct plugin_result_t *res = (struct plugin_result_t *)MYMALLOC(sizeof(
+                                      struct plugin_result_t), res);
+    int r = plugin_read(chk->plg_res_fd, res, sizeof(*res),
+                        timeout > 0 ? start + timeout * 1000 : 0);
+    int status;
+    if (r == 1) {
+        check_state_of(chk)->duration_ms = res->duration_ms;
+        status = plugin_check_status(chk, res->code, res->output);
+    } else if (r < 0) {
+        check_state_of(chk)->duration_ms = (int)(os_monotonic_ms() - start);
+        my_logf(LL_ERROR, LP_DATETIME,
+                "%s timeout after %li second(s), helper process killed", prefix,
+                timeout);
+        plugin_helper_stop(chk, TRUE);
+        status = ST_FAIL;
+    } else {
+        check_state_of(chk)->duration_ms = (int)(os_monotonic_ms() - start);
+        int wstatus = plugin_helper_stop(chk, FALSE);
+        if (WIFSIGNALED(wstatus)) {
+            my_logf(LL_ERROR, LP_DATETIME,
+                    "%s helper process terminated by signal %i", prefix,
+                    WTERMSIG(wstatus));
+        } else {
+            my_logf(LL_ERROR, LP_DATETIME,
+                    "%s helper process terminated, exit status %i", prefix,
+                    WEXITSTATUS(wstatus));
+        }
+        status = ST_UNKNOWN;
+    }
+    MYFREE(res);
+    return status;
+}
+
+//
+// Perform at the same time the checks of isolated plugins due at the given
+// dependency level: requests are sent to all helper processes, then answers
+// are collected. statuses[i] is set for each check performed.
+//
+void perform_checks_plugin_parallel(int *statuses, const int level) {
+    int *sent_idx = (int *)MYMALLOC(sizeof(int) * (unsigned long int)(
+                                        g_nb_checks + 1), sent_idx);
+    int nb = 0;
+    long long int start = os_monotonic_ms();
+    int i;
+
+    for (i = 0; i < g_nb_checks; ++i) {
+        struct check_state_t *st = &check_states[i];
+        if (!st->is_valid || !st->is_due || st->dep_level != level
+                || st->is_suppressed || statuses[i] != ST_UNDEF)
+            continue;
+        struct check_t *chk = &checks[i];
+        if (chk->method != CM_PLUGIN || !chk->plg_isolate)
+            continue;
+
+        my_logf(LL_VERBOSE, LP_DATETIME, "Performing check %s(%s)",
+                l_check_methods[chk->method], chk->display_name);
+        st->value = TS_VALUE_NONE;
+        chk->prg_output[0] = '\0';
+        if (plugin_helper_send(chk)) {
+            sent_idx[nb++] = i;
+        } else {
+            st->duration_ms = 0;
+            statuses[i] = ST_UNKNOWN;
+        }
+    }
+
+    for (i = 0; i < nb; ++i)
+        statuses[sent_idx[i]] = plugin_helper_status(&checks[sent_idx[i]], start);
+
+    MYFREE(sent_idx);
+}
 
-#ifdef MY_WINDOWS
-    ntsvc_SetServiceStatus(SERVICE_RUNNING,
-                           SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN);
 #endif
 
-    int delay = 0;
-    int this_sleep = 0;
-    while (!service_stop_requested) {
-        if (delay > 0) {
-            if (this_sleep == 0) {
-                my_logf(LL_NORMAL, LP_DATETIME,
-                        "Now sleeping for %i second(s) (interval = %li)",
-                        delay, g_check_interval);
-            }
-            this_sleep = delay < SLEEP_STEPS ? delay : SLEEP_STEPS;
-            delay -= this_sleep;
-            my_logf(LL_DEBUG, LP_DATETIME, "Will sleep %i second(s)", this_sleep);
-            my_logf(LL_DEBUG, LP_DATETIME,
-                    "Sleeping duration remaining after this one: %is second(s)", delay);
+//
+// Stop using the plugin of a check
+//
+void plugin_check_stop(struct check_t *chk) {
+#ifdef MY_LINUX
+    plugin_helper_stop(chk, FALSE);
+#endif
+    if (chk->plg_ready) {
+        plugin_destroy(chk, chk->plg_state);
+        chk->plg_ready = FALSE;
+        chk->plg_state = NULL;
+    }
+}
+
+//
+//
+//
+int perform_check_plugin(struct check_t *chk, const struct subst_t *subst,
+                         int subst_len) {
+#ifdef MY_LINUX
+    if (chk->plg_isolate) {
+        if (!plugin_helper_send(chk))
+            return ST_UNKNOWN;
+        return plugin_helper_status(chk, os_monotonic_ms());
+    }
+#endif
 
-            dbg_write("Now sleeping for %d second(s)\n", this_sleep);
+    if (!chk->plg_ready) {
+        if (!plugin_init(chk, &chk->plg_state))
+            return ST_UNKNOWN;
+        chk->plg_ready = TRUE;
+    }
+    char *output = (char *)MYMALLOC(PRG_OUTPUT_SIZE, output);
+    int code = plugin_run(chk, chk->plg_state, subst, subst_len, output,
+                          PRG_OUTPUT_SIZE);
+    int status = plugin_check_status(chk, code, output);
+    MYFREE(output);
+    return status;
+}
 
-            os_sleep((unsigned int)this_sleep);
-            continue;
+//
+// Tell whether a check must be left aside because a check it depends on is
+// down, either failed or itself left aside.
+//
+void check_update_suppressed(const struct check_t *chk) {
+    struct check_state_t *st = check_state_of(chk);
+    int i;
+    st->is_suppressed = FALSE;
+    for (i = 0; i < chk->nb_parents; ++i) {
+        const struct check_state_t *parent = &check_states[chk->parents[i]];
+        if (parent->status == ST_FAIL || parent->is_suppressed) {
+            st->is_suppressed = TRUE;
+            st->suppressed_by = chk->parents[i];
+            break;
         }
-        this_sleep = 0;
+    }
+}
 
-        ++loop_count;
-        int lc = (int)loop_count;
+#ifdef MY_LINUX
+//
+// Key of a check in the time series store: display name reduced to
+// characters safe in a file name, followed by a hash of the display name
+// to tell apart names that reduce to the same string. Display names are
+// case insensitive, so is the key of a check.
+//
+#define TS_KEY_NAME_MAX 64
+static void ts_key(const char *name, const int fold_case, char *key,
+                   size_t key_len) {
+    char reduced[TS_KEY_NAME_MAX + 1];
+    int i;
+    for (i = 0; name[i] != '\0' && i < TS_KEY_NAME_MAX; ++i) {
+        char c = (fold_case ? (char)tolower((unsigned char)name[i]) : name[i]);
+        reduced[i] = (isalnum((unsigned char)c) || c == '-' || c == '_' ? c : '_');
+    }
+    reduced[i] = '\0';
+    // check_index_hash is the hash of the name in lower case
+    snprintf(key, key_len, "%s-%08x", reduced,
+             fold_case ? check_index_hash(name) : fnv1a_hash(name));
+}
 
-        int II;
+void check_ts_key(const char *display_name, char *key, size_t key_len) {
+    ts_key(display_name, TRUE, key, key_len);
+}
 
-        my_logs(LL_NORMAL, LP_DATETIME, "Starting check...");
+//
+// Append the result of the check to the time series store
+//
+void check_ts_append(struct check_t *chk, const struct timeval *tv0) {
+    const struct check_state_t *st = check_state_of(chk);
+    struct ts_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.time_ms = (long long int)tv0->tv_sec * 1000 + tv0->tv_usec / 1000;
+    rec.duration_ms = (st->is_suppressed ? 0 : st->duration_ms);
+    rec.value = (st->is_suppressed ? TS_VALUE_NONE : st->value);
+    rec.status = st->status;
+    rec.method = chk->method;
 
-        struct timeval tv0;
-        if (gettimeofday(&tv0, NULL) == GETTIMEOFDAY_ERROR)
-            fatal_error("File %s, line %i, gettimeofday() error", __FILE__, __LINE__);
+    char key[TS_KEY_NAME_MAX + 20];
+    check_ts_key(chk->display_name, key, sizeof(key));
+    ts_append(&chk->ts_seg, g_history_directory, key,
+              (long long int)g_history_segment_duration * 1000, &rec);
+}
 
-        for (II = 0; II < g_nb_checks; ++II) {
+//
+// Key of a metric of a check in the time series store: key of the check,
+// a dot, then the label reduced the same way as a display name (the case
+// of a label matters).
+//
+void check_metric_ts_key(const char *display_name, const char *label,
+                         char *key, size_t key_len) {
+    char chk_key[TS_KEY_NAME_MAX + 20];
+    char label_key[TS_KEY_NAME_MAX + 20];
+    check_ts_key(display_name, chk_key, sizeof(chk_key));
+    ts_key(label, FALSE, label_key, sizeof(label_key));
+    snprintf(key, key_len, "%s.%s", chk_key, label_key);
+}
 
-            if (service_stop_requested)
-                break;
+//
+// Whether label has the same key in the time series store as a metric the
+// check already has. Both metrics would then write to the same segment files.
+//
+static int check_metric_key_is_taken(const struct check_t *chk,
+                                     const char *label) {
+    char key[2 * TS_KEY_NAME_MAX + 40];
+    char other_key[2 * TS_KEY_NAME_MAX + 40];
+    check_metric_ts_key(chk->display_name, label, key, sizeof(key));
+    int i;
+    for (i = 0; i < chk->nb_metrics; ++i) {
+        check_metric_ts_key(chk->display_name, chk->metrics[i].label, other_key,
+                            sizeof(other_key));
+        if (strcmp(key, other_key) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+#endif
+
+//
+// Update the metrics of a program check out of the performance data found
+// in the output of its last run, and record them in the time series store.
+// A check keeps track of at most NAGIOS_PERF_MAX distinct metrics, the
+// ones found first. A label whose key in the time series store is that of
+// another metric is ignored.
+//
+void check_metrics_update(struct check_t *chk, const struct timeval *tv0) {
+    int i;
+    int j;
+    for (i = 0; i < chk->nb_metrics; ++i)
+        chk->metrics[i].is_current = FALSE;
+    if (check_state_of(chk)->is_suppressed || chk->prg_output[0] == '\0')
+        return;
 
-            struct check_t *chk = &checks[II];
-            if (!chk->is_valid)
+    nagios_perf_t perf[NAGIOS_PERF_MAX];
+    size_t text_len;
+    int nb = nagios_parse_output(chk->prg_output, &text_len, perf,
+                                 NAGIOS_PERF_MAX);
+    if (nb >= 1 && chk->metrics == NULL)
+        chk->metrics = (struct check_metric_t *)MYMALLOC(sizeof(struct check_metric_t)
+                       * NAGIOS_PERF_MAX, chk->metrics);
+
+    for (i = 0; i < nb; ++i) {
+        for (j = 0; j < chk->nb_metrics; ++j) {
+            if (strcmp(chk->metrics[j].label, perf[i].label) == 0)
+                break;
+        }
+        if (j == chk->nb_metrics) {
+            if (chk->nb_metrics >= NAGIOS_PERF_MAX)
+                continue;
+#ifdef MY_LINUX
+            if (check_metric_key_is_taken(chk, perf[i].label)) {
+                my_logf(LL_VERBOSE, LP_DATETIME,
+                        "%s check(%s): metric %s ignored, same history key as "
+                        "another metric", chk->method == CM_PLUGIN ? "Plugin" :
+                        "Program", chk->display_name, perf[i].label);
                 continue;
+            }
+#endif
+            struct check_metric_t *m = &chk->metrics[chk->nb_metrics++];
+            memcpy(m->label, perf[i].label, sizeof(m->label));
+#ifdef MY_LINUX
+            ts_segment_init(&m->ts_seg, (int)sizeof(struct ts_metric_record_t));
+#endif
+        }
+        struct check_metric_t *m = &chk->metrics[j];
+        memcpy(m->uom, perf[i].uom, sizeof(m->uom));
+        m->value = perf[i].value;
+        m->is_current = TRUE;
+        my_logf(LL_DEBUG, LP_DATETIME, "%s check(%s): metric %s = %g%s",
+                chk->method == CM_PLUGIN ? "Plugin" : "Program",
+                chk->display_name, m->label, m->value, m->uom);
+
+#ifdef MY_LINUX
+        if (g_history_directory_set) {
+            struct ts_metric_record_t rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.time_ms = (long long int)tv0->tv_sec * 1000 + tv0->tv_usec / 1000;
+            rec.value = m->value;
+            char key[2 * TS_KEY_NAME_MAX + 40];
+            check_metric_ts_key(chk->display_name, m->label, key, sizeof(key));
+            ts_append(&m->ts_seg, g_history_directory, key,
+                      (long long int)g_history_segment_duration * 1000, &rec);
+        }
+#endif
+    }
+}
 
-            int status = perform_check(chk);
-            assert(status >= 0 && status <= _ST_LAST);
+//
+// Record the status of a check that has just been performed: update
+// status, history and counters, then trigger alerts as needed.
+// Must be called in checks[] order, so that the outcome does not depend on
+// the order in which checks complete.
+//
+void manage_check_status(struct check_t *chk, int status, int lc,
+                         const struct timeval *tv0) {
+    assert(status >= 0 && status <= _ST_LAST);
 
-            struct tm my_now;
-            set_current_tm(&my_now);
+    struct check_state_t *st = check_state_of(chk);
 
-            chk->prev_status = chk->status;
-            chk->status = status;
+    struct tm my_now;
+    set_current_tm(&my_now);
 
-            int reset_nb_failures = FALSE;
-            if (chk->prev_status != chk->status && chk->prev_status != ST_UNDEF) {
-                chk->last_status_change = my_now;
-                chk->last_status_change_flag = TRUE;
-                reset_nb_failures = TRUE;
-            }
-            if ((chk->status != ST_OK || chk->prev_status != ST_OK)
-                    && chk->status != chk->prev_status) {
-                set_current_tm(&chk->alert_info);
-                reset_nb_failures = TRUE;
-            }
+    st->prev_status = st->status;
+    st->status = status;
 
-            int as;
-            if (chk->status != ST_OK) {
-                as = AS_FAIL;
-                chk->nb_consecutive_notok++;
-            } else {
-                as = (chk->prev_status != ST_OK
-                      && chk->prev_status != ST_UNDEF ? AS_RECOVERY : AS_NOTHING);
-                chk->nb_consecutive_notok = 0;
-            }
+    int reset_nb_failures = FALSE;
+    if (st->prev_status != st->status && st->prev_status != ST_UNDEF) {
+        chk->last_status_change = my_now;
+        chk->last_status_change_flag = TRUE;
+        reset_nb_failures = TRUE;
+    }
+    if ((st->status != ST_OK || st->prev_status != ST_OK)
+            && st->status != st->prev_status) {
+        set_current_tm(&chk->alert_info);
+        reset_nb_failures = TRUE;
+    }
 
-            if (chk->last_status_change_flag) {
-                time_t lsc = mktime(&chk->last_status_change);
-                if ((long signed int)tv0.tv_sec - (long signed int)lsc >=
-                        LAST_STATUS_CHANGE_DISPLAY_SECONDS) {
-                    chk->last_status_change_flag = FALSE;
-                }
-            }
+    // A check not performed because of a dependency is left aside: it
+    // neither counts as a failure nor triggers alerts.
+    int as = AS_NOTHING;
+    if (!st->is_suppressed) {
+        if (st->status != ST_OK) {
+            as = AS_FAIL;
+            st->nb_consecutive_notok++;
+        } else {
+            as = (st->prev_status != ST_OK
+                  && st->prev_status != ST_UNDEF ? AS_RECOVERY : AS_NOTHING);
+            st->nb_consecutive_notok = 0;
+        }
+    }
 
+    if (chk->last_status_change_flag) {
+        time_t lsc = mktime(&chk->last_status_change);
+        if ((long signed int)tv0->tv_sec - (long signed int)lsc >=
+                LAST_STATUS_CHANGE_DISPLAY_SECONDS) {
+            chk->last_status_change_flag = FALSE;
+        }
+    }
+
+    if (st->is_suppressed) {
+        my_logf(LL_NORMAL, LP_DATETIME, "%s -> %s (depends on %s)",
+                chk->display_name, ST_TO_LONGSTR_FANCY[st->status],
+                checks[st->suppressed_by].display_name);
+    } else {
 #ifdef DEBUG
-            my_logf(LL_NORMAL, LP_DATETIME, "%s -> %s (%i)",
-                    chk->display_name, ST_TO_LONGSTR_FANCY[chk->status],
-                    chk->nb_consecutive_notok);
+        my_logf(LL_NORMAL, LP_DATETIME, "%s -> %s (%i)",
+                chk->display_name, ST_TO_LONGSTR_FANCY[st->status],
+                st->nb_consecutive_notok);
 #else
-            my_logf(LL_NORMAL, LP_DATETIME, "%s -> %s", chk->display_name,
-                    ST_TO_LONGSTR_FANCY[chk->status]);
+        my_logf(LL_NORMAL, LP_DATETIME, "%s -> %s", chk->display_name,
+                ST_TO_LONGSTR_FANCY[st->status]);
 #endif
+    }
 
-            // Update status history
-            if (g_nb_keep_last_status >= 1) {
-                char *shift_status = (char *)MYMALLOC((unsigned long int)
-                                                      g_nb_keep_last_status +
-                                                      1, shift_status);
-                strncpy(shift_status, chk->str_prev_status + 1,
-                        (unsigned long int)g_nb_keep_last_status + 1);
-                strncpy(chk->str_prev_status, shift_status,
-                        (unsigned long int)g_nb_keep_last_status + 1);
-                char t[] = "A";
-                t[0] = ST_TO_CHAR[chk->status];
-                strncat(chk->str_prev_status, t,
-                        (unsigned long int)g_nb_keep_last_status + 1);
-                MYFREE(shift_status);
-            }
+    // Update status history
+    status_hist_push(&chk->hist, st->status);
+#ifdef MY_LINUX
+    if (g_history_directory_set)
+        check_ts_append(chk, tv0);
+#endif
+    if (chk->method == CM_PROGRAM || chk->method == CM_PLUGIN)
+        check_metrics_update(chk, tv0);
+
+    if (st->is_suppressed)
+        return;
 
 // Manage alert
 
-            int trigger_alert = FALSE;
-            if (as == AS_NOTHING)
-                chk->trigger_sequence = 0;
-
-            int threshold = (int)(chk->alert_threshold_set ? chk->alert_threshold :
-                                  DEFAULT_ALERT_THRESHOLD);
-            int repeat_max = (int)(chk->alert_repeat_max_set ? chk->alert_repeat_max :
-                                   DEFAULT_ALERT_REPEAT_MAX);
-            if (chk->alert_threshold_set
-                    && chk->alert_threshold == chk->nb_consecutive_notok) {
-                trigger_alert = TRUE;
-                chk->trigger_sequence++;
-            } else if (chk->alert_repeat_every_set) {
-                if (chk->nb_consecutive_notok - threshold >= chk->alert_repeat_every &&
-                        (chk->nb_consecutive_notok - threshold + chk->alert_repeat_every) %
-                        chk->alert_repeat_every == 0) {
-                    trigger_alert = (repeat_max < 0 ? TRUE : (chk->trigger_sequence <=
-                                     repeat_max));
-                    chk->trigger_sequence++;
+    int trigger_alert = FALSE;
+    if (as == AS_NOTHING)
+        st->trigger_sequence = 0;
+
+    int threshold = (int)(chk->alert_threshold_set ? chk->alert_threshold :
+                          DEFAULT_ALERT_THRESHOLD);
+    int repeat_max = (int)(chk->alert_repeat_max_set ? chk->alert_repeat_max :
+                           DEFAULT_ALERT_REPEAT_MAX);
+    if (chk->alert_threshold_set
+            && chk->alert_threshold == st->nb_consecutive_notok) {
+        trigger_alert = TRUE;
+        st->trigger_sequence++;
+    } else if (chk->alert_repeat_every_set) {
+        if (st->nb_consecutive_notok - threshold >= chk->alert_repeat_every &&
+                (st->nb_consecutive_notok - threshold + chk->alert_repeat_every) %
+                chk->alert_repeat_every == 0) {
+            trigger_alert = (repeat_max < 0 ? TRUE : (st->trigger_sequence <=
+                             repeat_max));
+            st->trigger_sequence++;
+        }
+    }
+
+    /*            my_logf(LL_DEBUG, LP_DATETIME, "as = %d, st->trigger_sequence = %d", as,*/
+    /*                    st->trigger_sequence);*/
+    /*            my_logf(LL_DEBUG, LP_DATETIME, "st->nb_consecutive_notok = %d",*/
+    /*                    st->nb_consecutive_notok);*/
+    /*            my_logf(LL_DEBUG, LP_DATETIME, "trigger_alert = %d", trigger_alert);*/
+
+    int i;
+    for (i = 0; i < chk->nb_alerts; ++i) {
+        int trigger_alert_by_alert = trigger_alert;
+        struct alert_t *alrt = &alerts[chk->alert_ctrl[i].idx];
+
+        if (reset_nb_failures)
+            chk->alert_ctrl[i].nb_failures = 0;
+
+        if (!chk->alert_threshold_set) {
+            threshold = (int)(alrt->threshold_set ? alrt->threshold :
+                              DEFAULT_ALERT_THRESHOLD);
+            if (threshold == st->nb_consecutive_notok)
+                trigger_alert_by_alert = TRUE;
+        }
+
+        if (!chk->alert_repeat_every_set) {
+            int resend_every = (int)(alrt->repeat_every_set ? alrt->repeat_every :
+                                     DEFAULT_ALERT_REPEAT_EVERY);
+            if (st->nb_consecutive_notok - threshold >= resend_every &&
+                    (st->nb_consecutive_notok - threshold + resend_every) % resend_every ==
+                    0) {
+                int repm = (int)(alrt->repeat_max_set ? alrt->repeat_max : repeat_max);
+                trigger_alert_by_alert = (repm < 0 ? TRUE :
+                                          (chk->alert_ctrl[i].trigger_sequence
+                                           <= repm));
+            }
+        }
+
+        int retries = (int)(alrt->retries_set ? alrt->retries :
+                            DEFAULT_ALERT_RETRIES);
+        if (chk->alert_ctrl[i].alert_status == AS_FAIL && as == AS_RECOVERY) {
+            if (chk->alert_recovery_set && chk->alert_recovery) {
+                trigger_alert_by_alert = TRUE;
+            } else if (!chk->alert_recovery_set) {
+                if (alrt->recovery_set && alrt->recovery) {
+                    trigger_alert_by_alert = TRUE;
+                } else if (!alrt->recovery_set) {
+                    if (!trigger_alert_by_alert)
+                        trigger_alert_by_alert = DEFAULT_ALERT_RECOVERY;
                 }
             }
+        } else if (chk->alert_ctrl[i].alert_status == AS_RECOVERY
+                   && chk->alert_ctrl[i].nb_failures <= retries) {
+            trigger_alert_by_alert = TRUE;
+        }
 
-            /*            my_logf(LL_DEBUG, LP_DATETIME, "as = %d, chk->trigger_sequence = %d", as,*/
-            /*                    chk->trigger_sequence);*/
-            /*            my_logf(LL_DEBUG, LP_DATETIME, "chk->nb_consecutive_notok = %d",*/
-            /*                    chk->nb_consecutive_notok);*/
-            /*            my_logf(LL_DEBUG, LP_DATETIME, "trigger_alert = %d", trigger_alert);*/
+        int increase_seq = TRUE;
 
-            int i;
-            for (i = 0; i < chk->nb_alerts; ++i) {
-                int trigger_alert_by_alert = trigger_alert;
-                struct alert_t *alrt = &alerts[chk->alert_ctrl[i].idx];
+        if (chk->alert_ctrl[i].nb_failures >= 1
+                && chk->alert_ctrl[i].nb_failures <= retries) {
+            trigger_alert_by_alert = TRUE;
+            increase_seq = FALSE;
+        }
 
-                if (reset_nb_failures)
-                    chk->alert_ctrl[i].nb_failures = 0;
+        // Here we go! We have to trigger the alert, whatever the reason is (check
+        // config or alert config or default config or any combination)
+        if (trigger_alert_by_alert) {
+            if (increase_seq)
+                chk->alert_ctrl[i].trigger_sequence++;
 
-                if (!chk->alert_threshold_set) {
-                    threshold = (int)(alrt->threshold_set ? alrt->threshold :
-                                      DEFAULT_ALERT_THRESHOLD);
-                    if (threshold == chk->nb_consecutive_notok)
-                        trigger_alert_by_alert = TRUE;
-                }
+            /*                    my_logf(LL_DEBUG, LP_DATETIME,*/
+            /*                            "chk trigger sequence = %d, alert trigger sequence = %d",*/
+            /*                            st->trigger_sequence, chk->alert_ctrl[i].trigger_sequence);*/
 
-                if (!chk->alert_repeat_every_set) {
-                    int resend_every = (int)(alrt->repeat_every_set ? alrt->repeat_every :
-                                             DEFAULT_ALERT_REPEAT_EVERY);
-                    if (chk->nb_consecutive_notok - threshold >= resend_every &&
-                            (chk->nb_consecutive_notok - threshold + resend_every) % resend_every ==
-                            0) {
-                        int repm = (int)(alrt->repeat_max_set ? alrt->repeat_max : repeat_max);
-                        trigger_alert_by_alert = (repm < 0 ? TRUE :
-                                                  (chk->alert_ctrl[i].trigger_sequence
-                                                   <= repm));
-                    }
-                }
+            struct exec_alert_t exec_alert = { st->status, as, alrt, &chk->alert_ctrl[i], lc,
+                       &my_now, &chk->alert_info, &chk->last_status_change,
+                       st->nb_consecutive_notok, chk->display_name, chk->srv.server,
+                       NULL, 0, NULL
+            };
 
-                int retries = (int)(alrt->retries_set ? alrt->retries :
-                                    DEFAULT_ALERT_RETRIES);
-                if (chk->alert_ctrl[i].alert_status == AS_FAIL && as == AS_RECOVERY) {
-                    if (chk->alert_recovery_set && chk->alert_recovery) {
-                        trigger_alert_by_alert = TRUE;
-                    } else if (!chk->alert_recovery_set) {
-                        if (alrt->recovery_set && alrt->recovery) {
-                            trigger_alert_by_alert = TRUE;
-                        } else if (!alrt->recovery_set) {
-                            if (!trigger_alert_by_alert)
-                                trigger_alert_by_alert = DEFAULT_ALERT_RECOVERY;
-                        }
-                    }
-                } else if (chk->alert_ctrl[i].alert_status == AS_RECOVERY
-                           && chk->alert_ctrl[i].nb_failures <= retries) {
-                    trigger_alert_by_alert = TRUE;
+            int r = execute_alert(&exec_alert);
+
+            my_logf(LL_DEBUG, LP_DATETIME, "Executed alert, result = %d", r);
+
+            if (r != 0) {
+                chk->alert_ctrl[i].nb_failures++;
+                if (as != AS_NOTHING)
+                    chk->alert_ctrl[i].alert_status = as;
+
+                if (chk->alert_ctrl[i].nb_failures > retries) {
+                    chk->alert_ctrl[i].nb_failures = 0;
+                    if (chk->alert_ctrl[i].alert_status == AS_RECOVERY)
+                        chk->alert_ctrl[i].alert_status = AS_NOTHING;
+                }
+            } else {
+                if (as == AS_NOTHING) {
+                    chk->alert_ctrl[i].trigger_sequence = 0;
                 }
+                chk->alert_ctrl[i].nb_failures = 0;
+                chk->alert_ctrl[i].alert_status = (as == AS_RECOVERY ? AS_NOTHING : as);
+            }
+        } else if (as == AS_NOTHING) {
+            chk->alert_ctrl[i].alert_status = AS_NOTHING;
+            chk->alert_ctrl[i].trigger_sequence = 0;
+            chk->alert_ctrl[i].nb_failures = 0;
+        }
+    }
+}
+
+//
+// Main loop
+//
+void almost_neverending_loop() {
+
+    if (g_test_mode == 3) {
+        my_logf(LL_DEBUG, LP_DATETIME,
+                "Test mode 3: waiting to be at the middle of a second elapse to start");
+        int wday;
+        int year;
+        int month;
+        int day;
+        int hour;
+        int minute;
+        int second;
+        long int usec;
+        long int gmtoff;
+        while (usec >= 500000)
+            get_datetime_of_day(&wday, &year, &month, &day, &hour, &minute, &second,
+                                &usec,
+                                &gmtoff);
+        while (usec < 500000)
+            get_datetime_of_day(&wday, &year, &month, &day, &hour, &minute, &second,
+                                &usec,
+                                &gmtoff);
+    }
 
-                int increase_seq = TRUE;
+#ifdef MY_WINDOWS
+    ntsvc_SetServiceStatus(SERVICE_RUNNING,
+                           SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN);
+#endif
 
-                if (chk->alert_ctrl[i].nb_failures >= 1
-                        && chk->alert_ctrl[i].nb_failures <= retries) {
-                    trigger_alert_by_alert = TRUE;
-                    increase_seq = FALSE;
+#ifdef MY_LINUX
+    // Statuses of checks performed ahead of the main loop below, either by
+    // the epoll TCP engine, by parallel program runs or by worker processes
+    int *round_statuses = NULL;
+    if (g_check_workers >= 2 || g_check_processes >= 2
+            || g_tcp_engine == TE_EPOLL || g_program_parallel >= 2) {
+        round_statuses = (int *)MYMALLOC(sizeof(int) * (unsigned long int)(
+                                             g_nb_checks + 1), round_statuses);
+    }
+    if (g_check_processes >= 2)
+        shards_start();
+#endif
+
+    sched_init();
+    // When there is no check at all, rounds still occur every check_interval
+    long long int idle_due = sched_now();
+
+    int sleeping = FALSE;
+    while (!service_stop_requested) {
+        if (reload_requested) {
+            reload_requested = FALSE;
+            if (config_reload()) {
+#ifdef MY_LINUX
+                if (round_statuses != NULL)
+                    round_statuses = (int *)MYREALLOC(round_statuses,
+                                                      sizeof(int) * (unsigned long int)(g_nb_checks + 1));
+                // Check processes work on a copy of checks[]
+                if (g_check_processes >= 2) {
+                    shards_stop();
+                    shards_start();
                 }
+#endif
+                sched_reload();
+            }
+        }
+        long long int now = sched_now();
+        if (run_now_requested) {
+            run_now_requested = FALSE;
+            my_logs(LL_NORMAL, LP_DATETIME, "Request received to do checks now");
+            sched_all_due_now(now);
+            idle_due = now;
+        }
+        long long int due = (sched_heap_len >= 1 ?
+                             check_states[sched_heap[0]].next_due : idle_due);
+        if (due > now) {
+            if (g_test_mode >= 1) {
+                sched_virtual_now = due;
+                continue;
+            }
+            long long int delay = due - now;
+            if (!sleeping) {
+                my_logf(LL_NORMAL, LP_DATETIME,
+                        "Now sleeping for %i second(s) (interval = %li)",
+                        (int)((delay + 999) / 1000), g_check_interval);
+                sleeping = TRUE;
+            }
+#ifdef MY_LINUX
+            if (g_wait_timer_fd >= 0 && g_wait_signal_fd >= 0) {
+                sched_wait(due);
+                continue;
+            }
+#endif
+            long long int this_sleep = (delay < SLEEP_STEPS * 1000 ? delay :
+                                        SLEEP_STEPS * 1000);
+            my_logf(LL_DEBUG, LP_DATETIME, "Will sleep %lli millisecond(s)",
+                    this_sleep);
+            my_logf(LL_DEBUG, LP_DATETIME,
+                    "Sleeping duration remaining after this one: %lli millisecond(s)",
+                    delay - this_sleep);
 
-                // Here we go! We have to trigger the alert, whatever the reason is (check
-                // config or alert config or default config or any combination)
-                if (trigger_alert_by_alert) {
-                    if (increase_seq)
-                        chk->alert_ctrl[i].trigger_sequence++;
+            dbg_write("Now sleeping for %lli millisecond(s)\n", this_sleep);
 
-                    /*                    my_logf(LL_DEBUG, LP_DATETIME,*/
-                    /*                            "chk trigger sequence = %d, alert trigger sequence = %d",*/
-                    /*                            chk->trigger_sequence, chk->alert_ctrl[i].trigger_sequence);*/
+            os_sleep_until_ms(now + this_sleep);
+            continue;
+        }
+        sleeping = FALSE;
+        sched_record_drift(due, now);
 
-                    struct exec_alert_t exec_alert = { chk->status, as, alrt, &chk->alert_ctrl[i], lc,
-                               &my_now, &chk->alert_info, &chk->last_status_change,
-                               chk->nb_consecutive_notok, chk->display_name, chk->srv.server,
-                               NULL, 0, NULL
-                    };
+        ++loop_count;
+        int lc = (int)loop_count;
 
-                    int r = execute_alert(&exec_alert);
+        int II;
 
-                    my_logf(LL_DEBUG, LP_DATETIME, "Executed alert, result = %d", r);
+        // Pick checks that are due
+        for (II = 0; II < g_nb_checks; ++II)
+            check_states[II].is_due = FALSE;
+        while (sched_heap_len >= 1 && check_states[sched_heap[0]].next_due <= now)
+            check_states[sched_pop()].is_due = TRUE;
 
-                    if (r != 0) {
-                        chk->alert_ctrl[i].nb_failures++;
-                        if (as != AS_NOTHING)
-                            chk->alert_ctrl[i].alert_status = as;
+        my_logs(LL_NORMAL, LP_DATETIME, "Starting check...");
 
-                        if (chk->alert_ctrl[i].nb_failures > retries) {
-                            chk->alert_ctrl[i].nb_failures = 0;
-                            if (chk->alert_ctrl[i].alert_status == AS_RECOVERY)
-                                chk->alert_ctrl[i].alert_status = AS_NOTHING;
-                        }
-                    } else {
-                        if (as == AS_NOTHING) {
-                            chk->alert_ctrl[i].trigger_sequence = 0;
-                        }
-                        chk->alert_ctrl[i].nb_failures = 0;
-                        chk->alert_ctrl[i].alert_status = (as == AS_RECOVERY ? AS_NOTHING : as);
-                    }
-                } else if (as == AS_NOTHING) {
-                    chk->alert_ctrl[i].alert_status = AS_NOTHING;
-                    chk->alert_ctrl[i].trigger_sequence = 0;
-                    chk->alert_ctrl[i].nb_failures = 0;
+        struct timeval tv0;
+        if (gettimeofday(&tv0, NULL) == GETTIMEOFDAY_ERROR)
+            fatal_error("File %s, line %i, gettimeofday() error", __FILE__, __LINE__);
+        long long int round_start = os_monotonic_ms();
+
+#ifdef MY_LINUX
+        if (round_statuses != NULL) {
+            for (II = 0; II < g_nb_checks; ++II)
+                round_statuses[II] = ST_UNDEF;
+        }
+#endif
+
+        // Checks are performed level by level in the dependency graph, so
+        // that the status of the checks a check depends on is known when it
+        // comes its turn.
+        int level;
+        for (level = 0; level < g_nb_dep_levels && !service_stop_requested;
+                ++level) {
+
+            for (II = 0; II < g_nb_checks; ++II) {
+                const struct check_state_t *st = &check_states[II];
+                if (st->is_valid && st->is_due && st->dep_level == level)
+                    check_update_suppressed(&checks[II]);
+            }
+
+#ifdef MY_LINUX
+            if (round_statuses != NULL) {
+                if (g_tcp_engine == TE_EPOLL)
+                    perform_checks_tcp_multiplexed(round_statuses, level);
+                if (g_program_parallel >= 2) {
+                    perform_checks_plugin_parallel(round_statuses, level);
+                    perform_checks_program_parallel(round_statuses, level);
+                }
+                if (g_check_processes >= 2)
+                    perform_checks_with_shards(round_statuses, level);
+                else if (g_check_workers >= 2)
+                    perform_checks_with_workers(round_statuses, level);
+            }
+#endif
+
+            for (II = 0; II < g_nb_checks; ++II) {
+
+                if (service_stop_requested)
+                    break;
+
+                const struct check_state_t *st = &check_states[II];
+                if (!st->is_valid || !st->is_due || st->dep_level != level)
+                    continue;
+                struct check_t *chk = &checks[II];
+
+                int status = ST_UNKNOWN;
+                if (!st->is_suppressed) {
+#ifdef MY_LINUX
+                    if (round_statuses != NULL && round_statuses[II] != ST_UNDEF)
+                        status = round_statuses[II];
+                    else
+#endif
+                        status = perform_check(chk);
                 }
+
+                manage_check_status(chk, status, lc, &tv0);
             }
         }
 
+        // Schedule next execution of checks just performed
+        long long int now_after = sched_now();
+        for (II = 0; II < g_nb_checks; ++II) {
+            if (!check_states[II].is_valid || !check_states[II].is_due)
+                continue;
+            sched_set_next_due(&checks[II], now_after);
+            sched_push(II);
+        }
+        idle_due += (long long int)g_check_interval * 1000;
+        if (idle_due < now_after)
+            idle_due = now_after;
+
         struct tm now_done;
         set_current_tm(&now_done);
 
-        struct timeval tv1;
-        if (gettimeofday(&tv1, NULL) == GETTIMEOFDAY_ERROR)
-            fatal_error("File %s, line %i, gettimeofday() error", __FILE__, __LINE__);
-
-        float elapsed = (float)((long signed int)tv1.tv_sec - (long signed int)
-                                tv0.tv_sec);
-        elapsed += ((float)tv1.tv_usec - (float)tv0.tv_usec) / 1000000;
+        float elapsed = (float)(os_monotonic_ms() - round_start) / 1000;
         if (g_test_mode >= 1)
             elapsed = .12345F;
 
@@ -2692,19 +5832,18 @@ void almost_neverending_loop() {
 
         manage_output(&now_done, elapsed);
 
-        my_logf(LL_NORMAL, LP_DATETIME, "Check done in %fs", elapsed);
+        if (g_state_file_set)
+            state_save();
 
-//
-// Sleep before next loop
-//
+#ifdef MY_LINUX
+        dns_log_stats(shards_dns_nb_names());
+#else
+        dns_log_stats(0);
+#endif
+        ssl_log_stats();
+        my_logf(LL_NORMAL, LP_DATETIME, "Check done in %fs", elapsed);
 
-        if (g_check_interval && g_test_mode == 0) {
-            delay = (int)g_check_interval - (int)elapsed;
-            if (delay < 1)
-                delay = 1;
-            if (delay > g_check_interval)
-                delay = (int)g_check_interval;
-        } else if (g_test_mode >=1) {
+        if (g_test_mode >=1) {
             if (g_test_mode == 1)
                 break;
             else if (g_test_mode == 2 && lc == TEST2_NB_LOOPS)
@@ -2713,6 +5852,13 @@ void almost_neverending_loop() {
                 break;
         }
     }
+
+#ifdef MY_LINUX
+    if (round_statuses != NULL)
+        MYFREE(round_statuses);
+    shards_stop();
+#endif
+    sched_destroy();
 }
 
 void terminate(const char *how) {
@@ -2727,6 +5873,7 @@ void terminate(const char *how) {
     if (g_web_server_pid_is_set) {
         kill(g_web_server_pid, SIGTERM);
     }
+    shards_kill();
 #endif
 
     if (service_stop_requested) {
@@ -2738,8 +5885,11 @@ void terminate(const char *how) {
 
     destroy_checks();
     destroy_alerts();
-    if (loops != NULL)
-        MYFREE(loops);
+    plugin_libs_destroy();
+#ifdef MY_LINUX
+    sched_wait_destroy();
+    prg_server_stop();
+#endif
 
     my_logs(LL_NORMAL, LP_DATETIME, PACKAGE_NAME);
     my_logs(LL_NORMAL, LP_DATETIME, how);
@@ -2770,6 +5920,20 @@ static void sigint_handler(int sig) {
     exit(EXIT_FAILURE);
 }
 
+#ifdef MY_LINUX
+static void sigrunnow_handler(int sig) {
+    UNUSED(sig);
+
+    run_now_requested = TRUE;
+}
+
+static void sigreload_handler(int sig) {
+    UNUSED(sig);
+
+    reload_requested = TRUE;
+}
+#endif
+
 //
 // Manage errors with provided options
 //
@@ -2809,6 +5973,12 @@ void printhelp() {
     printf("    -d --daemon              Run as a daemon (Linux) / service (Windows)\n");
     printf("                             Linux: in the ini file, you must set the html_directory\n");
     printf("                             variable (in the [General] section) to an absolute path.\n");
+    printf("         --history NAME      Print the results of check NAME recorded in\n");
+    printf("                             history_directory and quit (Linux only)\n");
+    printf("         --from T, --to T    Restrict --history to results from time T\n");
+    printf("                             included, to time T excluded (seconds since epoch)\n");
+    printf("         --metric LABEL      With --history, print the values of the metric\n");
+    printf("                             LABEL found in the performance data of the check\n");
     printf("         --install           Install NT service (Windows only)\n");
     printf("         --uninstall         Uninstall NT service (Windows only)\n");
 }
@@ -2855,6 +6025,10 @@ void parse_options(int argc, char *argv[]) {
         {"install", no_argument, NULL, '2'},
         {"uninstall", no_argument, NULL, '3'},
         {"daemon", no_argument, NULL, 'd'},
+        {"history", required_argument, NULL, '5'},
+        {"from", required_argument, NULL, '6'},
+        {"to", required_argument, NULL, '7'},
+        {"metric", required_argument, NULL, '8'},
 #ifdef MY_WINDOWS
         {"webserver", no_argument, NULL, '4'},
 #endif
@@ -2870,6 +6044,8 @@ void parse_options(int argc, char *argv[]) {
     strncpy(g_web_log_file, DEFAULT_WEB_LOGFILE, sizeof(g_web_log_file));
     strncpy(g_cfg_file, DEFAULT_CFGFILE, sizeof(g_cfg_file));
     strncpy(g_test_alert, "", sizeof(g_test_alert));
+    strncpy(g_history_query, "", sizeof(g_history_query));
+    strncpy(g_history_metric, "", sizeof(g_history_metric));
 
     while (1) {
 
@@ -2932,6 +6108,24 @@ void parse_options(int argc, char *argv[]) {
             g_daemon = TRUE;
             break;
 
+        case '5':
+            strncpy(g_history_query, optarg, sizeof(g_history_query));
+            g_history_query[sizeof(g_history_query) - 1] = '\0';
+            break;
+
+        case '6':
+            g_history_from = atoll(optarg);
+            break;
+
+        case '7':
+            g_history_to = atoll(optarg);
+            break;
+
+        case '8':
+            strncpy(g_history_metric, optarg, sizeof(g_history_metric));
+            g_history_metric[sizeof(g_history_metric) - 1] = '\0';
+            break;
+
         case '0':
             g_laxist = TRUE;
             break;
@@ -3030,6 +6224,49 @@ void check_t_check(struct check_t *chk, const char *cf, int line_number,
                     cf, line_number);
             is_valid = FALSE;
         }
+        if (chk->prg_timeout_set && chk->prg_timeout < 0) {
+            my_logf(LL_ERROR, LP_DATETIME,
+                    "Configuration file '%s', section of line %i: program_timeout must be 0 or more, discarding check",
+                    cf, line_number);
+            is_valid = FALSE;
+        }
+    } else if (chk->method_set && chk->method == CM_PLUGIN) {
+        if (!chk->plg_file_set) {
+            my_logf(LL_ERROR, LP_DATETIME,
+                    "Configuration file '%s', section of line %i: no plugin file defined, discarding check",
+                    cf, line_number);
+            is_valid = FALSE;
+        } else {
+            char err[SMALLSTRSIZE];
+            chk->plugin = plugin_load(chk->plg_file, err, sizeof(err));
+            if (chk->plugin == NULL) {
+                my_logf(LL_ERROR, LP_DATETIME,
+                        "Configuration file '%s', section of line %i: unable to load plugin '%s': %s, discarding check",
+                        cf, line_number, chk->plg_file, err);
+                is_valid = FALSE;
+            }
+        }
+        if (chk->plg_timeout_set && chk->plg_timeout < 0) {
+            my_logf(LL_ERROR, LP_DATETIME,
+                    "Configuration file '%s', section of line %i: plugin_timeout must be 0 or more, discarding check",
+                    cf, line_number);
+            is_valid = FALSE;
+        }
+#ifdef MY_WINDOWS
+        if (chk->plg_isolate) {
+            my_logf(LL_WARNING, LP_DATETIME,
+                    "Configuration file '%s', section of line %i: plugin_isolate not supported under Windows, plugin will be run by netmon process",
+                    cf, line_number);
+            chk->plg_isolate = FALSE;
+        }
+#endif
+    }
+
+    if (chk->interval_set && chk->interval < 1) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "Configuration file '%s', section of line %i: interval must be 1 or more, discarding check",
+                cf, line_number);
+        is_valid = FALSE;
     }
 
     chk->is_valid = is_valid;
@@ -3106,6 +6343,12 @@ void alert_t_check(struct alert_t *alrt, const char *cf, int line_number,
                     cf, line_number);
             is_valid = FALSE;
         }
+        if (alrt->prg_timeout_set && alrt->prg_timeout < 0) {
+            my_logf(LL_ERROR, LP_DATETIME,
+                    "Configuration file '%s', section of line %i: program_timeout must be 0 or more, discarding alert",
+                    cf, line_number);
+            is_valid = FALSE;
+        }
     } else if (alrt->method == AM_LOG) {
         if (!alrt->log_file_set) {
             my_logf(LL_ERROR, LP_DATETIME,
@@ -3187,7 +6430,8 @@ char *get_path(char *f) {
 }
 
 //
-// Make sure g_html_directory is correct given the environment ->
+// Make sure g_html_directory (and any path given in the ini file) is
+// correct given the environment ->
 //   If the program runs normally (not a daemon/service), g_html_directory
 //   is just what's been provided in the ini file html_directory variable
 //   => DEFAULT_HTML_DIRECTORY if variable not provided in the ini, which
@@ -3201,26 +6445,53 @@ char *get_path(char *f) {
 //   In all cases, if g_html_directory is absolute, it IS the target
 //   directory.
 //
-void build_definitive_html_directory() {
+void build_definitive_path(char *path, const size_t path_len) {
     char log_base[MAX_PATH];
     char target[MAX_PATH];
     strncpy(log_base, g_log_file, sizeof(log_base));
     log_base[sizeof(log_base) - 1] = '\0';
     get_path(log_base);
 
-    build_file_complete_name(log_base, g_html_directory, target,
-                             sizeof(target));
-    strncpy(g_html_directory, target, sizeof(g_html_directory));
-    g_html_directory[sizeof(g_html_directory) - 1] = '\0';
+    build_file_complete_name(log_base, path, target, sizeof(target));
+    strncpy(path, target, path_len);
+    path[path_len - 1] = '\0';
+}
+
+void build_definitive_html_directory() {
+    build_definitive_path(g_html_directory, sizeof(g_html_directory));
+}
+
+//
+// Add a key=value line of a check section to the hash of its definition
+//
+static unsigned int def_hash_add(unsigned int h, const char *key,
+                                 const char *value) {
+    char lkey[SMALLSTRSIZE];
+    size_t i;
+    for (i = 0; key[i] != '\0' && i < sizeof(lkey) - 1; ++i)
+        lkey[i] = (char)tolower((unsigned char)key[i]);
+    lkey[i] = '\0';
+    h = fnv1a_hash_update(h, lkey);
+    h = fnv1a_hash_update(h, "=");
+    h = fnv1a_hash_update(h, value);
+    return fnv1a_hash_update(h, "\n");
 }
 
 //
 // Parse the ini file
+// When is_reload is TRUE, the [general] section is skipped (changes in it
+// need a restart) and an ini file that cannot be opened is not fatal.
+// Return FALSE if the ini file could not be opened, TRUE otherwise.
 //
-void read_configuration_file(const char *cf, int *nb_errors) {
+int read_configuration_file(const char *cf, const int is_reload,
+                            int *nb_errors) {
     FILE *FCFG = NULL;
     if ((FCFG = my_fopen(cf, "r", 1, 0)) == NULL) {
-        fatal_error("Configuration file '%s': unable to open", cf);
+        if (!is_reload)
+            fatal_error("Configuration file '%s': unable to open", cf);
+        my_logf(LL_ERROR, LP_DATETIME, "Configuration file '%s': unable to open",
+                cf);
+        return FALSE;
     }
     my_logf(LL_VERBOSE, LP_DATETIME, "Reading configuration from '%s'", cf);
 
@@ -3236,6 +6507,7 @@ void read_configuration_file(const char *cf, int *nb_errors) {
 
     int cur_check = -1;
     int cur_alert = -1;
+    int skip_section = FALSE;
 
     while ((nb_bytes = my_getline(&line, &len, FCFG)) != -1) {
         line[nb_bytes - 1] = '\0';
@@ -3284,6 +6556,7 @@ void read_configuration_file(const char *cf, int *nb_errors) {
 
                 int sec = find_string(l_sections_names,
                                       sizeof(l_sections_names) / sizeof(*l_sections_names), section_name);
+                skip_section = (sec == CS_GENERAL && is_reload);
                 if (sec == CS_GENERAL) {
                     read_status = CS_GENERAL;
                 } else {
@@ -3292,28 +6565,24 @@ void read_configuration_file(const char *cf, int *nb_errors) {
 
                     if (sec == CS_CHECK) {
                         ++cur_check;
-                        if (cur_check >= (signed)(sizeof(checks) / sizeof(*checks))) {
-                            --cur_check;
-                            (*nb_errors)++;
-                            my_logf(LL_ERROR, LP_DATETIME,
-                                    "Configuration file '%s', line %i: reached max number of checks (%lu)",
-                                    cf, line_number, (long unsigned int)(sizeof(checks) / sizeof(*checks)));
-                        } else {
-                            read_status = CS_CHECK;
-                            check_t_create(&chk00);
+                        if (cur_check >= g_nb_checks_alloc) {
+                            g_nb_checks_alloc = (g_nb_checks_alloc == 0 ?
+                                                 CHECK_ARRAY_INITIAL_SIZE : g_nb_checks_alloc * 2);
+                            checks = (struct check_t *)MYREALLOC(checks,
+                                                                 (unsigned long int)g_nb_checks_alloc * sizeof(struct check_t));
                         }
+                        read_status = CS_CHECK;
+                        check_t_create(&chk00);
                     } else if (sec == CS_ALERT) {
                         ++cur_alert;
-                        if (cur_alert >= (signed)(sizeof(alerts) / sizeof(*alerts))) {
-                            --cur_alert;
-                            (*nb_errors)++;
-                            my_logf(LL_ERROR, LP_DATETIME,
-                                    "Configuration file '%s', line %i: reached max number of alerts (%lu)",
-                                    cf, line_number, (long unsigned int)(sizeof(alerts) / sizeof(*alerts)));
-                        } else {
-                            read_status = CS_ALERT;
-                            alert_t_create(&alrt00);
+                        if (cur_alert >= g_nb_alerts_alloc) {
+                            g_nb_alerts_alloc = (g_nb_alerts_alloc == 0 ?
+                                                 ALERT_ARRAY_INITIAL_SIZE : g_nb_alerts_alloc * 2);
+                            alerts = (struct alert_t *)MYREALLOC(alerts,
+                                                                 (unsigned long int)g_nb_alerts_alloc * sizeof(struct alert_t));
                         }
+                        read_status = CS_ALERT;
+                        alert_t_create(&alrt00);
                     } else {
                         (*nb_errors)++;
                         my_logf(LL_ERROR, LP_DATETIME,
@@ -3325,6 +6594,8 @@ void read_configuration_file(const char *cf, int *nb_errors) {
             }
             break;
         default:
+            if (skip_section)
+                break;
             e = b;
             slen = 0;
             while (*e != '\0' && *e != '=') {
@@ -3365,6 +6636,9 @@ void read_configuration_file(const char *cf, int *nb_errors) {
                     value[l - 1] = '\0';
                     ++value;
                 }
+                if (read_status == CS_CHECK)
+                    chk00.def_hash = def_hash_add(chk00.def_hash, key, value);
+
                 if (strlen(key) == 0) {
                     (*nb_errors)++;
                     my_logf(LL_ERROR, LP_DATETIME,
@@ -3531,11 +6805,27 @@ void read_configuration_file(const char *cf, int *nb_errors) {
     assert(g_nb_checks == cur_check + 1)
     assert(g_nb_alerts == cur_alert + 1)
 
+    // Give back unused elements
+    if (g_nb_checks >= 1 && g_nb_checks < g_nb_checks_alloc) {
+        g_nb_checks_alloc = g_nb_checks;
+        checks = (struct check_t *)MYREALLOC(checks,
+                                             (unsigned long int)g_nb_checks_alloc * sizeof(struct check_t));
+    }
+    if (g_nb_alerts >= 1 && g_nb_alerts < g_nb_alerts_alloc) {
+        g_nb_alerts_alloc = g_nb_alerts;
+        alerts = (struct alert_t *)MYREALLOC(alerts,
+                                             (unsigned long int)g_nb_alerts_alloc * sizeof(struct alert_t));
+    }
+
     if (line != NULL)
         MYFREE(line);
 
     fclose(FCFG);
 
+    g_print_log = save_g_print_log;
+    if (is_reload)
+        return TRUE;
+
     build_definitive_html_directory();
 
     strncpy(g_html_complete_file_name, g_html_directory,
@@ -3545,7 +6835,10 @@ void read_configuration_file(const char *cf, int *nb_errors) {
 
     dbg_write("Output HTML file = %s\n", g_html_complete_file_name);
 
-    g_print_log = save_g_print_log;
+    strncpy(g_metrics_complete_file_name, g_html_directory,
+            sizeof(g_metrics_complete_file_name));
+    fs_concatene(g_metrics_complete_file_name, FILE_METRICS,
+                 sizeof(g_metrics_complete_file_name));
 
     if (!g_log_level_updated_by_option && g_ini_asked_log_level_set
             && g_ini_asked_log_level != FIND_STRING_NOT_FOUND) {
@@ -3580,6 +6873,7 @@ void read_configuration_file(const char *cf, int *nb_errors) {
 
 #endif
 
+    return TRUE;
 }
 
 //
@@ -3659,6 +6953,155 @@ void identify_alerts(int *nb_errors) {
 
 }
 
+//
+// Identify a check by its display name
+// Returns -1 if the check is not found
+//
+int find_check(const char *display_name) {
+    int i;
+    for (i = 0; i < g_nb_checks; ++i) {
+        if (checks[i].is_valid) {
+            if (strcasecmp(checks[i].display_name, display_name) == 0)
+                break;
+        }
+    }
+    return (i < g_nb_checks ? i : -1);
+}
+
+//
+// Identify checks listed in the depends_on option of checks, then sort
+// checks by level in the dependency graph: a check is performed only once
+// the checks it depends on have been, during the same round.
+// Checks involved in a circular dependency are discarded.
+//
+void identify_dependencies(int *nb_errors) {
+    int i;
+    int j;
+    int k;
+
+    int save_g_print_log = g_print_log;
+    g_print_log = TRUE;
+
+    for (i = 0; i < g_nb_checks; ++i) {
+        struct check_t *chk = &checks[i];
+        chk->dep_level = 0;
+        if (!chk->is_valid || !chk->depends_on_set)
+            continue;
+        char *p = chk->depends_on;
+        int n = 1;
+        for (j = 0; p[j] != '\0'; ++j) {
+            if (p[j] == CFGK_LIST_SEPARATOR)
+                ++n;
+        }
+        chk->parents = (int *)MYMALLOC(sizeof(int) * (long unsigned int)n,
+                                       chk->parents);
+        size_t b = strlen(chk->depends_on) + 2;
+
+        char *t = (char *)MYMALLOC(b, t);
+        strncpy(t, chk->depends_on, b);
+
+        char *next_curs = t;
+        int idx = 0;
+        while (next_curs != NULL) {
+            char *curs = next_curs;
+            char *fc = curs;
+            for (; (*fc) != CFGK_LIST_SEPARATOR && (*fc) != '\0'; ++fc)
+                ;
+            if ((*fc) == CFGK_LIST_SEPARATOR) {
+                (*fc) = '\0';
+                next_curs = fc + 1;
+            } else {
+                next_curs = NULL;
+            }
+            curs = trim(curs);
+            if ((k = find_check(curs)) < 0) {
+                (*nb_errors)++;
+                my_logf(LL_ERROR, LP_DATETIME, "Check '%s': depends on unknown check '%s'",
+                        chk->display_name, curs);
+            } else if (k == i) {
+                (*nb_errors)++;
+                my_logf(LL_ERROR, LP_DATETIME, "Check '%s': cannot depend on itself",
+                        chk->display_name);
+            } else {
+                chk->parents[idx] = k;
+                ++idx;
+            }
+        }
+        chk->nb_parents = idx;
+        MYFREE(t);
+    }
+
+    // Compute levels (Kahn's algorithm): a check is one level above the
+    // highest of its parents.
+    // children[first_child[p]] .. children[first_child[p + 1] - 1] are the
+    // checks that depend on check number p.
+    int *first_child = (int *)MYMALLOC(sizeof(int) * (long unsigned int)(
+                                           g_nb_checks + 2), first_child);
+    for (i = 0; i <= g_nb_checks + 1; ++i)
+        first_child[i] = 0;
+    int nb_links = 0;
+    for (i = 0; i < g_nb_checks; ++i) {
+        if (!checks[i].is_valid)
+            continue;
+        for (j = 0; j < checks[i].nb_parents; ++j) {
+            first_child[checks[i].parents[j] + 2]++;
+            ++nb_links;
+        }
+    }
+    for (i = 2; i <= g_nb_checks + 1; ++i)
+        first_child[i] += first_child[i - 1];
+    int *children = (int *)MYMALLOC(sizeof(int) * (long unsigned int)(
+                                        nb_links + 1), children);
+    for (i = 0; i < g_nb_checks; ++i) {
+        if (!checks[i].is_valid)
+            continue;
+        for (j = 0; j < checks[i].nb_parents; ++j)
+            children[first_child[checks[i].parents[j] + 1]++] = i;
+    }
+
+    int *nb_pending = (int *)MYMALLOC(sizeof(int) * (long unsigned int)(
+                                          g_nb_checks + 1), nb_pending);
+    int *queue = (int *)MYMALLOC(sizeof(int) * (long unsigned int)(
+                                     g_nb_checks + 1), queue);
+    int q_head = 0;
+    int q_tail = 0;
+    for (i = 0; i < g_nb_checks; ++i) {
+        nb_pending[i] = (checks[i].is_valid ? checks[i].nb_parents : -1);
+        if (nb_pending[i] == 0)
+            queue[q_tail++] = i;
+    }
+    g_nb_dep_levels = 1;
+    while (q_head < q_tail) {
+        int p = queue[q_head++];
+        if (checks[p].dep_level + 1 > g_nb_dep_levels)
+            g_nb_dep_levels = checks[p].dep_level + 1;
+        for (j = first_child[p]; j < first_child[p + 1]; ++j) {
+            int c = children[j];
+            if (checks[c].dep_level < checks[p].dep_level + 1)
+                checks[c].dep_level = checks[p].dep_level + 1;
+            if (--nb_pending[c] == 0)
+                queue[q_tail++] = c;
+        }
+    }
+    for (i = 0; i < g_nb_checks; ++i) {
+        if (nb_pending[i] > 0) {
+            (*nb_errors)++;
+            my_logf(LL_ERROR, LP_DATETIME,
+                    "Check '%s': circular dependency (direct or inherited), discarding check",
+                    checks[i].display_name);
+            checks[i].is_valid = FALSE;
+            --g_nb_valid_checks;
+        }
+    }
+    MYFREE(queue);
+    MYFREE(nb_pending);
+    MYFREE(children);
+    MYFREE(first_child);
+
+    g_print_log = save_g_print_log;
+
+}
+
 //
 // Log a long int value
 //
@@ -3713,6 +7156,17 @@ void checks_display() {
         } else if (chk->method == CM_PROGRAM) {
             d_s("       PROGRAM/command                      = ", chk->prg_command_set,
                 chk->prg_command);
+            d_i("       PROGRAM/timeout                      = ", chk->prg_timeout_set,
+                chk->prg_timeout);
+        } else if (chk->method == CM_PLUGIN) {
+            d_s("       PLUGIN/file                          = ", chk->plg_file_set,
+                chk->plg_file);
+            d_s("       PLUGIN/args                          = ", chk->plg_args_set,
+                chk->plg_args);
+            d_i("       PLUGIN/isolate                       = ", chk->plg_isolate_set,
+                chk->plg_isolate);
+            d_i("       PLUGIN/timeout                       = ", chk->plg_timeout_set,
+                chk->plg_timeout);
         } else if (chk->method == CM_LOOP) {
             d_s("       LOOP/id                                      = ",
                 chk->loop_id_set,
@@ -3774,6 +7228,12 @@ void checks_display() {
             chk->alert_repeat_every);
         d_i("       alert_repeat_max     = ", chk->alert_repeat_max_set,
             chk->alert_repeat_max);
+        if (chk->interval_set)
+            d_i("       interval             = ", TRUE, chk->interval);
+        if (chk->depends_on_set) {
+            d_s("       depends_on           = ", TRUE, chk->depends_on);
+            d_i("       dependency level     = ", TRUE, chk->dep_level);
+        }
     }
     assert(c == g_nb_valid_checks)
 }
@@ -3828,6 +7288,8 @@ void alerts_display() {
         } else if (alrt->method == AM_PROGRAM) {
             d_s("       program/command     = ", alrt->prg_command_set,
                 alrt->prg_command);
+            d_i("       program/timeout     = ", alrt->prg_timeout_set,
+                alrt->prg_timeout);
         } else if (alrt->method == AM_LOG) {
             d_s("       log/log_file            = ", alrt->log_file_set,
                 alrt->log_file);
@@ -3842,6 +7304,35 @@ void config_display() {
     my_logf(LL_VERBOSE, LP_DATETIME, "check_interval = %li", g_check_interval);
     my_logf(LL_VERBOSE, LP_DATETIME, "keep_last_status = %li",
             g_nb_keep_last_status);
+    if (g_check_workers_set)
+        my_logf(LL_VERBOSE, LP_DATETIME, "check_workers = %li", g_check_workers);
+    if (g_check_processes_set)
+        my_logf(LL_VERBOSE, LP_DATETIME, "check_processes = %li",
+                g_check_processes);
+    if (g_program_timeout_set)
+        my_logf(LL_VERBOSE, LP_DATETIME, "program_timeout = %li",
+                g_program_timeout);
+    if (g_program_parallel_set)
+        my_logf(LL_VERBOSE, LP_DATETIME, "program_parallel = %li",
+                g_program_parallel);
+    if (g_state_file_set)
+        my_logf(LL_VERBOSE, LP_DATETIME, "state_file = %s", g_state_file);
+    if (g_history_directory_set) {
+        my_logf(LL_VERBOSE, LP_DATETIME, "history_directory = %s",
+                g_history_directory);
+        my_logf(LL_VERBOSE, LP_DATETIME, "history_segment_duration = %li",
+                g_history_segment_duration);
+    }
+    if (g_tcp_engine_set)
+        my_logf(LL_VERBOSE, LP_DATETIME, "tcp_engine = %s",
+                l_tcp_engines[g_tcp_engine]);
+    if (g_dns_timeout_set)
+        my_logf(LL_VERBOSE, LP_DATETIME, "dns_timeout = %li", g_dns_timeout);
+    if (g_dns_cache_ttl_set)
+        my_logf(LL_VERBOSE, LP_DATETIME, "dns_cache_ttl = %li", g_dns_cache_ttl);
+    if (g_dns_negative_ttl_set)
+        my_logf(LL_VERBOSE, LP_DATETIME, "dns_negative_ttl = %li",
+                g_dns_negative_ttl);
     my_logf(LL_VERBOSE, LP_DATETIME, "display_name_width = %li",
             g_display_name_width);
     my_logf(LL_VERBOSE, LP_DATETIME, "html_directory = %s", g_html_directory);
@@ -3889,6 +7380,12 @@ void config_display() {
                     chk->display_name, chk->prg_command,
                     chk->alerts_set ? "alerts: " : "no alert",
                     chk->alerts_set ? list_alerts : "");
+        } else if (chk->method == CM_PLUGIN) {
+            my_logf(LL_NORMAL, LP_DATETIME, "To check: PLUGIN - '%s' [%s%s], %s%s",
+                    chk->display_name, chk->plg_file,
+                    chk->plg_isolate ? ", isolated" : "",
+                    chk->alerts_set ? "alerts: " : "no alert",
+                    chk->alerts_set ? list_alerts : "");
         } else if (chk->method == CM_LOOP) {
             my_logf(LL_NORMAL, LP_DATETIME, "To check: LOOP - '%s', %s, %s(%s), %s%s",
                     chk->display_name,
@@ -3899,6 +7396,279 @@ void config_display() {
     }
 }
 
+//
+// A check whose section did not change takes over the runtime state of the
+// check it replaces
+//
+static void reload_take_over(struct check_t *chk, struct check_t *old,
+                             const struct check_state_t *old_st,
+                             const struct alert_t *old_alerts) {
+    struct check_state_t *st = check_state_of(chk);
+    st->status = old_st->status;
+    st->prev_status = old_st->prev_status;
+    st->nb_consecutive_notok = old_st->nb_consecutive_notok;
+    st->trigger_sequence = old_st->trigger_sequence;
+    st->next_due = old_st->next_due;
+    st->duration_ms = old_st->duration_ms;
+    st->value = old_st->value;
+
+    chk->last_status_change_flag = old->last_status_change_flag;
+    chk->last_status_change = old->last_status_change;
+    chk->alert_info = old->alert_info;
+    chk->loop_send_countdown = old->loop_send_countdown;
+    loop_ring_destroy(&chk->loop_ring);
+    chk->loop_ring = old->loop_ring;
+    loop_ring_create(&old->loop_ring);
+
+    status_hist_destroy(&chk->hist);
+    chk->hist = old->hist;
+    old->hist.bits = NULL;
+    old->hist.size = 0;
+#ifdef MY_LINUX
+    chk->ts_seg = old->ts_seg;
+    ts_segment_init(&old->ts_seg, (int)sizeof(struct ts_record_t));
+#endif
+    chk->loop_uids = old->loop_uids;
+    chk->loop_nb_uids = old->loop_nb_uids;
+    old->loop_uids = NULL;
+    old->loop_nb_uids = 0;
+    strncpy(chk->prg_output, old->prg_output, sizeof(chk->prg_output));
+    check_metrics_destroy(chk);
+    chk->metrics = old->metrics;
+    chk->nb_metrics = old->nb_metrics;
+    old->metrics = NULL;
+    old->nb_metrics = 0;
+    chk->plg_ready = old->plg_ready;
+    chk->plg_state = old->plg_state;
+    old->plg_ready = FALSE;
+    old->plg_state = NULL;
+#ifdef MY_LINUX
+    chk->plg_pid = old->plg_pid;
+    chk->plg_cmd_fd = old->plg_cmd_fd;
+    chk->plg_res_fd = old->plg_res_fd;
+    old->plg_pid = -1;
+    old->plg_cmd_fd = -1;
+    old->plg_res_fd = -1;
+#endif
+
+    int i;
+    int j;
+    for (i = 0; i < chk->nb_alerts; ++i) {
+        struct alert_ctrl_t *ctrl = &chk->alert_ctrl[i];
+        for (j = 0; j < old->nb_alerts; ++j) {
+            const struct alert_ctrl_t *old_ctrl = &old->alert_ctrl[j];
+            if (strcmp(alerts[ctrl->idx].name, old_alerts[old_ctrl->idx].name) == 0) {
+                ctrl->alert_status = old_ctrl->alert_status;
+                ctrl->trigger_sequence = old_ctrl->trigger_sequence;
+                ctrl->nb_failures = old_ctrl->nb_failures;
+                break;
+            }
+        }
+    }
+}
+
+//
+// Reload the ini file (SIGHUP), to be called between rounds.
+// The ini file is read into new checks[] and alerts[] arrays, current ones
+// being put aside. If errors are found (and --laxist is not set), the new
+// arrays are dropped and the current configuration goes on. Otherwise
+// checks whose section did not change (same display_name, same variables)
+// keep their runtime state, other checks start afresh and join the next
+// round, then new arrays replace current ones.
+// The [general] section is not reloaded.
+// Return TRUE if the configuration got replaced.
+//
+int config_reload() {
+    my_logf(LL_NORMAL, LP_DATETIME, "Reloading configuration from '%s'",
+            g_cfg_file);
+
+    struct check_t *old_checks = checks;
+    struct check_state_t *old_states = check_states;
+    int old_nb_checks = g_nb_checks;
+    int old_nb_checks_alloc = g_nb_checks_alloc;
+    int old_nb_valid_checks = g_nb_valid_checks;
+    int old_nb_dep_levels = g_nb_dep_levels;
+    struct alert_t *old_alerts = alerts;
+    int old_nb_alerts = g_nb_alerts;
+    int old_nb_alerts_alloc = g_nb_alerts_alloc;
+    int old_nb_valid_alerts = g_nb_valid_alerts;
+
+    checks = NULL;
+    check_states = NULL;
+    g_nb_checks = 0;
+    g_nb_checks_alloc = 0;
+    g_nb_valid_checks = 0;
+    alerts = NULL;
+    g_nb_alerts = 0;
+    g_nb_alerts_alloc = 0;
+    g_nb_valid_alerts = 0;
+
+    int nb_errors = 0;
+    int ok = read_configuration_file(g_cfg_file, TRUE, &nb_errors);
+    if (ok) {
+        identify_alerts(&nb_errors);
+        identify_dependencies(&nb_errors);
+        if (nb_errors >= 1 && g_laxist) {
+            my_logf(LL_WARNING, LP_DATETIME, "%d error(s) in the ini file, continuing",
+                    nb_errors);
+        } else if (nb_errors >= 1) {
+            my_logf(LL_ERROR, LP_DATETIME,
+                    "%d error(s) found in the ini file, configuration not reloaded",
+                    nb_errors);
+            ok = FALSE;
+        }
+    }
+
+    if (!ok) {
+        destroy_checks();
+        destroy_alerts();
+        checks = old_checks;
+        check_states = old_states;
+        g_nb_checks = old_nb_checks;
+        g_nb_checks_alloc = old_nb_checks_alloc;
+        g_nb_valid_checks = old_nb_valid_checks;
+        g_nb_dep_levels = old_nb_dep_levels;
+        alerts = old_alerts;
+        g_nb_alerts = old_nb_alerts;
+        g_nb_alerts_alloc = old_nb_alerts_alloc;
+        g_nb_valid_alerts = old_nb_valid_alerts;
+        return FALSE;
+    }
+
+    // Next round, according to the current schedule
+    long long int next_round = (sched_heap_len >= 1 ?
+                                old_states[sched_heap[0]].next_due : sched_now());
+
+    check_states_create();
+    struct check_index_t ix;
+    check_index_create(&ix, old_checks, old_nb_checks);
+    int nb_unchanged = 0;
+    int nb_changed = 0;
+    int nb_added = 0;
+    int i;
+    for (i = 0; i < g_nb_checks; ++i) {
+        struct check_t *chk = &checks[i];
+        if (!chk->is_valid)
+            continue;
+        check_t_getready(chk);
+        check_states[i].next_due = next_round;
+        int o = check_index_find(&ix, chk->display_name);
+        if (o < 0) {
+            ++nb_added;
+        } else if (old_checks[o].def_hash != chk->def_hash) {
+            ++nb_changed;
+        } else {
+            ++nb_unchanged;
+            reload_take_over(chk, &old_checks[o], &old_states[o], old_alerts);
+        }
+    }
+    check_index_destroy(&ix);
+
+    // Free the configuration put aside
+    struct check_t *new_checks = checks;
+    struct check_state_t *new_states = check_states;
+    int new_nb_checks = g_nb_checks;
+    int new_nb_checks_alloc = g_nb_checks_alloc;
+    int new_nb_valid_checks = g_nb_valid_checks;
+    struct alert_t *new_alerts = alerts;
+    int new_nb_alerts = g_nb_alerts;
+    int new_nb_alerts_alloc = g_nb_alerts_alloc;
+    int new_nb_valid_alerts = g_nb_valid_alerts;
+    checks = old_checks;
+    check_states = old_states;
+    g_nb_checks = old_nb_checks;
+    alerts = old_alerts;
+    g_nb_alerts = old_nb_alerts;
+    destroy_checks();
+    destroy_alerts();
+    checks = new_checks;
+    check_states = new_states;
+    g_nb_checks = new_nb_checks;
+    g_nb_checks_alloc = new_nb_checks_alloc;
+    g_nb_valid_checks = new_nb_valid_checks;
+    alerts = new_alerts;
+    g_nb_alerts = new_nb_alerts;
+    g_nb_alerts_alloc = new_nb_alerts_alloc;
+    g_nb_valid_alerts = new_nb_valid_alerts;
+
+    checks_display();
+    alerts_display();
+    my_logf(LL_NORMAL, LP_DATETIME,
+            "Configuration reloaded: %i check(s) unchanged, %i changed, %i added, %i removed",
+            nb_unchanged, nb_changed, nb_added,
+            old_nb_valid_checks - nb_unchanged - nb_changed);
+    return TRUE;
+}
+
+#ifdef MY_LINUX
+//
+// Print one record found by history_query
+//
+static void history_timestamp(char *ts, const size_t ts_len,
+                              const long long int time_ms) {
+    time_t t = (time_t)(time_ms / 1000);
+    struct tm tm_rec = *localtime(&t);
+    set_log_timestamp(ts, ts_len, tm_rec.tm_year + 1900, tm_rec.tm_mon + 1,
+                      tm_rec.tm_mday, tm_rec.tm_hour, tm_rec.tm_min, tm_rec.tm_sec, -1);
+}
+
+static void history_print_record(const void *r, void *data) {
+    UNUSED(data);
+    const struct ts_record_t *rec = (const struct ts_record_t *)r;
+    char ts[STR_LOG_TIMESTAMP];
+    history_timestamp(ts, sizeof(ts), rec->time_ms);
+    int status = (rec->status >= 0 && rec->status <= _ST_LAST ? rec->status :
+                  ST_UNDEF);
+    printf("%s\t%s\t%i\t%i\n", ts, ST_TO_LONGSTR_SIMPLE[status],
+           rec->duration_ms, rec->value);
+}
+
+//
+// Print one metric value found by history_query
+//
+static void history_print_metric(const void *r, void *data) {
+    UNUSED(data);
+    const struct ts_metric_record_t *rec = (const struct ts_metric_record_t *)r;
+    char ts[STR_LOG_TIMESTAMP];
+    history_timestamp(ts, sizeof(ts), rec->time_ms);
+    printf("%s\t%.15g\n", ts, rec->value);
+}
+
+//
+// Print the results of a check (or the values of one of its metrics)
+// recorded in the time series store
+//
+void history_query() {
+    int code = EXIT_SUCCESS;
+    if (!g_history_directory_set) {
+        printf("history_directory not defined in the ini file\n");
+        code = EXIT_FAILURE;
+    } else {
+        char key[2 * TS_KEY_NAME_MAX + 40];
+        long long int to_ms = (g_history_to < 0 ? LLONG_MAX : g_history_to * 1000);
+        long long int nb;
+        if (strlen(g_history_metric) >= 1) {
+            check_metric_ts_key(g_history_query, g_history_metric, key, sizeof(key));
+            nb = ts_query(g_history_directory, key,
+                          (int)sizeof(struct ts_metric_record_t), g_history_from * 1000,
+                          to_ms, history_print_metric, NULL);
+        } else {
+            check_ts_key(g_history_query, key, sizeof(key));
+            nb = ts_query(g_history_directory, key, (int)sizeof(struct ts_record_t),
+                          g_history_from * 1000, to_ms, history_print_record, NULL);
+        }
+        if (nb < 0)
+            code = EXIT_FAILURE;
+        else
+            my_logf(LL_VERBOSE, LP_DATETIME, "%lli record(s) found for %s", nb,
+                    g_history_query);
+    }
+
+    my_log_close();
+    exit(code);
+}
+#endif
+
 //
 // Test one alert
 //
@@ -4040,6 +7810,7 @@ int main(int argc, char *argv[]) {
 
     SSL_load_error_strings(); /* readable error messages */
     SSL_library_init();             /* initialize library */
+    conn_ssl_init();
 
     parse_options(argc, argv);
 
@@ -4091,14 +7862,25 @@ int main_post(int argc, char *argv[]) {
     else
         my_logs(LL_NORMAL, LP_DATETIME, PACKAGE_STRING " start");
 
+#ifdef MY_LINUX
+    // Before the configuration is read, for the spawn server to be as small
+    // as possible
+    if (!prg_server_start()) {
+        my_logs(LL_WARNING, LP_DATETIME,
+                "Unable to start spawn server, programs will be started by netmon");
+    }
+#endif
+
     int nb_errors = 0;
-    read_configuration_file(g_cfg_file, &nb_errors);
+    read_configuration_file(g_cfg_file, FALSE, &nb_errors);
 
     g_trace_network_traffic = (g_current_log_level == LL_DEBUGTRACE);
 
     // Match alerts as written in the alerts option of checks (checks[]) with
     // defined alerts (alerts[])
     identify_alerts(&nb_errors);
+    // Resolve dependencies between checks
+    identify_dependencies(&nb_errors);
     if (nb_errors >=1 && g_laxist) {
         my_logf(LL_WARNING, LP_DATETIME, "%d error(s) in the ini file, continuing",
                 nb_errors);
@@ -4119,6 +7901,105 @@ int main_post(int argc, char *argv[]) {
                 "keep_last_status not defined, taking default = %li",
                 g_nb_keep_last_status);
     }
+    if (g_check_workers < 1 || g_check_workers > MAX_CHECK_WORKERS) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "check_workers must be between 1 and %i, taking default = %i",
+                MAX_CHECK_WORKERS, DEFAULT_CHECK_WORKERS);
+        g_check_workers = DEFAULT_CHECK_WORKERS;
+    }
+    if (g_check_processes < 1 || g_check_processes > MAX_CHECK_PROCESSES) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "check_processes must be between 1 and %i, taking default = %i",
+                MAX_CHECK_PROCESSES, DEFAULT_CHECK_PROCESSES);
+        g_check_processes = DEFAULT_CHECK_PROCESSES;
+    }
+    if (g_program_timeout < 0) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "program_timeout must be 0 or more, taking default = %i",
+                DEFAULT_PROGRAM_TIMEOUT);
+        g_program_timeout = DEFAULT_PROGRAM_TIMEOUT;
+    }
+    if (g_program_parallel < 1 || g_program_parallel > MAX_PROGRAM_PARALLEL) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "program_parallel must be between 1 and %i, taking default = %i",
+                MAX_PROGRAM_PARALLEL, DEFAULT_PROGRAM_PARALLEL);
+        g_program_parallel = DEFAULT_PROGRAM_PARALLEL;
+    }
+    if (g_check_processes >= 2 && g_check_workers >= 2) {
+        my_logs(LL_WARNING, LP_DATETIME,
+                "check_workers ignored when check_processes is 2 or more");
+        g_check_workers = 1;
+    }
+    if (g_history_segment_duration < MIN_HISTORY_SEGMENT_DURATION) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "history_segment_duration must be %i or more, taking default = %i",
+                MIN_HISTORY_SEGMENT_DURATION, DEFAULT_HISTORY_SEGMENT_DURATION);
+        g_history_segment_duration = DEFAULT_HISTORY_SEGMENT_DURATION;
+    }
+    if (g_dns_timeout < 1) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "dns_timeout must be 1 or more, taking default = %i",
+                DEFAULT_DNS_TIMEOUT);
+        g_dns_timeout = DEFAULT_DNS_TIMEOUT;
+    }
+    if (g_dns_cache_ttl < 0) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "dns_cache_ttl must be 0 or more, taking default = %i",
+                DEFAULT_DNS_CACHE_TTL);
+        g_dns_cache_ttl = DEFAULT_DNS_CACHE_TTL;
+    }
+    if (g_dns_negative_ttl < 0) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "dns_negative_ttl must be 0 or more, taking default = %i",
+                DEFAULT_DNS_NEGATIVE_TTL);
+        g_dns_negative_ttl = DEFAULT_DNS_NEGATIVE_TTL;
+    }
+    if (g_state_file_set)
+        build_definitive_path(g_state_file, sizeof(g_state_file));
+    if (g_history_directory_set) {
+        build_definitive_path(g_history_directory,
+                                   sizeof(g_history_directory));
+        struct stat s;
+        if (stat(g_history_directory, &s) != 0 || !S_ISDIR(s.st_mode)) {
+            my_logf(LL_ERROR, LP_DATETIME,
+                    "history_directory %s is not a directory, results will not be recorded",
+                    g_history_directory);
+            g_history_directory_set = FALSE;
+        }
+    }
+    if (g_tcp_engine == FIND_STRING_NOT_FOUND)
+        g_tcp_engine = TE_BLOCKING;
+#ifdef MY_WINDOWS
+    if (g_history_directory_set) {
+        my_logs(LL_WARNING, LP_DATETIME,
+                "history_directory not supported under Windows, results will not be recorded");
+        g_history_directory_set = FALSE;
+    }
+    if (g_tcp_engine == TE_EPOLL) {
+        my_logs(LL_WARNING, LP_DATETIME,
+                "tcp_engine epoll not supported under Windows, using blocking engine");
+        g_tcp_engine = TE_BLOCKING;
+    }
+    if (g_check_workers >= 2) {
+        my_logs(LL_WARNING, LP_DATETIME,
+                "check_workers not supported under Windows, checks will be performed one after the other");
+        g_check_workers = 1;
+    }
+    if (g_check_processes >= 2) {
+        my_logs(LL_WARNING, LP_DATETIME,
+                "check_processes not supported under Windows, checks will be performed by main process");
+        g_check_processes = 1;
+    }
+    if (g_program_parallel >= 2) {
+        my_logs(LL_WARNING, LP_DATETIME,
+                "program_parallel not supported under Windows, programs will be run one after the other");
+        g_program_parallel = 1;
+    }
+    if (g_program_timeout_set && g_program_timeout > 0) {
+        my_logs(LL_WARNING, LP_DATETIME,
+                "program_timeout not supported under Windows, programs will not be interrupted");
+    }
+#endif
     if (!g_date_format_set)
         g_date_format = (g_date_format == FIND_STRING_NOT_FOUND ?
                          DEFAULT_DATE_FORMAT :
@@ -4126,10 +8007,14 @@ int main_post(int argc, char *argv[]) {
     g_date_df = (g_date_format == DF_FRENCH);
 
     int ii;
+    check_states_create();
     for (ii = 0; ii < g_nb_checks; ++ii) {
         struct check_t *chk = &checks[ii];
         check_t_getready(chk);
     }
+    if (g_state_file_set && strlen(g_test_alert) == 0
+            && strlen(g_history_query) == 0)
+        state_load();
 
     checks_display();
     alerts_display();
@@ -4157,6 +8042,8 @@ int main_post(int argc, char *argv[]) {
             fatal_error("setsid() error");
 
         chdir("/");
+        // Programs are started in the same conditions as netmon
+        prg_server_setup();
 
         close(STDIN_FILENO);
         close(STDOUT_FILENO);
@@ -4171,8 +8058,18 @@ int main_post(int argc, char *argv[]) {
     if (strlen(g_test_alert) >= 1)
         test_alert();
 
+#ifdef MY_LINUX
+    if (strlen(g_history_query) >= 1)
+        history_query();
+#endif
+
     web_create_files_for_web();
 
+#ifdef MY_LINUX
+    if (g_test_mode == 0)
+        sched_wait_init();
+#endif
+
     if (g_webserver_on) {
 
 #ifdef MY_WINDOWS
@@ -4205,6 +8102,7 @@ int main_post(int argc, char *argv[]) {
 
 #ifdef MY_LINUX
         if ((g_web_server_pid = fork()) == 0) {
+            child_after_fork(NULL);
             webserver();
             exit(EXIT_SUCCESS);
         } else if (g_web_server_pid < 0) {
@@ -4219,6 +8117,10 @@ int main_post(int argc, char *argv[]) {
     signal(SIGTERM, sigterm_handler);
     signal(SIGABRT, sigabrt_handler);
     signal(SIGINT, sigint_handler);
+#ifdef MY_LINUX
+    signal(SIGHUP, sigreload_handler);
+    signal(SIGUSR1, sigrunnow_handler);
+#endif
 
     almost_neverending_loop();
 
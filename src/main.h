@@ -9,6 +9,7 @@
 #endif
 
 #include "util.h"
+#include "netmon-plugin.h"
 
 #include <sys/types.h>
 #include <time.h>
@@ -17,7 +18,9 @@
 
 #define URL_MAN_EN  "man-en"
 #define URL_LOG     "netmon.log"
+#define URL_RUN_NOW "run-now"
 #define FILE_MAN_EN "netmon.html"
+#define FILE_METRICS "metrics.json"
 
 void os_set_sock_nonblocking_mode(int sock);
 
@@ -89,14 +92,64 @@ struct pop3_account_t {
     int password_set;
 };
 
+// Last statuses of a check, 2 bits per status (statuses go from 0 to
+// _ST_LAST = 3), in a ring buffer so that recording a status is O(1)
+struct status_hist_t {
+    unsigned char *bits;
+    int size;
+    // Position of the oldest status, where the next one will be written
+    int head;
+};
+
 enum {LE_NONE = 0, LE_SENT = 1, LE_RECEIVED = 2};
 struct loop_t {
     int status;
     char loop_ref[LOOP_REF_SIZE];
+    // fnv1a_hash of loop_ref
+    unsigned int hash;
     time_t sent_time;
     time_t received_time;
 };
 
+// Probe emails of a loop check, oldest first, in a ring buffer (size is a
+// power of 2). index is an open-addressing hash table (linear probing) of
+// positions in entries by loop_ref, -1 being an empty slot.
+struct loop_ring_t {
+    struct loop_t *entries;
+    int size;
+    int first;
+    int nb;
+    // Number of entries with status LE_SENT
+    int nb_sent;
+    // Entries removed without their email going back, since the last one
+    // that went back
+    int nb_lost;
+    int *index;
+    unsigned int index_mask;
+};
+
+// Unique id of an email in a POP3 mailbox, 1 to 70 characters (RFC 1939)
+#define POP3_UID_SIZE 71
+struct pop3_uid_t {
+    char uid[POP3_UID_SIZE];
+};
+
+// Part of the output of a program check that is kept: its first line, as
+// it contains the text and performance data of a Nagios plugin
+#define CHECK_OUTPUT_SIZE 1024
+
+// Metric found in the performance data of a program check
+struct check_metric_t {
+    char label[NAGIOS_LABEL_SIZE];
+    char uom[NAGIOS_UOM_SIZE];
+    double value;
+    // Found in the output of the last run of the check
+    int is_current;
+#ifdef MY_LINUX
+    ts_segment_t ts_seg;
+#endif
+};
+
 struct check_t {
 
 // 1. Defined at build time
@@ -119,6 +172,18 @@ struct check_t {
     // CM_PROGRAM method
     char *prg_command;
     int prg_command_set;
+    long int prg_timeout;
+    int prg_timeout_set;
+
+    // CM_PLUGIN method
+    char *plg_file;
+    int plg_file_set;
+    char *plg_args;
+    int plg_args_set;
+    long int plg_isolate;
+    int plg_isolate_set;
+    long int plg_timeout;
+    int plg_timeout_set;
 
     // CM_LOOP method
     char *loop_id;
@@ -132,15 +197,36 @@ struct check_t {
     long int loop_send_every;
     int loop_send_every_set;
     int loop_send_countdown;
+    struct loop_ring_t loop_ring;
 
     // Common to all methods
+    long int interval;
+    int interval_set;
+
+    // Dependencies (names of checks this one depends on), resolved into
+    // indexes in checks[] once the configuration is loaded
+    char *depends_on;
+    int depends_on_set;
+    int nb_parents;
+    int *parents;
+    int dep_level;
+
+    // Check process in charge of this check, when check_processes >= 2
+    int shard;
+
+    // Hash of the variables of the section, to detect changes on reload
+    unsigned int def_hash;
+
     char *alerts;
     long int alert_threshold;
     long int alert_repeat_every;
     long int alert_repeat_max;
     long int alert_recovery;
-    int nb_consecutive_notok;
     int nb_alerts;
+    // Per-alert counters. Left here rather than in struct check_state_t: the
+    // array is variable-length, built while reading the configuration, and
+    // only used by manage_check_status() along with the alert settings
+    // above, never when walking through all checks.
     struct alert_ctrl_t *alert_ctrl;
 
     int alerts_set;
@@ -149,17 +235,68 @@ struct check_t {
     int alert_repeat_max_set;
     int alert_recovery_set;
 
-// 2. Updatable
+// 2. Updatable, only when the check is performed
+//    See also struct check_state_t
 
-    int status;
-    int prev_status;
     int last_status_change_flag;
     struct tm last_status_change;
     struct tm alert_info;
 
-    char *str_prev_status;
+    struct status_hist_t hist;
+#ifdef MY_LINUX
+    ts_segment_t ts_seg;
+#endif
+
+    // CM_LOOP method: UIDs of the emails of the POP3 mailbox known not to
+    // be probe emails of this check, sorted, so that they are not fetched
+    // again
+    struct pop3_uid_t *loop_uids;
+    int loop_nb_uids;
+
+    // CM_PROGRAM method: first line of the output of the last run, and the
+    // metrics found so far in performance data (at most NAGIOS_PERF_MAX)
+    char prg_output[CHECK_OUTPUT_SIZE];
+    struct check_metric_t *metrics;
+    int nb_metrics;
+
+    // CM_PLUGIN method: plugin found in the library when the configuration
+    // is read, and its state once initialized by the process performing the
+    // check, or the helper process that performs the check (plugin_isolate)
+    const struct netmon_plugin_t *plugin;
+    int plg_ready;
+    void *plg_state;
+#ifdef MY_LINUX
+    pid_t plg_pid;
+    int plg_cmd_fd;
+    int plg_res_fd;
+#endif
+};
+
+// State of a check that is read or updated at every round, kept apart from
+// struct check_t so that walking through all checks stays cache friendly.
+// check_states[i] is the state of checks[i].
+struct check_state_t {
+    // Copies of struct check_t fields, made once configuration is read
+    int is_valid;
+    int dep_level;
 
+    int status;
+    int prev_status;
+    int nb_consecutive_notok;
     int trigger_sequence;
+
+    // Scheduling
+    long long int next_due;
+    int is_due;
+
+    // Not performed because a check it depends on is down
+    int is_suppressed;
+    int suppressed_by;
+
+    // Last check performed: duration and method-specific value (exit code
+    // of program checks, emails not back yet for loop checks)
+    int duration_ms;
+    int value;
 };
 
 struct alert_t {
@@ -189,6 +326,8 @@ struct alert_t {
     // "program" method
     char *prg_command;
     int prg_command_set;
+    long int prg_timeout;
+    int prg_timeout_set;
 
     // "log" method
     char *log_file;
@@ -253,8 +392,17 @@ int perform_check_program(struct check_t *chk, const struct subst_t *subst,
                           int subst_len);
 int perform_check_loop(struct check_t *chk, const struct subst_t *subst,
                        int subst_len);
+int perform_check_plugin(struct check_t *chk, const struct subst_t *subst,
+                         int subst_len);
+void plugin_check_stop(struct check_t *chk);
 
 int main_post(int argc, char *argv[]);
+int config_reload();
+
+#ifdef MY_LINUX
+int sched_request_run_now();
+void child_after_fork(const struct check_t *except);
+#endif
 
 // From webserver.c
 void *webserver();
@@ -0,0 +1,68 @@
+// netmon-plugin.h
+
+// Copyright Sébastien Millet, 2013
+
+// Interface between netmon and check plugins (checks defined with
+// method=plugin).
+//
+// A plugin is a shared object (.so) that exports the function
+// netmon_plugin_entry, returning a description of the plugin. The library is
+// loaded once, when the configuration is read, then:
+//   init is called once, before the first run of the check, with the value
+//     of plugin_args. It returns 0 if successful, and can store in *state a
+//     pointer that is given back to run and destroy.
+//   run is called each time the check is performed. It returns a Nagios
+//     code (0: OK, 1: WARNING, 2: CRITICAL, 3: UNKNOWN), and can write in
+//     output a text formatted as the output of a Nagios plugin, including
+//     performance data ("TEXT | PERFDATA").
+//   destroy is called when the check is removed (netmon terminates or its
+//     configuration is reloaded).
+// init and destroy can be NULL.
+//
+// Unless plugin_isolate is set, these functions are called by the netmon
+// process itself: a plugin that crashes takes netmon down with it, and a
+// plugin that does not return blocks all checks.
+//
+// Build a plugin with something like:
+//   cc -shared -fPIC -o myplugin.so myplugin.c
+
+#ifndef NETMON_PLUGIN_H
+#define NETMON_PLUGIN_H
+
+#include <stddef.h>
+
+// Increased whenever the structures below change
+#define NETMON_PLUGIN_ABI_VERSION   1
+
+#define NETMON_PLUGIN_ENTRY         "netmon_plugin_entry"
+
+// Same substitutions as for program_command (DISPLAY_NAME, NOW_TIMESTAMP,
+// LOOP_COUNT, ...)
+struct netmon_plugin_subst_t {
+    const char *name;
+    const char *value;
+};
+
+struct netmon_plugin_check_t {
+    const char *display_name;
+    // Empty if host_name is not defined
+    const char *host_name;
+    // NULL if plugin_args is not defined
+    const char *args;
+};
+
+struct netmon_plugin_t {
+    // Must be NETMON_PLUGIN_ABI_VERSION
+    int abi_version;
+    const char *name;
+
+    int (*init)(const char *args, void **state);
+    int (*run)(void *state, const struct netmon_plugin_check_t *check,
+               const struct netmon_plugin_subst_t *subst, int subst_len,
+               char *output, size_t output_size);
+    void (*destroy)(void *state);
+};
+
+typedef const struct netmon_plugin_t *(*netmon_plugin_entry_t)(void);
+
+#endif  // NETMON_PLUGIN_H
@@ -2,6 +2,11 @@
 
 // Copyright Sébastien Millet, 2013
 
+// getaddrinfo_a()
+#if !defined(_WIN32) && !defined(_WIN64)
+#define _GNU_SOURCE
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "../config.h"
 #else
@@ -27,6 +32,9 @@ const int crypt_ports[] = {443, 465, 585, 993, 995};
 
 long int g_connect_timeout = DEFAULT_CONNECT_TIMEOUT;
 long int g_netio_timeout = DEFAULT_NETIO_TIMEOUT;
+long int g_dns_timeout = DEFAULT_DNS_TIMEOUT;
+long int g_dns_cache_ttl = DEFAULT_DNS_CACHE_TTL;
+long int g_dns_negative_ttl = DEFAULT_DNS_NEGATIVE_TTL;
 
 loglevel_t g_current_log_level = LL_DEFAULT;
 
@@ -68,6 +76,16 @@ void os_sleep(unsigned int seconds) {
     os_usleep(seconds * 1000L);
 }
 
+long long int os_monotonic_ms() {
+    return (long long int)GetTickCount64();
+}
+
+void os_sleep_until_ms(const long long int deadline) {
+    long long int d = deadline - os_monotonic_ms();
+    if (d > 0)
+        Sleep((DWORD)d);
+}
+
 static void os_set_sock_nonblocking_mode(int sock) {
     u_long iMode = 1;
     int iResult = ioctlsocket(sock, FIONBIO, &iMode);
@@ -135,6 +153,21 @@ int os_wexitstatus(const int r) {
     return r;
 }
 
+//
+// Under Windows, programs are run by system(): their output is not
+// captured and they are not subject to a timeout.
+//
+void prg_run(prg_run_t *run) {
+    long long int start = os_monotonic_ms();
+    run->out[0] = '\0';
+    run->out_len = 0;
+    run->err[0] = '\0';
+    run->err_len = 0;
+    run->timed_out = FALSE;
+    run->exit_code = system(run->command);
+    run->duration_ms = (int)(os_monotonic_ms() - start);
+}
+
 int add_reader_access_right(const char *f) {
     UNUSED(f);
 
@@ -151,6 +184,21 @@ void win_get_exe_file(const char *argv0, char *p, size_t p_len) {
     }
 }
 
+void *os_lib_open(const char *file, char *err, const size_t err_len) {
+    HMODULE lib = LoadLibrary(file);
+    if (lib == NULL)
+        os_last_err_desc_n(err, err_len, GetLastError());
+    return (void *)lib;
+}
+
+void *os_lib_symbol(void *lib, const char *name) {
+    return (void *)GetProcAddress((HMODULE)lib, name);
+}
+
+void os_lib_close(void *lib) {
+    FreeLibrary((HMODULE)lib);
+}
+
 #define strcasecmp _stricmp
 #define strncasecmp _strnicmp
 
@@ -162,8 +210,20 @@ void win_get_exe_file(const char *argv0, char *p, size_t p_len) {
 
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <arpa/inet.h>
 #include <netdb.h>
+#include <dirent.h>
+#include <dlfcn.h>
 
 #define HAS_TM_GMTOFF
 // Because HAS_TM_GMTOFF is defined, the fnuction
@@ -179,6 +239,23 @@ void os_sleep(unsigned int seconds) {
     sleep(seconds);
 }
 
+long long int os_monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long int)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//
+// Sleep until an absolute time of the monotonic clock, so that successive
+// sleeps do not accumulate drift. Returns early if a signal is caught.
+//
+void os_sleep_until_ms(const long long int deadline) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(deadline / 1000);
+    ts.tv_nsec = (long int)(deadline % 1000) * 1000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
 static void os_set_sock_nonblocking_mode(int sock) {
     long arg = fcntl(sock, F_GETFL, NULL);
     arg |= O_NONBLOCK;
@@ -220,6 +297,32 @@ int os_wexitstatus(const int r) {
     return WEXITSTATUS(r);
 }
 
+void *os_lib_open(const char *file, char *err, const size_t err_len) {
+    // RTLD_NOW so that an unresolved symbol is reported now, not when the
+    // check is performed
+    void *lib = dlopen(file, RTLD_NOW | RTLD_LOCAL);
+    if (lib == NULL) {
+        const char *e = dlerror();
+        snprintf(err, err_len, "%s", e != NULL ? e : "unknown error");
+    }
+    return lib;
+}
+
+void *os_lib_symbol(void *lib, const char *name) {
+    return dlsym(lib, name);
+}
+
+void os_lib_close(void *lib) {
+    dlclose(lib);
+}
+
+//
+// Pipe not inherited by the programs netmon starts
+//
+int os_pipe_cloexec(int fds[2]) {
+    return pipe2(fds, O_CLOEXEC);
+}
+
 int add_reader_access_right(const char *f) {
     struct stat s;
     int r = 0;
@@ -468,6 +571,10 @@ void my_log_open() {
         log_fd = my_fopen(g_log_file, "a", 1, 0);
     else
         log_fd = NULL;
+#ifdef MY_LINUX
+    if (log_fd != NULL)
+        fcntl(fileno(log_fd), F_SETFD, FD_CLOEXEC);
+#endif
 }
 
 //
@@ -713,6 +820,168 @@ void my_logf(const loglevel_t log_level, const logdisp_t log_disp,
     my_log_core_output(dt, dt_len);
 }
 
+//
+// FNV-1a hash of a string
+// fnv1a_hash_update continues the hash h with the characters of s.
+//
+unsigned int fnv1a_hash_update(unsigned int h, const char *s) {
+    const unsigned char *p;
+    for (p = (const unsigned char *)s; *p != '\0'; ++p) {
+        h ^= *p;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+unsigned int fnv1a_hash(const char *s) {
+    return fnv1a_hash_update(2166136261U, s);
+}
+
+//
+// Nagios plugin output
+//
+// Parsing allocates no memory: the text is located within the output, and
+// performance data items are written to the array given by the caller.
+//
+
+static int nagios_is_blank(const char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+//
+// Copy a field of len characters, truncated to fit in dst
+//
+static void nagios_copy_field(char *dst, const size_t dst_size, const char *src,
+                              size_t len) {
+    if (len >= dst_size)
+        len = dst_size - 1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+//
+// Parse the number found at p, that cannot go beyond end. Return the
+// address of the character that follows it, NULL if there is no number.
+//
+static const char *nagios_parse_number(const char *p, const char *end,
+                                       double *v) {
+    if (p >= end || nagios_is_blank(*p))
+        return NULL;
+    char *e;
+    *v = strtod(p, &e);
+    if (e == p || e > end)
+        return NULL;
+    return e;
+}
+
+//
+// Parse one performance data item, from p to end (excluded)
+// Return TRUE if the item is valid, FALSE otherwise (a value of 'U', meaning
+// the plugin could not get the value, makes the item invalid).
+//
+static int nagios_parse_perf_item(const char *p, const char *end,
+                                  nagios_perf_t *perf) {
+
+    // 1. Label, can be enclosed in single quotes, '' being a quote
+    size_t l = 0;
+    if (*p == '\'') {
+        ++p;
+        while (p < end) {
+            if (*p == '\'') {
+                if (p + 1 < end && p[1] == '\'')
+                    ++p;
+                else
+                    break;
+            }
+            if (l < sizeof(perf->label) - 1)
+                perf->label[l++] = *p;
+            ++p;
+        }
+        if (p >= end)
+            return FALSE;
+        ++p;
+    } else {
+        while (p < end && *p != '=') {
+            if (l < sizeof(perf->label) - 1)
+                perf->label[l++] = *p;
+            ++p;
+        }
+    }
+    perf->label[l] = '\0';
+    if (l == 0 || p >= end || *p != '=')
+        return FALSE;
+    ++p;
+
+    // 2. Value and unit of measurement
+    const char *f = (const char *)memchr(p, ';', (size_t)(end - p));
+    const char *f_end = (f == NULL ? end : f);
+    const char *u = nagios_parse_number(p, f_end, &perf->value);
+    if (u == NULL)
+        return FALSE;
+    nagios_copy_field(perf->uom, sizeof(perf->uom), u, (size_t)(f_end - u));
+
+    // 3. warn;crit;min;max, all optional
+    perf->warn[0] = '\0';
+    perf->crit[0] = '\0';
+    perf->has_min = FALSE;
+    perf->has_max = FALSE;
+    int i;
+    for (i = 0; i < 4 && f_end < end; ++i) {
+        p = f_end + 1;
+        f = (const char *)memchr(p, ';', (size_t)(end - p));
+        f_end = (f == NULL ? end : f);
+        if (i == 0)
+            nagios_copy_field(perf->warn, sizeof(perf->warn), p, (size_t)(f_end - p));
+        else if (i == 1)
+            nagios_copy_field(perf->crit, sizeof(perf->crit), p, (size_t)(f_end - p));
+        else if (i == 2)
+            perf->has_min = (nagios_parse_number(p, f_end, &perf->min) != NULL);
+        else
+            perf->has_max = (nagios_parse_number(p, f_end, &perf->max) != NULL);
+    }
+    return TRUE;
+}
+
+//
+// Parse the first line of the output of a Nagios plugin.
+// *text_len is set to the length of the text (what comes before '|'), the
+// text starting at out. Valid performance data items are written to perf,
+// at most perf_max of them.
+// Return the number of performance data items written to perf.
+//
+int nagios_parse_output(const char *out, size_t *text_len, nagios_perf_t *perf,
+                        const int perf_max) {
+    const char *end = out + strcspn(out, "\n");
+    const char *bar = (const char *)memchr(out, '|', (size_t)(end - out));
+    const char *t_end = (bar == NULL ? end : bar);
+    while (t_end > out && nagios_is_blank(t_end[-1]))
+        --t_end;
+    *text_len = (size_t)(t_end - out);
+    if (bar == NULL)
+        return 0;
+
+    int nb = 0;
+    const char *p = bar + 1;
+    while (nb < perf_max) {
+        while (p < end && nagios_is_blank(*p))
+            ++p;
+        if (p >= end)
+            break;
+        // An item ends with the first blank that is not within quotes
+        const char *q = p;
+        int quoted = FALSE;
+        while (q < end && (quoted || !nagios_is_blank(*q))) {
+            if (*q == '\'')
+                quoted = !quoted;
+            ++q;
+        }
+        if (nagios_parse_perf_item(p, q, &perf[nb]))
+            ++nb;
+        p = q;
+    }
+    return nb;
+}
+
 //
 // Return true if s begins with prefix, false otherwise
 // String comparison is case insensitive
@@ -729,6 +998,161 @@ char *ssl_get_error(const unsigned long e, char *s, const size_t s_len) {
     return s;
 }
 
+//
+// SSL client context and session cache
+//
+// One SSL_CTX is shared by all connections. The last session established
+// with a destination (host:port) is kept, so that the next connection to
+// it resumes the session instead of performing a full handshake.
+//
+
+#define SSL_DEST_INITIAL_SLOTS 64
+// How long to wait for a TLS 1.3 session ticket when closing a connection
+#define SSL_TICKET_WAIT_MS     200
+
+struct ssl_dest_t {
+    char *desc;
+    SSL_SESSION *session;
+    // Session received during current connection
+    int has_new_session;
+    // FALSE once the server did not send a ticket in time
+    int wait_ticket;
+};
+
+static SSL_CTX *ssl_client_ctx = NULL;
+static struct ssl_dest_t **ssl_dests = NULL;
+static int ssl_nb_dests = 0;
+static int ssl_dests_size = 0;
+// Open addressing hash table of indexes in ssl_dests, -1 if empty
+static int *ssl_slots = NULL;
+static unsigned int ssl_mask = 0;
+
+static unsigned long int ssl_full_handshakes = 0;
+static unsigned long int ssl_resumed_handshakes = 0;
+
+//
+// Destination desc in the cache, created if need be
+//
+static struct ssl_dest_t *ssl_dest_get(const char *desc) {
+    unsigned int j;
+    int i;
+
+    if (ssl_slots != NULL) {
+        j = fnv1a_hash(desc) & ssl_mask;
+        while (ssl_slots[j] != -1) {
+            if (strcmp(ssl_dests[ssl_slots[j]]->desc, desc) == 0)
+                return ssl_dests[ssl_slots[j]];
+            j = (j + 1) & ssl_mask;
+        }
+    }
+
+    if (ssl_nb_dests >= ssl_dests_size) {
+        ssl_dests_size = (ssl_dests_size == 0 ? SSL_DEST_INITIAL_SLOTS / 2 :
+                          ssl_dests_size * 2);
+        ssl_dests = (struct ssl_dest_t **)MYREALLOC(ssl_dests,
+                    sizeof(struct ssl_dest_t *) * (size_t)ssl_dests_size);
+    }
+    // Load factor kept below 1/2
+    if (ssl_slots == NULL || (unsigned int)ssl_nb_dests * 2 + 2 > ssl_mask + 1) {
+        unsigned int nb_slots = (ssl_slots == NULL ? SSL_DEST_INITIAL_SLOTS :
+                                 (ssl_mask + 1) * 2);
+        if (ssl_slots != NULL)
+            MYFREE(ssl_slots);
+        ssl_slots = (int *)MYMALLOC(sizeof(int) * nb_slots, ssl_slots);
+        ssl_mask = nb_slots - 1;
+        for (i = 0; i < (int)nb_slots; ++i)
+            ssl_slots[i] = -1;
+        for (i = 0; i < ssl_nb_dests; ++i) {
+            j = fnv1a_hash(ssl_dests[i]->desc) & ssl_mask;
+            while (ssl_slots[j] != -1)
+                j = (j + 1) & ssl_mask;
+            ssl_slots[j] = i;
+        }
+    }
+
+    struct ssl_dest_t *d = (struct ssl_dest_t *)MYMALLOC(sizeof(*d), d);
+    size_t l = strlen(desc) + 1;
+    d->desc = (char *)MYMALLOC(l, d->desc);
+    memcpy(d->desc, desc, l);
+    d->session = NULL;
+    d->has_new_session = FALSE;
+    d->wait_ticket = TRUE;
+    j = fnv1a_hash(desc) & ssl_mask;
+    while (ssl_slots[j] != -1)
+        j = (j + 1) & ssl_mask;
+    ssl_slots[j] = ssl_nb_dests;
+    ssl_dests[ssl_nb_dests++] = d;
+    return d;
+}
+
+static void ssl_dest_set_session(struct ssl_dest_t *d, SSL_SESSION *session) {
+    if (d->session != NULL)
+        SSL_SESSION_free(d->session);
+    d->session = session;
+}
+
+//
+// Called by OpenSSL when the server provides a new session. With TLS 1.3
+// this can happen after the handshake is over.
+//
+static int ssl_new_session(SSL *ssl, SSL_SESSION *session) {
+    struct ssl_dest_t *d = (struct ssl_dest_t *)SSL_get_app_data(ssl);
+    if (d == NULL)
+        return 0;
+    ssl_dest_set_session(d, session);
+    d->has_new_session = TRUE;
+    // Returning 1 means we keep the reference to session
+    return 1;
+}
+
+//
+// Create the SSL client context, once SSL library is initialized
+//
+void conn_ssl_init() {
+    if ((ssl_client_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) {
+        char s_err[ERR_STR_BUFSIZE];
+        unsigned long e = ERR_get_error();
+        my_logf(LL_ERROR, LP_DATETIME, "SSL error: %lu (%s)", e,
+                ssl_get_error(e, s_err, sizeof(s_err)));
+        return;
+    }
+    SSL_CTX_set_session_cache_mode(ssl_client_ctx, SSL_SESS_CACHE_CLIENT |
+                                   SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_client_ctx, ssl_new_session);
+}
+
+//
+// Handshake counters, for a child process to send them to the main process
+//
+void ssl_get_stats(unsigned long int *full, unsigned long int *resumed) {
+    *full = ssl_full_handshakes;
+    *resumed = ssl_resumed_handshakes;
+}
+
+//
+// Add counters of handshakes done by a child process
+//
+void ssl_add_stats(const unsigned long int full, const unsigned long int resumed) {
+    ssl_full_handshakes += full;
+    ssl_resumed_handshakes += resumed;
+}
+
+//
+// Log handshake counters, if they changed since the last call
+//
+void ssl_log_stats() {
+    static unsigned long int last_full = 0;
+    static unsigned long int last_resumed = 0;
+
+    if (ssl_full_handshakes == last_full && ssl_resumed_handshakes == last_resumed)
+        return;
+    last_full = ssl_full_handshakes;
+    last_resumed = ssl_resumed_handshakes;
+    my_logf(LL_VERBOSE, LP_DATETIME,
+            "SSL handshakes: %lu full, %lu resumed", ssl_full_handshakes,
+            ssl_resumed_handshakes);
+}
+
 //
 // Initializes the connection_t object
 //
@@ -736,7 +1160,10 @@ void conn_init(connection_t *conn, int type) {
     conn->type = type;
     conn->sock = -1;
     conn->ssl = NULL;
-    conn->ssl_context = NULL;
+    conn->handshake_ms = -1;
+    conn->rbuf_start = 0;
+    conn->rbuf_end = 0;
+    conn->wbuf_len = 0;
 
     conn->sock_read = connection_table[conn->type].sock_read;
     conn->log_prefix_received =
@@ -749,35 +1176,107 @@ void conn_init(connection_t *conn, int type) {
 // Closes the connection
 //
 void conn_close(connection_t *conn) {
+    if (conn->wbuf_len >= 1)
+        conn_flush(my_logf, conn);
+
+    struct ssl_dest_t *d = (conn->ssl != NULL ?
+                            (struct ssl_dest_t *)SSL_get_app_data(conn->ssl) : NULL);
+    if (d != NULL && !d->has_new_session && d->wait_ticket
+            && conn->sock != -1 && SSL_is_init_finished(conn->ssl)
+            && SSL_version(conn->ssl) >= TLS1_3_VERSION) {
+        // TLS 1.3 session tickets are sent by the server after the
+        // handshake, they are read here if nothing else did.
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET((unsigned int)(conn->sock), &fdset);
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = SSL_TICKET_WAIT_MS * 1000;
+        if (SSL_pending(conn->ssl) >= 1
+                || select(conn->sock + 1, &fdset, NULL, NULL, &tv) >= 1) {
+            char c;
+            os_set_sock_nonblocking_mode(conn->sock);
+            SSL_peek(conn->ssl, &c, 1);
+            ERR_clear_error();
+        }
+        if (!d->has_new_session)
+            d->wait_ticket = FALSE;
+    }
     os_closesocket(conn->sock);
     if (conn->ssl != NULL) {
         SSL_shutdown(conn->ssl);
         SSL_free(conn->ssl);
         conn->ssl = NULL;
     }
-    if (conn->ssl_context != NULL) {
-        SSL_CTX_free(conn->ssl_context);
-        conn->ssl_context = NULL;
-    }
     conn->sock = -1;
+    conn->rbuf_start = 0;
+    conn->rbuf_end = 0;
+    conn->wbuf_len = 0;
 }
 
 //
 // Check whether a given connection_t object is closed
 //
 int conn_is_closed(connection_t *conn) {
-    if (conn->sock != -1 || conn->ssl_context != NULL || conn->ssl != NULL)
+    if (conn->sock != -1 || conn->ssl != NULL)
         return FALSE;
     return TRUE;
 }
 
 //
-// Connect to a remote host, with a timeout
+// Perform SSL handshake on a non-blocking socket, waiting for the socket to
+// be ready until deadline.
+// Return CONNRES_* code.
+//
+static int conn_ssl_handshake(connection_t *conn, const long long int deadline,
+                              const char *desc, const char *prefix) {
+    char s_err[ERR_STR_BUFSIZE];
+
+    while (TRUE) {
+        int r = SSL_connect(conn->ssl);
+        if (r == 1)
+            return CONNRES_OK;
+
+        int e = SSL_get_error(conn->ssl, r);
+        if (e != SSL_ERROR_WANT_READ && e != SSL_ERROR_WANT_WRITE) {
+            unsigned long ee = ERR_get_error();
+            my_logf(LL_ERROR, LP_DATETIME, "%s SSL error: %lu (%s)",
+                    prefix, ee, ssl_get_error(ee, s_err, sizeof(s_err)));
+            return CONNRES_SSL_CONNECTION_ERROR;
+        }
+
+        long long int w = deadline - os_monotonic_ms();
+        if (w <= 0) {
+            my_logf(LL_ERROR, LP_DATETIME, "%s timeout during SSL handshake with %s",
+                    prefix, desc);
+            return CONNRES_CONNECTION_TIMEOUT;
+        }
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET((unsigned int)(conn->sock), &fdset);
+        struct timeval tv;
+        tv.tv_sec = (long int)(w / 1000);
+        tv.tv_usec = (long int)(w % 1000) * 1000;
+        if (select(conn->sock + 1, e == SSL_ERROR_WANT_READ ? &fdset : NULL,
+                   e == SSL_ERROR_WANT_WRITE ? &fdset : NULL, NULL, &tv) < 0
+                && errno != EINTR) {
+            my_logf(LL_ERROR, LP_DATETIME, "%s network error during SSL handshake with %s, %s",
+                    prefix, desc, os_last_err_desc(s_err, sizeof(s_err)));
+            return CONNRES_NETIO;
+        }
+    }
+}
+
+//
+// Connect to a remote host, with a timeout. In case of SSL connection, the
+// timeout covers the handshake, too.
 // Return EC_* code.
 //
 int conn_connect(connection_t *conn, const struct sockaddr_in *server,
                  const int conn_to, const int netio_to, const char *desc,
                  const char *prefix) {
+    long long int deadline = os_monotonic_ms() + (long long int)conn_to * 1000;
+
     fd_set fdset;
     FD_ZERO(&fdset);
     FD_SET((unsigned int)(conn->sock), &fdset);
@@ -825,26 +1324,25 @@ int conn_connect(connection_t *conn, const struct sockaddr_in *server,
         return cr;
     }
 
-    os_set_sock_blocking_mode(conn->sock);
-
     if (os_setsock_timeout(conn->sock, netio_to)) {
         my_logf(LL_ERROR, LP_DATETIME, "%s unable to set timeout to network I/O",
                 prefix);
     }
 
-    if (conn->type == CONNTYPE_PLAIN)
+    if (conn->type == CONNTYPE_PLAIN) {
+        os_set_sock_blocking_mode(conn->sock);
         return CONNRES_OK;
+    }
 
-    // Assume we are a v2 or v3 client
-    if ((conn->ssl_context = SSL_CTX_new(SSLv23_client_method())) == NULL) {
-        my_logf(LL_ERROR, LP_DATETIME, "%s SSL error: %lu (%s)",
-                prefix, ERR_get_error(), ssl_get_error(ERR_get_error(), s_err,
-                        sizeof(s_err)));
+    struct ssl_dest_t *dest = ssl_dest_get(desc);
+
+    if (ssl_client_ctx == NULL) {
+        my_logf(LL_ERROR, LP_DATETIME, "%s SSL error: no SSL context", prefix);
         cr = CONNRES_SSL_CONNECTION_ERROR;
     }
 
     /* Create SSL connection */
-    else if ((conn->ssl = SSL_new(conn->ssl_context)) == NULL) {
+    else if ((conn->ssl = SSL_new(ssl_client_ctx)) == NULL) {
         my_logf(LL_ERROR, LP_DATETIME, "%s SSL error: %lu (%s)",
                 prefix, ERR_get_error(), ssl_get_error(ERR_get_error(), s_err,
                         sizeof(s_err)));
@@ -859,17 +1357,27 @@ int conn_connect(connection_t *conn, const struct sockaddr_in *server,
         cr = CONNRES_SSL_CONNECTION_ERROR;
     }
 
-    /* Initiate SSL handshake */
-    else if (SSL_connect(conn->ssl) != 1) {
-        my_logf(LL_ERROR, LP_DATETIME, "%s SSL error: %lu (%s)",
-                prefix, ERR_get_error(), ssl_get_error(ERR_get_error(), s_err,
-                        sizeof(s_err)));
-        cr = CONNRES_SSL_CONNECTION_ERROR;
+    /* Initiate SSL handshake, resuming last session if any */
+    else {
+        SSL_set_app_data(conn->ssl, dest);
+        dest->has_new_session = FALSE;
+        if (dest->session != NULL)
+            SSL_set_session(conn->ssl, dest->session);
+        long long int hs_start = os_monotonic_ms();
+        if ((cr = conn_ssl_handshake(conn, deadline, desc, prefix)) != CONNRES_OK)
+            ssl_dest_set_session(dest, NULL);
+        else
+            conn->handshake_ms = (int)(os_monotonic_ms() - hs_start);
     }
 
     if (cr == CONNRES_OK) {
-        my_logf(LL_DEBUG, LP_DATETIME, "%s SSL: handshake [%s] successful", prefix,
-                desc);
+        int resumed = SSL_session_reused(conn->ssl);
+        if (resumed)
+            ++ssl_resumed_handshakes;
+        else
+            ++ssl_full_handshakes;
+        my_logf(LL_DEBUG, LP_DATETIME, "%s SSL: handshake [%s] successful in %i ms%s",
+                prefix, desc, conn->handshake_ms, resumed ? " (session resumed)" : "");
         os_set_sock_blocking_mode(conn->sock);
     } else {
         conn_close(conn);
@@ -926,239 +1434,724 @@ int guess_conntype(const long int p, const int crypt_set,
 }
 
 //
-// Establish a connection, including all what it takes ->
-//      Host name resolution
-//      TCP connection open
-//      Check server answer
+// DNS cache
+//
+// The answer to a host name lookup (address or failure) is kept
+// g_dns_cache_ttl seconds (g_dns_negative_ttl seconds for a failure).
+// getaddrinfo() does not tell the TTL of the records, these durations are
+// an upper bound of it.
+// Under Linux lookups are made by getaddrinfo_a(), so that the caller can
+// wait for them at most g_dns_timeout seconds, or go on with other work and
+// be notified through dns_event_fd(). Requests for a name whose lookup is
+// in progress wait for the same lookup.
 //
-int conn_establish_connection(connection_t *conn, const conn_def_t *srv,
-                              const int default_port, const char *expect,
-                              const char *prefix, const int trace) {
 
-    char h[SMALLSTRSIZE];
-    int p;
+#define DNS_INITIAL_SLOTS 64
 
-    if (split_hostname(srv->server, srv->port_set, (int)srv->port,
-                       default_port, prefix, h, sizeof(h), &p)) {
-        return CONNRES_INVALID_PORT_NUMBER;
-    }
+struct dns_entry_t {
+    char *name;
+    int status;
+    struct in_addr addr;
+    long long int expires;
+    char err_desc[ERR_STR_BUFSIZE];
+#ifdef MY_LINUX
+    struct dns_request_t *req;
+#endif
+};
 
-    conn_init(conn, guess_conntype(p, srv->crypt_set, (int)srv->crypt));
+static struct dns_entry_t *dns_entries = NULL;
+static int dns_nb_entries = 0;
+static int dns_entries_size = 0;
+// Open addressing hash table of indexes in dns_entries, -1 if empty
+static int *dns_slots = NULL;
+static unsigned int dns_mask = 0;
 
-    my_logf(LL_DEBUG, LP_DATETIME, "%s connecting to %s:%i...", prefix, h, p);
+static unsigned long int dns_hits = 0;
+static unsigned long int dns_misses = 0;
 
-    char server_desc[SMALLSTRSIZE + 100];
-    char s_err[ERR_STR_BUFSIZE];
+#ifdef MY_LINUX
+struct dns_request_t {
+    struct gaicb cb;
+    struct addrinfo hints;
+};
 
-    snprintf(server_desc, sizeof(server_desc), "%s:%i", h, p);
+static int dns_efd = -1;
+// getaddrinfo_a() runs lookups in threads that fork() does not duplicate
+static int dns_async = TRUE;
+static int dns_async_used = FALSE;
+#endif
 
-    // Resolving server name
-    struct sockaddr_in server;
-    struct hostent *hostinfo = NULL;
-    my_logf(LL_DEBUG, LP_DATETIME, "Running gethosbyname() on %s", h);
-    hostinfo = gethostbyname(h);
-    if (hostinfo == NULL) {
-        my_logf(LL_ERROR, LP_DATETIME, "Unknown host %s, %s", h,
-                os_last_err_desc(s_err, sizeof(s_err)));
-        return CONNRES_RESOLVE_ERROR;
+static int dns_find(const char *name) {
+    if (dns_slots == NULL)
+        return -1;
+    unsigned int i = fnv1a_hash(name) & dns_mask;
+    while (dns_slots[i] != -1) {
+        if (strcmp(dns_entries[dns_slots[i]].name, name) == 0)
+            return dns_slots[i];
+        i = (i + 1) & dns_mask;
     }
+    return -1;
+}
 
-    int ret = CONNRES_CONNECTION_ERROR;
+static int dns_add(const char *name) {
+    int i;
 
-    if ((conn->sock = socket(AF_INET, SOCK_STREAM,
-                             IPPROTO_TCP)) == SOCKET_ERROR) {
-        fatal_error("%s socket() error to create connection socket, %s", prefix,
-                    os_last_err_desc(s_err, sizeof(s_err)));
+    if (dns_nb_entries >= dns_entries_size) {
+        dns_entries_size = (dns_entries_size == 0 ? DNS_INITIAL_SLOTS / 2 :
+                            dns_entries_size * 2);
+        dns_entries = (struct dns_entry_t *)MYREALLOC(dns_entries,
+                      sizeof(struct dns_entry_t) * (size_t)dns_entries_size);
+    }
+    // Load factor kept below 1/2
+    if ((unsigned int)dns_nb_entries * 2 + 2 > dns_mask + 1 || dns_slots == NULL) {
+        unsigned int nb_slots = (dns_slots == NULL ? DNS_INITIAL_SLOTS :
+                                 (dns_mask + 1) * 2);
+        if (dns_slots != NULL)
+            MYFREE(dns_slots);
+        dns_slots = (int *)MYMALLOC(sizeof(int) * nb_slots, dns_slots);
+        dns_mask = nb_slots - 1;
+        for (i = 0; i < (int)nb_slots; ++i)
+            dns_slots[i] = -1;
+        for (i = 0; i < dns_nb_entries; ++i) {
+            unsigned int j = fnv1a_hash(dns_entries[i].name) & dns_mask;
+            while (dns_slots[j] != -1)
+                j = (j + 1) & dns_mask;
+            dns_slots[j] = i;
+        }
     }
-    server.sin_family = AF_INET;
-    server.sin_port = htons((uint16_t)p);
-    server.sin_addr = *(struct in_addr *)hostinfo->h_addr;
-    // tv value is undefined after call to connect() as per documentation, so
-    // it is to be re-set every time.
-    int conn_to = (int)(srv->connect_timeout_set ? srv->connect_timeout :
-                        g_connect_timeout);
-    int netio_to = (int)(srv->netio_timeout_set ? srv->netio_timeout :
-                         g_netio_timeout);
 
-    my_logf(LL_DEBUG, LP_DATETIME,
-            "%s will connect to %s:%i, connect timeout = %d, netio timeout = %d",
-            prefix, h, p, conn_to, netio_to);
+    struct dns_entry_t *e = &dns_entries[dns_nb_entries];
+    size_t l = strlen(name) + 1;
+    e->name = (char *)MYMALLOC(l, e->name);
+    memcpy(e->name, name, l);
+    e->status = DNS_FAILED;
+    e->expires = 0;
+    e->err_desc[0] = '\0';
+#ifdef MY_LINUX
+    e->req = NULL;
+#endif
+    unsigned int j = fnv1a_hash(name) & dns_mask;
+    while (dns_slots[j] != -1)
+        j = (j + 1) & dns_mask;
+    dns_slots[j] = dns_nb_entries;
+    return dns_nb_entries++;
+}
 
-    if ((ret = conn_connect(conn, &server, conn_to, netio_to, server_desc,
-                            prefix)) == CONNRES_OK) {
-        my_logf(LL_DEBUG, LP_DATETIME, "%s connected to %s", prefix, server_desc);
+static void dns_set_ok(struct dns_entry_t *e, const struct in_addr *addr) {
+    e->status = DNS_OK;
+    e->addr = *addr;
+    e->expires = os_monotonic_ms() + (long long int)g_dns_cache_ttl * 1000;
+}
 
-        if (expect != NULL && strlen(expect) >= 1) {
-            char *response = NULL;
-            size_t response_size;
-            if (conn_read_line_alloc(my_logf, conn, &response, trace,
-                                     &response_size) < 0) {
-                ;
-            } else if (s_begins_with(response, expect)) {
-                my_logf(LL_VERBOSE, LP_DATETIME,
-                        "%s received expected answer: '%s' (expected '%s')",
-                        prefix, response, expect);
-                ret = CONNRES_OK;
-            } else {
-                my_logf(LL_ERROR, LP_DATETIME,
-                        "%s received unexpected answer: '%s' (expected '%s')",
-                        prefix, response, expect);
-                ret = CONNRES_UNEXPECTED_ANSWER;
-            }
-            MYFREE(response);
-        } else {
-            ret = CONNRES_OK;
-        }
+static void dns_set_failed(struct dns_entry_t *e, const char *desc) {
+    e->status = DNS_FAILED;
+    strncpy(e->err_desc, desc, sizeof(e->err_desc) - 1);
+    e->err_desc[sizeof(e->err_desc) - 1] = '\0';
+    e->expires = os_monotonic_ms() + (long long int)g_dns_negative_ttl * 1000;
+}
 
-    }
+#ifdef MY_LINUX
+static void dns_set_result(struct dns_entry_t *e, const int r,
+                           const struct addrinfo *res) {
+    if (r == 0 && res != NULL)
+        dns_set_ok(e, &((const struct sockaddr_in *)res->ai_addr)->sin_addr);
+    else
+        dns_set_failed(e, gai_strerror(r == 0 ? EAI_NONAME : r));
+}
 
-    return ret;
+//
+// Executed by a thread of getaddrinfo_a() once a lookup is done
+//
+static void dns_notify(union sigval sv) {
+    (void)sv;
+    uint64_t one = 1;
+    ssize_t n = write(dns_efd, &one, sizeof(one));
+    (void)n;
 }
 
 //
-// Receives a line from a socket (terminated by \015\010)
-// Return -1 if an error occured, 1 if reading is successful,
-// 0 if transmission is closed.
+// Take into account the result of the lookup in progress, if it is over
 //
-int conn_read_line_alloc(void (*lp)(const loglevel_t, const logdisp_t,
-                                    const char *, ...), connection_t *conn, char **out, int trace,
-                         size_t *size) {
-    const int INITIAL_READLINE_BUFFER_SIZE = 100;
+static void dns_update(struct dns_entry_t *e) {
+    if (e->req == NULL)
+        return;
+    int r = gai_error(&e->req->cb);
+    if (r == EAI_INPROGRESS)
+        return;
+    dns_set_result(e, r, e->req->cb.ar_result);
+    if (e->req->cb.ar_result != NULL)
+        freeaddrinfo(e->req->cb.ar_result);
+    MYFREE(e->req);
+    e->req = NULL;
+}
+#endif
 
-    int i = 0;
-    int cr = FALSE;
-    char ch;
-    ssize_t nb;
+//
+// Start the lookup of e->name
+//
+static void dns_start(struct dns_entry_t *e) {
+    ++dns_misses;
+    my_logf(LL_DEBUG, LP_DATETIME, "Resolving %s", e->name);
 
-    if (*out == NULL) {
-        *size = (size_t)INITIAL_READLINE_BUFFER_SIZE;
-        *out = (char *)MYMALLOC(*size, out);
-    }
+#ifdef MY_LINUX
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
 
-    for (;;) {
-        if ((nb = conn->sock_read(conn, &ch, 1)) == SOCKET_ERROR) {
+    if (!dns_async) {
+        struct addrinfo *res = NULL;
+        int r = getaddrinfo(e->name, NULL, &hints, &res);
+        dns_set_result(e, r, res);
+        if (res != NULL)
+            freeaddrinfo(res);
+        return;
+    }
+
+    if (dns_efd < 0) {
+        if ((dns_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
             char s_err[ERR_STR_BUFSIZE];
-            lp(LL_ERROR, LP_DATETIME, "Error reading socket, error %s",
-               os_last_err_desc(s_err, sizeof(s_err)));
-            conn_close(conn);
-            return -1;
+            fatal_error("eventfd() error, %s", os_last_err_desc(s_err,
+                        sizeof(s_err)));
         }
+    }
 
-        if ((unsigned)i >= *size) {
-            if (*size * 2 <= MAX_READLINE_SIZE) {
-                *size *= 2;
-                *out = (char *)MYREALLOC(*out, *size);
-            } else {
-                (*out)[*size - 1] = '\0';
-                break;
-            }
+    e->req = (struct dns_request_t *)MYMALLOC(sizeof(struct dns_request_t),
+             e->req);
+    memset(e->req, 0, sizeof(*e->req));
+    e->req->hints = hints;
+    e->req->cb.ar_name = e->name;
+    e->req->cb.ar_request = &e->req->hints;
+
+    struct gaicb *list[1];
+    list[0] = &e->req->cb;
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = dns_notify;
+
+    dns_async_used = TRUE;
+    int r = getaddrinfo_a(GAI_NOWAIT, list, 1, &sev);
+    if (r != 0) {
+        dns_set_failed(e, gai_strerror(r));
+        MYFREE(e->req);
+        e->req = NULL;
+        return;
+    }
+    e->status = DNS_PENDING;
+#else
+    struct hostent *hostinfo = gethostbyname(e->name);
+    if (hostinfo == NULL) {
+        char s_err[ERR_STR_BUFSIZE];
+        dns_set_failed(e, os_last_err_desc(s_err, sizeof(s_err)));
+    } else {
+        dns_set_ok(e, (struct in_addr *)hostinfo->h_addr);
+    }
+#endif
+}
+
+//
+// Status of the lookup identified by handle (returned by dns_lookup).
+// *addr is set if status is DNS_OK.
+//
+int dns_status(const int handle, struct in_addr *addr) {
+    struct dns_entry_t *e = &dns_entries[handle];
+#ifdef MY_LINUX
+    dns_update(e);
+#endif
+    if (e->status == DNS_OK)
+        *addr = e->addr;
+    return e->status;
+}
+
+//
+// Look for name in the cache, start a lookup if it is not there or if it
+// expired.
+// Returns DNS_OK (address in *addr), DNS_FAILED or DNS_PENDING. *handle is
+// set to be used with dns_status and dns_err_desc.
+//
+int dns_lookup(const char *name, struct in_addr *addr, int *handle) {
+    *handle = -1;
+
+#ifdef MY_LINUX
+    if (inet_pton(AF_INET, name, addr) == 1)
+        return DNS_OK;
+#endif
+
+    // Host names are case insensitive
+    char key[SMALLSTRSIZE];
+    size_t j;
+    for (j = 0; name[j] != '\0' && j < sizeof(key) - 1; ++j)
+        key[j] = (char)tolower((unsigned char)name[j]);
+    key[j] = '\0';
+    name = key;
+
+    int i = dns_find(name);
+    if (i >= 0) {
+        int st = dns_status(i, addr);
+        if (st == DNS_PENDING || dns_entries[i].expires > os_monotonic_ms()) {
+            ++dns_hits;
+            *handle = i;
+            return st;
         }
+    } else {
+        i = dns_add(name);
+    }
+    *handle = i;
+    dns_start(&dns_entries[i]);
+    return dns_status(i, addr);
+}
 
-        if (nb == 0) {
-            (*out)[i] = '\0';
+//
+// Same as dns_lookup, waiting at most g_dns_timeout seconds for the lookup
+// to complete. DNS_PENDING is returned in case of timeout.
+//
+int dns_resolve(const char *name, struct in_addr *addr, int *handle) {
+    int st = dns_lookup(name, addr, handle);
+
+#ifdef MY_LINUX
+    long long int deadline = os_monotonic_ms() + (long long int)g_dns_timeout
+                             * 1000;
+    while (st == DNS_PENDING) {
+        long long int w = deadline - os_monotonic_ms();
+        if (w <= 0)
             break;
+        const struct gaicb *list[1];
+        list[0] = &dns_entries[*handle].req->cb;
+        struct timespec ts;
+        ts.tv_sec = (time_t)(w / 1000);
+        ts.tv_nsec = (long int)(w % 1000) * 1000000;
+        gai_suspend(list, 1, &ts);
+        st = dns_status(*handle, addr);
+    }
+#endif
+
+    return st;
+}
+
+//
+// Description of a failed lookup
+//
+const char *dns_err_desc(const int handle) {
+    if (handle < 0)
+        return "";
+    return dns_entries[handle].err_desc;
+}
+
+//
+// Cache counters, for a child process to send them to the main process
+//
+void dns_get_stats(unsigned long int *hits, unsigned long int *misses,
+                   int *nb_names) {
+    *hits = dns_hits;
+    *misses = dns_misses;
+    *nb_names = dns_nb_entries;
+}
+
+//
+// Add counters of lookups done by a child process
+//
+void dns_add_stats(const unsigned long int hits, const unsigned long int misses) {
+    dns_hits += hits;
+    dns_misses += misses;
+}
+
+//
+// Log cache counters, if they changed since the last call. other_names is
+// the number of names cached by other processes (check processes).
+//
+void dns_log_stats(const int other_names) {
+    static unsigned long int last_hits = 0;
+    static unsigned long int last_misses = 0;
+
+    if (dns_hits == last_hits && dns_misses == last_misses)
+        return;
+    last_hits = dns_hits;
+    last_misses = dns_misses;
+    my_logf(LL_VERBOSE, LP_DATETIME,
+            "DNS cache: %lu hit(s), %lu miss(es), %i name(s)", dns_hits,
+            dns_misses, dns_nb_entries + other_names);
+}
+
+#ifdef MY_LINUX
+//
+// File descriptor that becomes readable when a lookup completes, -1 if no
+// lookup was ever started.
+//
+int dns_event_fd() {
+    return dns_efd;
+}
+
+//
+// Take into account lookups completed since last call
+//
+void dns_poll() {
+    int i;
+    uint64_t v;
+
+    if (dns_efd >= 0) {
+        ssize_t n = read(dns_efd, &v, sizeof(v));
+        (void)n;
+    }
+    for (i = 0; i < dns_nb_entries; ++i)
+        dns_update(&dns_entries[i]);
+}
+
+//
+// To be called by a child process after fork(). Lookups in progress belong
+// to the parent, and getaddrinfo_a() is no longer used if the parent did
+// use it.
+//
+void dns_after_fork() {
+    int i;
+    for (i = 0; i < dns_nb_entries; ++i) {
+        struct dns_entry_t *e = &dns_entries[i];
+        if (e->req != NULL) {
+            MYFREE(e->req);
+            e->req = NULL;
+            e->status = DNS_FAILED;
+            e->expires = 0;
         }
+    }
+    if (dns_async_used)
+        dns_async = FALSE;
+    if (dns_efd >= 0) {
+        close(dns_efd);
+        dns_efd = -1;
+    }
+}
+#endif
+
+//
+// Establish a connection, including all what it takes ->
+//      Host name resolution
+//      TCP connection open
+//      Check server answer
+//
+int conn_establish_connection(connection_t *conn, const conn_def_t *srv,
+                              const int default_port, const char *expect,
+                              const char *prefix, const int trace) {
+
+    char h[SMALLSTRSIZE];
+    int p;
+
+    if (split_hostname(srv->server, srv->port_set, (int)srv->port,
+                       default_port, prefix, h, sizeof(h), &p)) {
+        return CONNRES_INVALID_PORT_NUMBER;
+    }
+
+    conn_init(conn, guess_conntype(p, srv->crypt_set, (int)srv->crypt));
+
+    my_logf(LL_DEBUG, LP_DATETIME, "%s connecting to %s:%i...", prefix, h, p);
+
+    char server_desc[SMALLSTRSIZE + 100];
+    char s_err[ERR_STR_BUFSIZE];
+
+    snprintf(server_desc, sizeof(server_desc), "%s:%i", h, p);
+
+    // Resolving server name
+    struct sockaddr_in server;
+    struct in_addr addr;
+    int dns_handle;
+    int dns_st = dns_resolve(h, &addr, &dns_handle);
+    if (dns_st == DNS_PENDING) {
+        my_logf(LL_ERROR, LP_DATETIME, "%s timeout resolving %s", prefix, h);
+        return CONNRES_RESOLVE_ERROR;
+    } else if (dns_st == DNS_FAILED) {
+        my_logf(LL_ERROR, LP_DATETIME, "Unknown host %s, %s", h,
+                dns_err_desc(dns_handle));
+        return CONNRES_RESOLVE_ERROR;
+    }
+
+    int ret = CONNRES_CONNECTION_ERROR;
+
+    if ((conn->sock = socket(AF_INET, SOCK_STREAM,
+                             IPPROTO_TCP)) == SOCKET_ERROR) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "%s socket() error to create connection socket, %s", prefix,
+                os_last_err_desc(s_err, sizeof(s_err)));
+        conn->sock = -1;
+        return CONNRES_SOCKET_ERROR;
+    }
+    server.sin_family = AF_INET;
+    server.sin_port = htons((uint16_t)p);
+    server.sin_addr = addr;
+    // tv value is undefined after call to connect() as per documentation, so
+    // it is to be re-set every time.
+    int conn_to = (int)(srv->connect_timeout_set ? srv->connect_timeout :
+                        g_connect_timeout);
+    int netio_to = (int)(srv->netio_timeout_set ? srv->netio_timeout :
+                         g_netio_timeout);
+
+    my_logf(LL_DEBUG, LP_DATETIME,
+            "%s will connect to %s:%i, connect timeout = %d, netio timeout = %d",
+            prefix, h, p, conn_to, netio_to);
+
+    if ((ret = conn_connect(conn, &server, conn_to, netio_to, server_desc,
+                            prefix)) == CONNRES_OK) {
+        my_logf(LL_DEBUG, LP_DATETIME, "%s connected to %s", prefix, server_desc);
 
-        if (ch == '\n') {
-            if (cr && i > 0) {
-                i--;
+        if (expect != NULL && strlen(expect) >= 1) {
+            char *response = NULL;
+            size_t response_size;
+            if (conn_read_line_alloc(my_logf, conn, &response, trace,
+                                     &response_size) < 0) {
+                ;
+            } else if (s_begins_with(response, expect)) {
+                my_logf(LL_VERBOSE, LP_DATETIME,
+                        "%s received expected answer: '%s' (expected '%s')",
+                        prefix, response, expect);
+                ret = CONNRES_OK;
+            } else {
+                my_logf(LL_ERROR, LP_DATETIME,
+                        "%s received unexpected answer: '%s' (expected '%s')",
+                        prefix, response, expect);
+                ret = CONNRES_UNEXPECTED_ANSWER;
             }
-            (*out)[i] = '\0';
-            break;
+            MYFREE(response);
         } else {
-            cr = (ch == '\r' ? TRUE : FALSE);
-            (*out)[i] = ch;
+            ret = CONNRES_OK;
         }
-        i++;
+
     }
 
-    if (nb == 0) {
-        return 0;
-    } else {
-        if (trace) {
-            lp(LL_DEBUGTRACE, LP_DATETIME, "%s%s", conn->log_prefix_received,
-               *out);
+    return ret;
+}
+
+//
+// Receives a line from a socket (terminated by \012, a \015 before it being
+// removed). Data is read by chunks into the connection buffer, *line points
+// to the line inside it and remains valid until next read on conn. A line
+// longer than MAX_READLINE_SIZE is returned in several pieces.
+// Return -1 if an error occured, 1 if reading is successful,
+// 0 if transmission is closed (*line is then what was received before).
+//
+int conn_read_line(void (*lp)(const loglevel_t, const logdisp_t,
+                              const char *, ...), connection_t *conn, char **line,
+                   size_t *len, int trace) {
+    for (;;) {
+        char *b = conn->rbuf + conn->rbuf_start;
+        size_t avail = conn->rbuf_end - conn->rbuf_start;
+        char *nl = (char *)memchr(b, '\n', avail);
+
+        if (nl != NULL || avail >= MAX_READLINE_SIZE) {
+            size_t l = (nl != NULL ? (size_t)(nl - b) : avail);
+            conn->rbuf_start += (nl != NULL ? l + 1 : l);
+            if (nl != NULL && l >= 1 && b[l - 1] == '\r')
+                --l;
+            b[l] = '\0';
+            *line = b;
+            *len = l;
+            if (trace) {
+                lp(LL_DEBUGTRACE, LP_DATETIME, "%s%s", conn->log_prefix_received,
+                   b);
+            }
+            return 1;
+        }
+
+        // No complete line available: send what is waiting to be sent,
+        // as the answer may depend on it, move what was received to the
+        // beginning of the buffer, then read more.
+        if (conn->wbuf_len >= 1 && conn_flush(lp, conn))
+            return -1;
+        if (conn->rbuf_start >= 1) {
+            memmove(conn->rbuf, b, avail);
+            conn->rbuf_start = 0;
+            conn->rbuf_end = avail;
+        }
+        ssize_t nb = conn->sock_read(conn, conn->rbuf + conn->rbuf_end,
+                                     MAX_READLINE_SIZE - conn->rbuf_end);
+        if (nb < 0) {
+            char s_err[ERR_STR_BUFSIZE];
+            lp(LL_ERROR, LP_DATETIME, "Error reading socket, error %s",
+               os_last_err_desc(s_err, sizeof(s_err)));
+            conn_close(conn);
+            return -1;
+        }
+        if (nb == 0) {
+            conn->rbuf[conn->rbuf_end] = '\0';
+            *line = conn->rbuf;
+            *len = conn->rbuf_end;
+            conn->rbuf_start = conn->rbuf_end;
+            return 0;
         }
-        return 1;
+        conn->rbuf_end += (size_t)nb;
+    }
+}
+
+//
+// Same as conn_read_line, the line being copied into *out, allocated or
+// enlarged as need be.
+//
+int conn_read_line_alloc(void (*lp)(const loglevel_t, const logdisp_t,
+                                    const char *, ...), connection_t *conn, char **out, int trace,
+                         size_t *size) {
+    const size_t INITIAL_READLINE_BUFFER_SIZE = 100;
+
+    if (*out == NULL) {
+        *size = INITIAL_READLINE_BUFFER_SIZE;
+        *out = (char *)MYMALLOC(*size, out);
+    }
+
+    char *line;
+    size_t len;
+    int r = conn_read_line(lp, conn, &line, &len, trace);
+    if (r < 0)
+        return r;
+
+    if (len + 1 > *size) {
+        while (len + 1 > *size)
+            *size *= 2;
+        *out = (char *)MYREALLOC(*out, *size);
     }
+    memcpy(*out, line, len + 1);
+    return r;
 }
 
 //
-// Send a line to a socket
+// Send data waiting in the output buffer
 // Return 0 if OK, -1 if error.
 // Manage logging an error code and closing socket.
 //
-int conn_line_sendf(void (*lp)(const loglevel_t, const logdisp_t,
-                               const char *, ...), connection_t *conn, int trace, const char *fmt, ...) {
+int conn_flush(void (*lp)(const loglevel_t, const logdisp_t,
+                          const char *, ...), connection_t *conn) {
+    size_t done = 0;
+    size_t len = conn->wbuf_len;
+
+    conn->wbuf_len = 0;
+    if (conn->sock == -1)
+        return (len == 0 ? 0 : -1);
+    while (done < len) {
+        ssize_t e = conn->sock_write(conn, conn->wbuf + done, len - done);
+        if (e <= 0) {
+            char s_err[ERR_STR_BUFSIZE];
+            lp(LL_ERROR, LP_DATETIME, "Network I/O error: %s",
+               os_last_err_desc(s_err, sizeof(s_err)));
+            conn_close(conn);
+            return -1;
+        }
+        done += (size_t)e;
+    }
+    return 0;
+}
 
+//
+// Add a line to the output buffer. The buffer is sent when full, before
+// reading an answer, by conn_flush or when closing the connection.
+// Return 0 if OK, -1 if error.
+// Manage logging an error code and closing socket.
+//
+static int conn_line_vsendf(void (*lp)(const loglevel_t, const logdisp_t,
+                                       const char *, ...), connection_t *conn, int trace, const char *fmt,
+                            va_list args) {
     if (conn->sock == -1) {
         return -1;
     }
 
-    size_t l = (long int)(strlen(fmt) + 100);
-    char *to_send = (char *)MYMALLOC(l + 1, to_send);
+    va_list args2;
+    size_t room = CONN_WRITE_BUFSIZE - conn->wbuf_len;
+    va_copy(args2, args);
+    int n = vsnprintf(conn->wbuf + conn->wbuf_len, room, fmt, args2);
+    va_end(args2);
+    if (n < 0)
+        return -1;
 
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(to_send, l, fmt, args);
-    va_end(args);
+    if ((size_t)n + 2 > room) {
+        if (conn_flush(lp, conn))
+            return -1;
+        if ((size_t)n + 2 <= CONN_WRITE_BUFSIZE) {
+            va_copy(args2, args);
+            vsnprintf(conn->wbuf, CONN_WRITE_BUFSIZE, fmt, args2);
+            va_end(args2);
+        } else {
+            // Line larger than the buffer: sent on its own
+            size_t l = (size_t)n + 3;
+            char *to_send = (char *)MYMALLOC(l, to_send);
+            va_copy(args2, args);
+            vsnprintf(to_send, l, fmt, args2);
+            va_end(args2);
+            if (trace)
+                lp(LL_DEBUGTRACE, LP_DATETIME, "%s%s", conn->log_prefix_sent,
+                   to_send);
+            strncat(to_send, "\015\012", l - strlen(to_send) - 1);
+            ssize_t e = conn->sock_write(conn, to_send, strlen(to_send));
+            MYFREE(to_send);
+            if (e != (ssize_t)(n + 2)) {
+                char s_err[ERR_STR_BUFSIZE];
+                lp(LL_ERROR, LP_DATETIME, "Network I/O error: %s",
+                   os_last_err_desc(s_err, sizeof(s_err)));
+                conn_close(conn);
+                return -1;
+            }
+            return 0;
+        }
+    }
 
     if (trace)
         lp(LL_DEBUGTRACE, LP_DATETIME, "%s%s", conn->log_prefix_sent,
-           to_send);
-
-    strncat(to_send, "\015\012", l);
-    to_send[l] = '\0';
-
-    ssize_t e = conn->sock_write(conn, to_send, strlen(to_send));
-
-    MYFREE(to_send);
-
-    if (e == SOCKET_ERROR) {
-        char s_err[ERR_STR_BUFSIZE];
-        lp(LL_ERROR, LP_DATETIME, "Network I/O error: %s",
-           os_last_err_desc(s_err, sizeof(s_err)));
-        conn_close(conn);
-        return -1;
-    }
+           conn->wbuf + conn->wbuf_len);
 
+    conn->wbuf_len += (size_t)n;
+    conn->wbuf[conn->wbuf_len++] = '\015';
+    conn->wbuf[conn->wbuf_len++] = '\012';
     return 0;
 }
 
+//
+// Send a line to a socket, see conn_line_vsendf
+//
+int conn_line_sendf(void (*lp)(const loglevel_t, const logdisp_t,
+                               const char *, ...), connection_t *conn, int trace, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int e = conn_line_vsendf(lp, conn, trace, fmt, args);
+    va_end(args);
+    return e;
+}
+
 //
 // Send a string to a socket and chck answer (telnet-style communication)
 //
 int conn_round_trip(void (*lp)(const loglevel_t, const logdisp_t,
                                const char *, ...), connection_t *conn, const char *expect, int trace,
                     const char *fmt, ...) {
-    size_t l = strlen(fmt) + 100;
-    char *formatted_str = (char *)MYMALLOC(l + 1, formatted_str);
-
     va_list args;
     va_start(args, fmt);
-    vsnprintf(formatted_str, l, fmt, args);
+    int e = conn_line_vsendf(lp, conn, trace, fmt, args);
     va_end(args);
-
-    int e = conn_line_sendf(lp, conn, trace, formatted_str);
-    MYFREE(formatted_str);
     if (e)
         return CONNRES_NETIO;
 
-    char *response = NULL;
-    size_t response_size;
-    if (conn_read_line_alloc(lp, conn, &response, trace,
-                             &response_size) < 0) {
-        MYFREE(response);
-        return CONNRES_NETIO;
-    }
+    return conn_expect(lp, conn, expect, trace);
+}
 
-    if (s_begins_with(response, expect)) {
-        MYFREE(response);
-        return CONNRES_OK;
-    }
+//
+// Tell whether a line is followed by other lines of the same reply: a
+// multi-line reply (SMTP, RFC 5321 section 4.2.1) is made of lines
+// "NNN-text", the last one being "NNN text".
+//
+int conn_is_continuation_line(const char *line) {
+    return isdigit((unsigned char)line[0]) && isdigit((unsigned char)line[1])
+           && isdigit((unsigned char)line[2]) && line[3] == '-';
+}
+
+//
+// Read the answer to a command sent beforehand and check it begins with
+// expect. Used by conn_round_trip, and on its own when several commands are
+// sent before answers are read (SMTP PIPELINING).
+// Of a multi-line reply, the last line is checked.
+//
+int conn_expect(void (*lp)(const loglevel_t, const logdisp_t,
+                           const char *, ...), connection_t *conn, const char *expect, int trace) {
+    char *response;
+    size_t len;
+    do {
+        if (conn_read_line(lp, conn, &response, &len, trace) < 0)
+            return CONNRES_NETIO;
+    } while (conn_is_continuation_line(response));
 
-    MYFREE(response);
-    return CONNRES_UNEXPECTED_ANSWER;
+    return s_begins_with(response, expect) ? CONNRES_OK :
+           CONNRES_UNEXPECTED_ANSWER;
 }
 
 //
@@ -1193,3 +2186,1682 @@ ssize_t conn_ssl_write(connection_t *conn, void *buf,
     return SSL_write(conn->ssl, buf, (int)buf_len);
 }
 
+#ifdef MY_LINUX
+
+//
+// Multiplexed TCP probes
+//
+// All probes are started at once (within the limit of open files) and driven
+// by one epoll loop, so that a round of probes lasts about one connect
+// timeout, instead of the sum of them.
+// Only plain connections are multiplexed, SSL ones are left to the caller
+// (multiplexed member set to FALSE).
+//
+
+// File descriptors left available to the rest of the program
+#define PROBE_FD_RESERVE           32
+#define PROBE_EPOLL_MAX_EVENTS     256
+#define PROBE_READ_CHUNK           512
+#define PROBE_LINE_INITIAL_SIZE    100
+// epoll data of the DNS event file descriptor
+#define PROBE_DNS_EVENT_ID         UINT32_MAX
+
+enum {PS_WAITING, PS_RESOLVING, PS_CONNECTING, PS_READING, PS_DONE};
+
+struct probe_state_t {
+    int state;
+    int sock;
+    int dns_handle;
+    struct in_addr addr;
+    int port;
+    long long int start;
+    long long int deadline;
+    int netio_to;
+    char desc[SMALLSTRSIZE + 100];
+    char *line;
+    size_t line_size;
+    size_t line_len;
+};
+
+//
+// Number of probes that can run at the same time. Raises the soft limit of
+// open files (up to the hard limit) if need be.
+//
+static int probe_max_running(const int nb) {
+    struct rlimit rl;
+    rlim_t needed = (rlim_t)nb + PROBE_FD_RESERVE;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return nb;
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < needed
+            && rl.rlim_cur != rl.rlim_max) {
+        rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || needed < rl.rlim_max ?
+                       needed : rl.rlim_max);
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0 || getrlimit(RLIMIT_NOFILE, &rl) != 0)
+            return 1;
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur >= needed)
+        return nb;
+
+    int m = (int)rl.rlim_cur - PROBE_FD_RESERVE;
+    return m >= 1 ? m : 1;
+}
+
+//
+// Terminates a probe: send the closing line if any, then disconnect
+//
+static void probe_finish(conn_probe_t *probe, struct probe_state_t *ps,
+                         const int cr, const int trace) {
+    probe->cr = cr;
+    probe->duration_ms = (int)(os_monotonic_ms() - ps->start);
+
+    if (ps->sock != -1) {
+        if (cr == CONNRES_OK && probe->close != NULL) {
+            size_t l = strlen(probe->close) + 3;
+            char *to_send = (char *)MYMALLOC(l, to_send);
+            snprintf(to_send, l, "%s\015\012", probe->close);
+            if (trace)
+                my_logf(LL_DEBUGTRACE, LP_DATETIME, "%s%s",
+                        connection_table[CONNTYPE_PLAIN].log_prefix_sent, probe->close);
+            if (send(ps->sock, to_send, strlen(to_send), MSG_NOSIGNAL)
+                    != (ssize_t)strlen(to_send)) {
+                char s_err[ERR_STR_BUFSIZE];
+                my_logf(LL_ERROR, LP_DATETIME, "Network I/O error: %s",
+                        os_last_err_desc(s_err, sizeof(s_err)));
+                probe->cr = CONNRES_NETIO;
+            }
+            MYFREE(to_send);
+        }
+        os_closesocket(ps->sock);
+        ps->sock = -1;
+        if (cr == CONNRES_OK)
+            my_logf(LL_VERBOSE, LP_DATETIME, "%s disconnected from %s",
+                    probe->prefix, ps->desc);
+    }
+
+    if (ps->line != NULL) {
+        MYFREE(ps->line);
+        ps->line = NULL;
+    }
+    ps->state = PS_DONE;
+}
+
+//
+// Create socket and initiate connection, once host name is resolved
+//
+static void probe_connect(conn_probe_t *probe, struct probe_state_t *ps,
+                          const int epfd, const uint32_t id, const int trace) {
+    char s_err[ERR_STR_BUFSIZE];
+
+    int conn_to = (int)(probe->srv->connect_timeout_set ?
+                        probe->srv->connect_timeout : g_connect_timeout);
+    ps->netio_to = (int)(probe->srv->netio_timeout_set ?
+                         probe->srv->netio_timeout : g_netio_timeout);
+
+    my_logf(LL_DEBUG, LP_DATETIME,
+            "%s will connect to %s, connect timeout = %d, netio timeout = %d",
+            probe->prefix, ps->desc, conn_to, ps->netio_to);
+
+    if ((ps->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == SOCKET_ERROR) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "%s socket() error to create connection socket, %s",
+                probe->prefix, os_last_err_desc(s_err, sizeof(s_err)));
+        ps->sock = -1;
+        probe_finish(probe, ps, CONNRES_SOCKET_ERROR, trace);
+        return;
+    }
+    os_set_sock_nonblocking_mode(ps->sock);
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons((uint16_t)ps->port);
+    server.sin_addr = ps->addr;
+
+    if (connect(ps->sock, (struct sockaddr *)&server,
+                sizeof(server)) == CONNECT_ERROR
+            && !os_last_network_op_is_in_progress()) {
+        my_logf(LL_ERROR, LP_DATETIME, "%s error connecting to %s, %s",
+                probe->prefix, ps->desc, os_last_err_desc(s_err, sizeof(s_err)));
+        probe_finish(probe, ps, CONNRES_CONNECTION_ERROR, trace);
+        return;
+    }
+
+    // Whether or not connection is already established, completion is
+    // reported by epoll (the socket becomes writable).
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.u32 = id;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ps->sock, &ev) != 0)
+        fatal_error("%s epoll_ctl() error, %s", probe->prefix,
+                    os_last_err_desc(s_err, sizeof(s_err)));
+    ps->state = PS_CONNECTING;
+    ps->deadline = os_monotonic_ms() + (long long int)conn_to * 1000;
+}
+
+//
+// Host name lookup is over (or was not needed)
+//
+static void probe_on_resolve(conn_probe_t *probe, struct probe_state_t *ps,
+                             const int dns_st, const int epfd,
+                             const uint32_t id, const int trace) {
+    if (dns_st == DNS_OK) {
+        probe_connect(probe, ps, epfd, id, trace);
+    } else {
+        my_logf(LL_ERROR, LP_DATETIME, "%s unknown host %s, %s", probe->prefix,
+                ps->desc, dns_err_desc(ps->dns_handle));
+        probe_finish(probe, ps, CONNRES_RESOLVE_ERROR, trace);
+    }
+}
+
+//
+// Resolve host name, then initiate connection. If the host name lookup is
+// in progress, connection is initiated once it is over.
+//
+static void probe_start(conn_probe_t *probe, struct probe_state_t *ps,
+                        const int epfd, const uint32_t id, const int trace) {
+    char h[SMALLSTRSIZE];
+
+    ps->start = os_monotonic_ms();
+    if (split_hostname(probe->srv->server, probe->srv->port_set,
+                       (int)probe->srv->port, 0, probe->prefix, h, sizeof(h),
+                       &ps->port)) {
+        probe_finish(probe, ps, CONNRES_INVALID_PORT_NUMBER, trace);
+        return;
+    }
+
+    if (guess_conntype(ps->port, probe->srv->crypt_set,
+                       (int)probe->srv->crypt) != CONNTYPE_PLAIN) {
+        probe->multiplexed = FALSE;
+        ps->state = PS_DONE;
+        return;
+    }
+
+    my_logf(LL_DEBUG, LP_DATETIME, "%s connecting to %s:%i...", probe->prefix, h,
+            ps->port);
+    snprintf(ps->desc, sizeof(ps->desc), "%s:%i", h, ps->port);
+
+    int dns_st = dns_lookup(h, &ps->addr, &ps->dns_handle);
+    if (dns_st == DNS_PENDING) {
+        ps->state = PS_RESOLVING;
+        ps->deadline = os_monotonic_ms() + (long long int)g_dns_timeout * 1000;
+        return;
+    }
+    probe_on_resolve(probe, ps, dns_st, epfd, id, trace);
+}
+
+//
+// Connection attempt is over (socket is writable)
+//
+static void probe_on_connect(conn_probe_t *probe, struct probe_state_t *ps,
+                             const int epfd, const uint32_t id, const int trace) {
+    int so_error = 0;
+    socklen_t len = sizeof(so_error);
+    if (getsockopt(ps->sock, SOL_SOCKET, SO_ERROR, &so_error, &len) != 0)
+        so_error = errno;
+    if (so_error != 0) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "%s network error connecting to %s, code=%i (%s)",
+                probe->prefix, ps->desc, so_error, strerror(so_error));
+        probe_finish(probe, ps, CONNRES_NETIO, trace);
+        return;
+    }
+
+    my_logf(LL_DEBUG, LP_DATETIME, "%s connected to %s", probe->prefix,
+            ps->desc);
+
+    if (probe->expect == NULL || strlen(probe->expect) == 0) {
+        probe_finish(probe, ps, CONNRES_OK, trace);
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = id;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, ps->sock, &ev) != 0) {
+        char s_err[ERR_STR_BUFSIZE];
+        fatal_error("%s epoll_ctl() error, %s", probe->prefix,
+                    os_last_err_desc(s_err, sizeof(s_err)));
+    }
+    ps->state = PS_READING;
+    ps->deadline = os_monotonic_ms() + (long long int)ps->netio_to * 1000;
+    ps->line_size = PROBE_LINE_INITIAL_SIZE;
+    ps->line_len = 0;
+    ps->line = (char *)MYMALLOC(ps->line_size, ps->line);
+}
+
+//
+// First line received: compare it with what is expected
+//
+static void probe_check_answer(conn_probe_t *probe, struct probe_state_t *ps,
+                               const int trace) {
+    ps->line[ps->line_len] = '\0';
+    char *eol = strchr(ps->line, '\n');
+    if (eol != NULL) {
+        if (eol > ps->line && *(eol - 1) == '\r')
+            --eol;
+        *eol = '\0';
+    }
+
+    if (trace)
+        my_logf(LL_DEBUGTRACE, LP_DATETIME, "%s%s",
+                connection_table[CONNTYPE_PLAIN].log_prefix_received, ps->line);
+
+    if (s_begins_with(ps->line, probe->expect)) {
+        my_logf(LL_VERBOSE, LP_DATETIME,
+                "%s received expected answer: '%s' (expected '%s')",
+                probe->prefix, ps->line, probe->expect);
+        probe_finish(probe, ps, CONNRES_OK, trace);
+    } else {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "%s received unexpected answer: '%s' (expected '%s')",
+                probe->prefix, ps->line, probe->expect);
+        probe_finish(probe, ps, CONNRES_UNEXPECTED_ANSWER, trace);
+    }
+}
+
+//
+// Data available on the socket
+//
+static void probe_on_read(conn_probe_t *probe, struct probe_state_t *ps,
+                          const int trace) {
+    for (;;) {
+        char buf[PROBE_READ_CHUNK];
+        ssize_t nb = recv(ps->sock, buf, sizeof(buf), 0);
+        if (nb < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            char s_err[ERR_STR_BUFSIZE];
+            my_logf(LL_ERROR, LP_DATETIME, "Error reading socket, error %s",
+                    os_last_err_desc(s_err, sizeof(s_err)));
+            probe_finish(probe, ps, CONNRES_NETIO, trace);
+            return;
+        }
+        if (nb == 0) {
+            probe_check_answer(probe, ps, trace);
+            return;
+        }
+
+        while (ps->line_len + (size_t)nb + 1 > ps->line_size
+                && ps->line_size * 2 <= MAX_READLINE_SIZE) {
+            ps->line_size *= 2;
+            ps->line = (char *)MYREALLOC(ps->line, ps->line_size);
+        }
+        size_t n = (size_t)nb;
+        if (ps->line_len + n + 1 > ps->line_size)
+            n = ps->line_size - ps->line_len - 1;
+        memcpy(ps->line + ps->line_len, buf, n);
+        ps->line_len += n;
+
+        if (memchr(buf, '\n', n) != NULL || ps->line_len + 1 >= ps->line_size) {
+            probe_check_answer(probe, ps, trace);
+            return;
+        }
+    }
+}
+
+//
+// Perform TCP probes all at once. Result of each probe (CONNRES_* code) is
+// stored in probes[i].cr.
+//
+void conn_probe_multi(conn_probe_t *probes, const int nb, const int trace) {
+    int i;
+
+    if (nb <= 0)
+        return;
+
+    struct probe_state_t *states =
+        (struct probe_state_t *)MYMALLOC(sizeof(struct probe_state_t) *
+                                         (unsigned long int)nb, states);
+    for (i = 0; i < nb; ++i) {
+        probes[i].multiplexed = TRUE;
+        probes[i].cr = CONNRES_CONNECTION_ERROR;
+        probes[i].duration_ms = 0;
+        states[i].state = PS_WAITING;
+        states[i].sock = -1;
+        states[i].dns_handle = -1;
+        states[i].line = NULL;
+        states[i].desc[0] = '\0';
+    }
+
+    char s_err[ERR_STR_BUFSIZE];
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        fatal_error("epoll_create1() error, %s", os_last_err_desc(s_err,
+                    sizeof(s_err)));
+
+    int max_running = probe_max_running(nb);
+    int nb_running = 0;
+    int next = 0;
+    int dns_watched = FALSE;
+    struct epoll_event events[PROBE_EPOLL_MAX_EVENTS];
+
+    for (;;) {
+        while (nb_running < max_running && next < nb) {
+            probe_start(&probes[next], &states[next], epfd, (uint32_t)next, trace);
+            if (states[next].state != PS_DONE)
+                ++nb_running;
+            ++next;
+        }
+
+        if (nb_running == 0)
+            break;
+
+        if (!dns_watched && dns_event_fd() >= 0) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.u32 = PROBE_DNS_EVENT_ID;
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, dns_event_fd(), &ev) != 0)
+                fatal_error("epoll_ctl() error, %s", os_last_err_desc(s_err,
+                            sizeof(s_err)));
+            dns_watched = TRUE;
+        }
+
+        long long int now = os_monotonic_ms();
+        long long int wait = -1;
+        for (i = 0; i < next; ++i) {
+            if (states[i].state == PS_RESOLVING || states[i].state == PS_CONNECTING
+                    || states[i].state == PS_READING) {
+                long long int w = states[i].deadline - now;
+                if (w < 0)
+                    w = 0;
+                if (wait < 0 || w < wait)
+                    wait = w;
+            }
+        }
+
+        int n = epoll_wait(epfd, events, PROBE_EPOLL_MAX_EVENTS, (int)wait);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fatal_error("epoll_wait() error, %s", os_last_err_desc(s_err,
+                        sizeof(s_err)));
+        }
+
+        int k;
+        for (k = 0; k < n; ++k) {
+            if (events[k].data.u32 == PROBE_DNS_EVENT_ID) {
+                dns_poll();
+                for (i = 0; i < next; ++i) {
+                    if (states[i].state != PS_RESOLVING)
+                        continue;
+                    int dns_st = dns_status(states[i].dns_handle, &states[i].addr);
+                    if (dns_st == DNS_PENDING)
+                        continue;
+                    probe_on_resolve(&probes[i], &states[i], dns_st, epfd,
+                                     (uint32_t)i, trace);
+                    if (states[i].state == PS_DONE)
+                        --nb_running;
+                }
+                continue;
+            }
+            int id = (int)events[k].data.u32;
+            struct probe_state_t *ps = &states[id];
+            if (ps->state == PS_CONNECTING)
+                probe_on_connect(&probes[id], ps, epfd, (uint32_t)id, trace);
+            else if (ps->state == PS_READING)
+                probe_on_read(&probes[id], ps, trace);
+            else
+                continue;
+            if (ps->state == PS_DONE)
+                --nb_running;
+        }
+
+        now = os_monotonic_ms();
+        for (i = 0; i < next; ++i) {
+            struct probe_state_t *ps = &states[i];
+            if (ps->state != PS_RESOLVING && ps->state != PS_CONNECTING
+                    && ps->state != PS_READING)
+                continue;
+            if (ps->deadline > now)
+                continue;
+            if (ps->state == PS_RESOLVING) {
+                my_logf(LL_ERROR, LP_DATETIME, "%s timeout resolving %s",
+                        probes[i].prefix, ps->desc);
+                probe_finish(&probes[i], ps, CONNRES_RESOLVE_ERROR, trace);
+            } else if (ps->state == PS_CONNECTING) {
+                my_logf(LL_ERROR, LP_DATETIME, "%s timeout connecting to %s",
+                        probes[i].prefix, ps->desc);
+                probe_finish(&probes[i], ps, CONNRES_CONNECTION_TIMEOUT, trace);
+            } else {
+                my_logf(LL_ERROR, LP_DATETIME, "%s timeout reading from %s",
+                        probes[i].prefix, ps->desc);
+                probe_finish(&probes[i], ps, CONNRES_NETIO, trace);
+            }
+            --nb_running;
+        }
+    }
+
+    close(epfd);
+    MYFREE(states);
+}
+
+
+//
+// Program runner
+//
+// Programs are started with posix_spawn (no copy of netmon's memory), in a
+// process group of their own, standard output and standard error going to
+// pipes. One poll loop reads the pipes of all the programs running and
+// enforces their timeout by killing their process group.
+// When the spawn server (see below) is running, this is done by the
+// server rather than by netmon.
+//
+
+// While a program is running, delay between two checks of its termination,
+// when the kernel does not provide process file descriptors
+#define PRG_REAP_POLL_MS           10
+
+// Once a program is terminated, number of reads of each of its outputs
+// at most, for what remains in the pipes
+#define PRG_DRAIN_MAX_READS        32
+
+extern char **environ;
+
+//
+// Start a program, return FALSE if it could not be started
+//
+static int prg_spawn(prg_run_t *run) {
+    int out[2];
+    int err[2];
+    if (pipe2(out, O_CLOEXEC) != 0)
+        return FALSE;
+    if (pipe2(err, O_CLOEXEC) != 0) {
+        close(out[0]);
+        close(out[1]);
+        return FALSE;
+    }
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, err[1], STDERR_FILENO);
+
+    // Signals netmon catches are reset by exec, SIGPIPE is ignored by
+    // netmon and must not be by the program.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK
+                             | POSIX_SPAWN_SETSIGDEF);
+
+    char *argv[4];
+    argv[0] = (char *)"sh";
+    argv[1] = (char *)"-c";
+    argv[2] = (char *)run->command;
+    argv[3] = NULL;
+    int e = posix_spawn(&run->pid, "/bin/sh", &fa, &attr, argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    close(out[1]);
+    close(err[1]);
+    if (e != 0) {
+        close(out[0]);
+        close(err[0]);
+        errno = e;
+        return FALSE;
+    }
+    run->fds[0] = out[0];
+    run->fds[1] = err[0];
+#ifdef SYS_pidfd_open
+    run->pidfd = (int)syscall(SYS_pidfd_open, run->pid, 0);
+#else
+    run->pidfd = -1;
+#endif
+    return TRUE;
+}
+
+//
+// Read what is available on output number i (0: standard output,
+// 1: standard error) of a program. What goes beyond the buffer is read and
+// discarded, so that the program does not block.
+//
+static void prg_read(prg_run_t *run, const int i) {
+    char *buf = (i == 0 ? run->out : run->err);
+    size_t *len = (i == 0 ? &run->out_len : &run->err_len);
+    char discard[PRG_OUTPUT_SIZE];
+    ssize_t n;
+    if (*len < PRG_OUTPUT_SIZE - 1)
+        n = read(run->fds[i], buf + *len, PRG_OUTPUT_SIZE - 1 - *len);
+    else
+        n = read(run->fds[i], discard, sizeof(discard));
+    if (n < 0 && errno == EINTR)
+        return;
+    if (n <= 0) {
+        close(run->fds[i]);
+        run->fds[i] = -1;
+        return;
+    }
+    if (*len < PRG_OUTPUT_SIZE - 1) {
+        *len += (size_t)n;
+        buf[*len] = '\0';
+    }
+}
+
+//
+// Get the exit status of a program. Returns FALSE if it is not terminated
+// yet.
+//
+static int prg_reap(prg_run_t *run, const int options) {
+    int status;
+    pid_t r;
+    while ((r = waitpid(run->pid, &status, options)) < 0 && errno == EINTR)
+        ;
+    if (r == 0)
+        return FALSE;
+    if (run->pidfd >= 0) {
+        close(run->pidfd);
+        run->pidfd = -1;
+    }
+    if (r < 0)
+        run->exit_code = -1;
+    else if (WIFEXITED(status))
+        run->exit_code = WEXITSTATUS(status);
+    else
+        run->exit_code = -1;
+    run->duration_ms = (int)(os_monotonic_ms() - run->start);
+    return TRUE;
+}
+
+//
+// Timeout: kill the whole process group, not only the shell
+//
+static void prg_kill(prg_run_t *run) {
+    kill(-run->pid, SIGKILL);
+    int i;
+    for (i = 0; i < 2; ++i) {
+        if (run->fds[i] >= 0) {
+            close(run->fds[i]);
+            run->fds[i] = -1;
+        }
+    }
+    run->timed_out = TRUE;
+    prg_reap(run, 0);
+    run->exit_code = -1;
+}
+
+static void prg_reset(prg_run_t *run) {
+    run->exit_code = -1;
+    run->timed_out = FALSE;
+    run->duration_ms = 0;
+    run->out[0] = '\0';
+    run->out_len = 0;
+    run->err[0] = '\0';
+    run->err_len = 0;
+}
+
+//
+// Prepare the run of a program and start it. If the program could not be
+// started, the run is done and the reason is in its standard error.
+// Returns TRUE if the program is running.
+//
+static int prg_start(prg_run_t *run) {
+    prg_reset(run);
+    run->start = os_monotonic_ms();
+    if (!prg_spawn(run)) {
+        char s_err[ERR_STR_BUFSIZE];
+        snprintf(run->err, sizeof(run->err), "unable to run /bin/sh, %s",
+                 os_last_err_desc(s_err, sizeof(s_err)));
+        run->err_len = strlen(run->err);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//
+// Add to pfds the descriptors of a running program to wait for, pfd_run
+// telling the index of the program (i) for each descriptor added.
+// Returns the delay after which the program needs attention, -1 if none.
+//
+static long long int prg_poll_add(const prg_run_t *run, const int i,
+                                  struct pollfd *pfds, int *pfd_run, int *nb_pfds,
+                                  const long long int now) {
+    int j;
+    for (j = 0; j < 2; ++j) {
+        if (run->fds[j] < 0)
+            continue;
+        pfds[*nb_pfds].fd = run->fds[j];
+        pfds[*nb_pfds].events = POLLIN;
+        pfd_run[(*nb_pfds)++] = i;
+    }
+    // The termination of the program is watched along with its outputs,
+    // that programs it started in the background can keep open.
+    long long int w = -1;
+    if (run->pidfd >= 0) {
+        pfds[*nb_pfds].fd = run->pidfd;
+        pfds[*nb_pfds].events = POLLIN;
+        pfd_run[(*nb_pfds)++] = i;
+    } else {
+        w = PRG_REAP_POLL_MS;
+    }
+    if (run->timeout_ms > 0) {
+        long long int left = run->start + run->timeout_ms - now;
+        if (left < 0)
+            left = 0;
+        if (w < 0 || left < w)
+            w = left;
+    }
+    return w;
+}
+
+//
+// Read the output a program for which poll returned an event
+//
+static void prg_poll_read(prg_run_t *run, const struct pollfd *pfd) {
+    if (pfd->fd == run->fds[0])
+        prg_read(run, 0);
+    else if (pfd->fd == run->fds[1])
+        prg_read(run, 1);
+}
+
+//
+// Read what remains in the outputs of a terminated program, without
+// waiting for programs it started in the background, then close them
+//
+static void prg_drain(prg_run_t *run) {
+    int i;
+    for (i = 0; i < 2; ++i) {
+        int n;
+        for (n = 0; run->fds[i] >= 0 && n < PRG_DRAIN_MAX_READS; ++n) {
+            struct pollfd pfd;
+            pfd.fd = run->fds[i];
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, 0) <= 0)
+                break;
+            prg_read(run, i);
+        }
+        if (run->fds[i] >= 0) {
+            close(run->fds[i]);
+            run->fds[i] = -1;
+        }
+    }
+}
+
+//
+// Returns TRUE if a program is done, either terminated or killed because
+// its timeout elapsed
+//
+static int prg_is_done(prg_run_t *run, const long long int now) {
+    if (prg_reap(run, WNOHANG)) {
+        prg_drain(run);
+        return TRUE;
+    }
+    if (run->timeout_ms > 0 && now >= run->start + run->timeout_ms) {
+        prg_kill(run);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+//
+// Run programs, at most max_parallel at a time, and wait for all of them
+// to terminate (or to be killed).
+//
+static void prg_run_multi_direct(prg_run_t *runs, const int nb,
+                                 const int max_parallel) {
+    int *running = (int *)MYMALLOC(sizeof(int) * (size_t)(nb + 1), running);
+    struct pollfd *pfds = (struct pollfd *)MYMALLOC(sizeof(struct pollfd) *
+                          (size_t)(3 * nb + 1), pfds);
+    int *pfd_run = (int *)MYMALLOC(sizeof(int) * (size_t)(3 * nb + 1), pfd_run);
+    int nb_running = 0;
+    int next = 0;
+    int i;
+
+    while (TRUE) {
+        while (nb_running < max_parallel && next < nb) {
+            if (prg_start(&runs[next]))
+                running[nb_running++] = next;
+            ++next;
+        }
+        if (nb_running == 0)
+            break;
+
+        long long int now = os_monotonic_ms();
+        long long int wait = -1;
+        int nb_pfds = 0;
+        for (i = 0; i < nb_running; ++i) {
+            long long int w = prg_poll_add(&runs[running[i]], i, pfds, pfd_run,
+                                           &nb_pfds, now);
+            if (w >= 0 && (wait < 0 || w < wait))
+                wait = w;
+        }
+
+        if (poll(pfds, (nfds_t)nb_pfds, (int)wait) < 0 && errno != EINTR) {
+            char s_err[ERR_STR_BUFSIZE];
+            fatal_error("poll() error, %s", os_last_err_desc(s_err,
+                        sizeof(s_err)));
+        }
+
+        for (i = 0; i < nb_pfds; ++i) {
+            if (pfds[i].revents != 0)
+                prg_poll_read(&runs[running[pfd_run[i]]], &pfds[i]);
+        }
+
+        now = os_monotonic_ms();
+        i = 0;
+        while (i < nb_running) {
+            if (prg_is_done(&runs[running[i]], now))
+                running[i] = running[--nb_running];
+            else
+                ++i;
+        }
+    }
+
+    MYFREE(pfd_run);
+    MYFREE(pfds);
+    MYFREE(running);
+}
+
+//
+// Spawn server
+//
+// A small process forked when netmon starts, before the configuration is
+// read, that starts programs on behalf of netmon: programs do not inherit
+// netmon's descriptors (connections, pipes of check processes and plugin
+// helpers, ...), and starting them does not depend on the size of netmon.
+// Requests and answers go through a SOCK_SEQPACKET socket pair, one
+// message each, so that answers can come in any order, which happens only
+// when several programs are sent at a time (program_parallel 2 or more).
+// The server runs programs the same way netmon would, using the functions
+// above, and tells netmon the pid of each program it starts.
+// If the server cannot be started or stops answering, netmon kills it
+// along with the programs it was running, and starts programs itself.
+//
+
+// Longest command the server accepts
+#define PRG_SERVER_COMMAND_MAX  65536
+
+// Time given to the server to answer once the timeout of a program
+// elapsed, beyond which the server is considered hung
+#define PRG_SERVER_ANSWER_MARGIN_MS 5000
+
+enum {PRG_REQ_RUN, PRG_REQ_SETUP};
+enum {PRG_ANS_DONE, PRG_ANS_STARTED, PRG_ANS_SETUP};
+
+// Followed by the command (PRG_REQ_RUN) or the working directory
+// (PRG_REQ_SETUP), terminated by a null character
+struct prg_request_t {
+    int type;
+    int id;
+    long int timeout_ms;
+    // PRG_REQ_SETUP
+    mode_t umask;
+};
+
+// PRG_ANS_DONE is followed by out_len bytes of standard output, then
+// err_len bytes of standard error
+struct prg_answer_t {
+    int type;
+    int id;
+    // PRG_ANS_STARTED: pid of the program
+    // PRG_ANS_SETUP: errno value of the setup, 0 if successful
+    int value;
+    int exit_code;
+    int timed_out;
+    int duration_ms;
+    int out_len;
+    int err_len;
+};
+
+static int prg_server_fd = -1;
+static pid_t prg_server_pid = -1;
+// Readable once the server is terminated, -1 if not available
+static int prg_server_pidfd = -1;
+
+static int prg_server_answer(int fd, const int id, const prg_run_t *run) {
+    struct prg_answer_t ans;
+    memset(&ans, 0, sizeof(ans));
+    ans.type = PRG_ANS_DONE;
+    ans.id = id;
+    ans.exit_code = run->exit_code;
+    ans.timed_out = run->timed_out;
+    ans.duration_ms = run->duration_ms;
+    ans.out_len = (int)run->out_len;
+    ans.err_len = (int)run->err_len;
+    struct iovec iov[3];
+    iov[0].iov_base = &ans;
+    iov[0].iov_len = sizeof(ans);
+    iov[1].iov_base = (void *)run->out;
+    iov[1].iov_len = run->out_len;
+    iov[2].iov_base = (void *)run->err;
+    iov[2].iov_len = run->err_len;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+    ssize_t n;
+    while ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return n >= 0;
+}
+
+//
+// Answer that comes with no output (PRG_ANS_STARTED or PRG_ANS_SETUP)
+//
+static int prg_server_notify(int fd, const int type, const int id,
+                             const int value) {
+    struct prg_answer_t ans;
+    memset(&ans, 0, sizeof(ans));
+    ans.type = type;
+    ans.id = id;
+    ans.value = value;
+    ssize_t n;
+    while ((n = send(fd, &ans, sizeof(ans), MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return n >= 0;
+}
+
+//
+// Code executed by the server. Returns when netmon closes its end of the
+// socket.
+//
+static void prg_server_run(int fd) {
+    // Tell it apart from netmon in the list of processes
+    prctl(PR_SET_NAME, "netmon-spawn", 0, 0, 0);
+
+    // Signals sent to the terminal process group are for netmon, the server
+    // terminates once netmon is gone
+    signal(SIGINT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+
+    size_t req_size = sizeof(struct prg_request_t) + PRG_SERVER_COMMAND_MAX + 1;
+    char *req_buf = (char *)MYMALLOC(req_size, req_buf);
+    int nb_alloc = 4;
+    prg_run_t **running = (prg_run_t **)MYMALLOC(sizeof(prg_run_t *) *
+                          (size_t)nb_alloc, running);
+    int *running_id = (int *)MYMALLOC(sizeof(int) * (size_t)nb_alloc,
+                                      running_id);
+    struct pollfd *pfds = (struct pollfd *)MYMALLOC(sizeof(struct pollfd) *
+                          (size_t)(3 * nb_alloc + 1), pfds);
+    int *pfd_run = (int *)MYMALLOC(sizeof(int) * (size_t)(3 * nb_alloc + 1),
+                                   pfd_run);
+    int nb_running = 0;
+    int fd_open = TRUE;
+    int i;
+
+    while (fd_open || nb_running >= 1) {
+        long long int now = os_monotonic_ms();
+        long long int wait = -1;
+        int nb_pfds = 0;
+        if (fd_open) {
+            pfds[nb_pfds].fd = fd;
+            pfds[nb_pfds].events = POLLIN;
+            pfd_run[nb_pfds++] = -1;
+        }
+        for (i = 0; i < nb_running; ++i) {
+            long long int w = prg_poll_add(running[i], i, pfds, pfd_run, &nb_pfds,
+                                           now);
+            if (w >= 0 && (wait < 0 || w < wait))
+                wait = w;
+        }
+
+        if (poll(pfds, (nfds_t)nb_pfds, (int)wait) < 0 && errno != EINTR)
+            break;
+
+        for (i = 0; i < nb_pfds; ++i) {
+            if (pfds[i].revents != 0 && pfd_run[i] >= 0)
+                prg_poll_read(running[pfd_run[i]], &pfds[i]);
+        }
+
+        if (fd_open && pfds[0].revents != 0) {
+            ssize_t n = recv(fd, req_buf, req_size - 1, MSG_TRUNC);
+            if (n == 0 || (n < 0 && errno != EINTR)) {
+                fd_open = FALSE;
+            } else if (n >= (ssize_t)sizeof(struct prg_request_t)
+                       && n <= (ssize_t)req_size - 1) {
+                req_buf[n] = '\0';
+                struct prg_request_t *req = (struct prg_request_t *)req_buf;
+                const char *s = req_buf + sizeof(struct prg_request_t);
+                if (req->type == PRG_REQ_SETUP) {
+                    umask(req->umask);
+                    int e = (chdir(s) == 0 ? 0 : errno);
+                    fd_open = prg_server_notify(fd, PRG_ANS_SETUP, req->id, e);
+                } else if (req->type == PRG_REQ_RUN) {
+                    if (nb_running + 1 > nb_alloc) {
+                        nb_alloc = 2 * nb_alloc + 4;
+                        running = (prg_run_t **)MYREALLOC(running,
+                                                          sizeof(prg_run_t *) * (size_t)nb_alloc);
+                        running_id = (int *)MYREALLOC(running_id,
+                                                      sizeof(int) * (size_t)nb_alloc);
+                        pfds = (struct pollfd *)MYREALLOC(pfds,
+                                                          sizeof(struct pollfd) * (size_t)(3 * nb_alloc + 1));
+                        pfd_run = (int *)MYREALLOC(pfd_run,
+                                                   sizeof(int) * (size_t)(3 * nb_alloc + 1));
+                    }
+                    prg_run_t *run = (prg_run_t *)MYMALLOC(sizeof(prg_run_t), run);
+                    char *command = (char *)MYMALLOC(strlen(s) + 1, command);
+                    strcpy(command, s);
+                    run->command = command;
+                    run->timeout_ms = req->timeout_ms;
+                    if (prg_start(run)) {
+                        running[nb_running] = run;
+                        running_id[nb_running++] = req->id;
+                        fd_open = prg_server_notify(fd, PRG_ANS_STARTED, req->id,
+                                                    (int)run->pid);
+                    } else {
+                        fd_open = fd_open && prg_server_answer(fd, req->id, run);
+                        MYFREE(command);
+                        MYFREE(run);
+                    }
+                }
+            }
+        }
+
+        now = os_monotonic_ms();
+        i = 0;
+        while (i < nb_running) {
+            prg_run_t *run = running[i];
+            if (prg_is_done(run, now)) {
+                if (fd_open)
+                    fd_open = prg_server_answer(fd, running_id[i], run);
+                MYFREE((char *)run->command);
+                MYFREE(run);
+                --nb_running;
+                running[i] = running[nb_running];
+                running_id[i] = running_id[nb_running];
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    MYFREE(pfd_run);
+    MYFREE(pfds);
+    MYFREE(running_id);
+    MYFREE(running);
+    MYFREE(req_buf);
+}
+
+//
+// Fork the spawn server
+// Returns TRUE if successful, FALSE otherwise
+//
+int prg_server_start() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0)
+        return FALSE;
+
+    // Don't let the child process inherit unflushed output
+    fflush(NULL);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        prg_server_run(sv[1]);
+        _exit(EXIT_SUCCESS);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        return FALSE;
+    }
+    prg_server_fd = sv[0];
+    prg_server_pid = pid;
+#ifdef SYS_pidfd_open
+    prg_server_pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+#endif
+    return TRUE;
+}
+
+//
+// Kill the spawn server, unless it is already terminated: its pid could
+// then be used by another process. Without process file descriptors, this
+// can be known only while netmon is the parent of the server (not in
+// daemon mode), otherwise the server is left alone.
+//
+static void prg_server_kill() {
+#ifdef SYS_pidfd_send_signal
+    if (prg_server_pidfd >= 0) {
+        syscall(SYS_pidfd_send_signal, prg_server_pidfd, SIGKILL, NULL, 0);
+        return;
+    }
+#endif
+    if (waitpid(prg_server_pid, NULL, WNOHANG) == 0)
+        kill(prg_server_pid, SIGKILL);
+}
+
+//
+// Stop the spawn server: closing the socket tells it to terminate
+//
+void prg_server_stop() {
+    if (prg_server_fd < 0)
+        return;
+    close(prg_server_fd);
+    prg_server_fd = -1;
+    // waitpid fails if netmon is no longer the parent (daemon mode)
+    while (waitpid(prg_server_pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+    prg_server_pid = -1;
+    if (prg_server_pidfd >= 0) {
+        close(prg_server_pidfd);
+        prg_server_pidfd = -1;
+    }
+}
+
+//
+// To be called by a child process after fork(): the server belongs to the
+// parent, the child starts programs itself.
+//
+void prg_server_after_fork() {
+    if (prg_server_fd >= 0)
+        close(prg_server_fd);
+    prg_server_fd = -1;
+    prg_server_pid = -1;
+    if (prg_server_pidfd >= 0)
+        close(prg_server_pidfd);
+    prg_server_pidfd = -1;
+}
+
+static int prg_server_send(const int id, const prg_run_t *run) {
+    struct prg_request_t req;
+    memset(&req, 0, sizeof(req));
+    req.type = PRG_REQ_RUN;
+    req.id = id;
+    req.timeout_ms = run->timeout_ms;
+    struct iovec iov[2];
+    iov[0].iov_base = &req;
+    iov[0].iov_len = sizeof(req);
+    iov[1].iov_base = (void *)run->command;
+    iov[1].iov_len = strlen(run->command) + 1;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    ssize_t n;
+    while ((n = sendmsg(prg_server_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return n >= 0;
+}
+
+//
+// Wait for an answer of the server until deadline (-1 for no deadline)
+// Returns FALSE if no answer came in time
+//
+static int prg_server_wait(const long long int deadline) {
+    while (TRUE) {
+        int w = -1;
+        if (deadline >= 0) {
+            long long int left = deadline - os_monotonic_ms();
+            w = (int)(left >= 0 ? left : 0);
+        }
+        struct pollfd pfd;
+        pfd.fd = prg_server_fd;
+        pfd.events = POLLIN;
+        int r = poll(&pfd, 1, w);
+        if (r >= 1)
+            return TRUE;
+        if (r == 0 || errno != EINTR)
+            return FALSE;
+    }
+}
+
+//
+// Give the server the current working directory and umask, for the
+// programs it starts to get the same as netmon
+//
+void prg_server_setup() {
+    if (prg_server_fd < 0)
+        return;
+    char cwd[PRG_SERVER_COMMAND_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return;
+    struct prg_request_t req;
+    memset(&req, 0, sizeof(req));
+    req.type = PRG_REQ_SETUP;
+    req.umask = umask(0);
+    umask(req.umask);
+    struct iovec iov[2];
+    iov[0].iov_base = &req;
+    iov[0].iov_len = sizeof(req);
+    iov[1].iov_base = cwd;
+    iov[1].iov_len = strlen(cwd) + 1;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    ssize_t n;
+    while ((n = sendmsg(prg_server_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+
+    struct prg_answer_t ans;
+    if (n >= 0 && prg_server_wait(os_monotonic_ms() + PRG_SERVER_ANSWER_MARGIN_MS)) {
+        while ((n = recv(prg_server_fd, &ans, sizeof(ans), 0)) < 0 && errno == EINTR)
+            ;
+    } else {
+        n = -1;
+    }
+    if (n == (ssize_t)sizeof(ans) && ans.type == PRG_ANS_SETUP && ans.value == 0)
+        return;
+
+    if (n == (ssize_t)sizeof(ans) && ans.type == PRG_ANS_SETUP) {
+        char s_err[ERR_STR_BUFSIZE];
+        errno = ans.value;
+        my_logf(LL_ERROR, LP_DATETIME,
+                "Spawn server unable to change directory to '%s', %s, programs will be started by netmon",
+                cwd, os_last_err_desc(s_err, sizeof(s_err)));
+    } else {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "Spawn server (pid %lu) not answering, programs will be started by netmon",
+                (long unsigned)prg_server_pid);
+    }
+    prg_server_kill();
+    prg_server_stop();
+}
+
+//
+// Read an answer of the server into runs[]
+// Returns the index of the run the answer is about, -1 if the server is not
+// answering. *done tells whether the run is done or only started.
+//
+static int prg_server_recv(prg_run_t *runs, const int nb, const int *state,
+                           int *done) {
+    size_t buf_size = sizeof(struct prg_answer_t) + 2 * PRG_OUTPUT_SIZE;
+    char *buf = (char *)MYMALLOC(buf_size, buf);
+    ssize_t n;
+    while ((n = recv(prg_server_fd, buf, buf_size, 0)) < 0 && errno == EINTR)
+        ;
+    const struct prg_answer_t *ans = (const struct prg_answer_t *)buf;
+    int id = -1;
+    *done = FALSE;
+    if (n == (ssize_t)sizeof(struct prg_answer_t) && ans->type == PRG_ANS_STARTED
+            && ans->id >= 0 && ans->id < nb && state[ans->id] == 1) {
+        id = ans->id;
+        runs[id].pid = (pid_t)ans->value;
+    } else if (n >= (ssize_t)sizeof(struct prg_answer_t) && ans->type == PRG_ANS_DONE
+            && ans->id >= 0 && ans->id < nb
+            && state[ans->id] == 1 && ans->out_len >= 0 && ans->out_len < PRG_OUTPUT_SIZE
+            && ans->err_len >= 0 && ans->err_len < PRG_OUTPUT_SIZE
+            && n == (ssize_t)(sizeof(struct prg_answer_t) + (size_t)ans->out_len
+                              + (size_t)ans->err_len)) {
+        id = ans->id;
+        prg_run_t *run = &runs[id];
+        run->exit_code = ans->exit_code;
+        run->timed_out = ans->timed_out;
+        run->duration_ms = ans->duration_ms;
+        run->out_len = (size_t)ans->out_len;
+        memcpy(run->out, buf + sizeof(struct prg_answer_t), run->out_len);
+        run->out[run->out_len] = '\0';
+        run->err_len = (size_t)ans->err_len;
+        memcpy(run->err, buf + sizeof(struct prg_answer_t) + run->out_len,
+               run->err_len);
+        run->err[run->err_len] = '\0';
+        *done = TRUE;
+    }
+    MYFREE(buf);
+    return id;
+}
+
+//
+// Run programs through the spawn server, at most max_parallel at a time.
+// If the server stops answering, or does not answer in time for a program
+// that has a timeout, programs not sent yet are run directly, programs in
+// progress are killed and reported as not run.
+//
+static void prg_run_multi_server(prg_run_t *runs, const int nb,
+                                 const int max_parallel) {
+    // 0: not sent, 1: sent, 2: done
+    int *state = (int *)MYMALLOC(sizeof(int) * (size_t)(nb + 1), state);
+    int nb_done = 0;
+    int nb_sent = 0;
+    int next = 0;
+    int failed = FALSE;
+    int i;
+
+    for (i = 0; i < nb; ++i)
+        state[i] = 0;
+
+    while (nb_done < nb && !failed) {
+        while (nb_sent < max_parallel && next < nb) {
+            prg_run_t *run = &runs[next];
+            prg_reset(run);
+            if (strlen(run->command) >= PRG_SERVER_COMMAND_MAX) {
+                snprintf(run->err, sizeof(run->err), "command too long");
+                run->err_len = strlen(run->err);
+                state[next++] = 2;
+                ++nb_done;
+                continue;
+            }
+            if (!prg_server_send(next, run)) {
+                failed = TRUE;
+                break;
+            }
+            run->start = os_monotonic_ms();
+            run->pid = -1;
+            state[next++] = 1;
+            ++nb_sent;
+        }
+        if (failed || nb_sent == 0)
+            continue;
+
+        long long int deadline = -1;
+        for (i = 0; i < nb; ++i) {
+            if (state[i] == 1 && runs[i].timeout_ms > 0) {
+                long long int d = runs[i].start + runs[i].timeout_ms
+                                  + PRG_SERVER_ANSWER_MARGIN_MS;
+                if (deadline < 0 || d < deadline)
+                    deadline = d;
+            }
+        }
+        if (!prg_server_wait(deadline)) {
+            failed = TRUE;
+            continue;
+        }
+        int done;
+        int id = prg_server_recv(runs, nb, state, &done);
+        if (id < 0) {
+            failed = TRUE;
+            continue;
+        }
+        if (!done)
+            continue;
+        state[id] = 2;
+        --nb_sent;
+        ++nb_done;
+    }
+
+    if (failed) {
+        my_logf(LL_ERROR, LP_DATETIME,
+                "Spawn server (pid %lu) not answering, programs will be started by netmon",
+                (long unsigned)prg_server_pid);
+        // Answers the server sent before it stopped are still to be read
+        int done;
+        int id;
+        while (prg_server_wait(os_monotonic_ms())
+                && (id = prg_server_recv(runs, nb, state, &done)) >= 0) {
+            if (done)
+                state[id] = 2;
+        }
+        prg_server_kill();
+        prg_server_stop();
+        for (i = 0; i < nb; ++i) {
+            if (state[i] == 1) {
+                // Programs are in a process group of their own, not killed
+                // along with the server. A program the server did not tell
+                // the pid of (stopped right after starting it) is left
+                // alone.
+                if (runs[i].pid > 0)
+                    kill(-runs[i].pid, SIGKILL);
+                snprintf(runs[i].err, sizeof(runs[i].err),
+                         "spawn server terminated while the program was running");
+                runs[i].err_len = strlen(runs[i].err);
+            } else if (state[i] == 0) {
+                prg_run_multi_direct(&runs[i], 1, 1);
+            }
+        }
+    }
+
+    MYFREE(state);
+}
+
+void prg_run_multi(prg_run_t *runs, const int nb, const int max_parallel) {
+    if (prg_server_fd >= 0)
+        prg_run_multi_server(runs, nb, max_parallel);
+    else
+        prg_run_multi_direct(runs, nb, max_parallel);
+}
+
+void prg_run(prg_run_t *run) {
+    prg_run_multi(run, 1, 1);
+}
+
+//
+// Time series store
+//
+// One file per key and per segment, named <dir>/<key>.<start>.nmts, start
+// being the beginning of the segment in seconds since the epoch. A file is
+// a struct ts_header_t followed by fixed-size records (struct ts_record_t
+// or struct ts_metric_record_t), written through a shared mapping. The
+// file grows by chunks, and is cut down to its records when the segment is
+// closed.
+// The file is mapped only while a record is appended, and open only while
+// it gets mapped or resized: netmon would otherwise keep one mapping and
+// one file per check and per metric, up to the limits of the process
+// (vm.max_map_count, number of open files).
+//
+
+#define TS_GROW_RECORDS     256
+
+static void ts_file_name(char *fn, const size_t fn_len, const char *dir,
+                         const char *key, const long long int start_ms) {
+    snprintf(fn, fn_len, "%s%c%s.%lld%s", dir, FS_SEPARATOR, key,
+             start_ms / 1000, TS_FILE_EXT);
+}
+
+static size_t ts_file_size(const int record_size,
+                           const long long int nb_records) {
+    return sizeof(struct ts_header_t) + (size_t)nb_records * (size_t)record_size;
+}
+
+static long long int ts_record_time(const char *records, const int record_size,
+                                    const long long int i) {
+    return *(const long long int *)(records + i * record_size);
+}
+
+//
+// Check a header read from an existing file
+//
+static int ts_header_is_valid(const struct ts_header_t *h,
+                              const int record_size, const size_t file_size) {
+    if (memcmp(h->magic, TS_MAGIC, sizeof(h->magic)) != 0
+            || h->version != TS_VERSION
+            || h->record_size != record_size
+            || h->duration_ms <= 0 || h->nb_records < 0)
+        return FALSE;
+    return ts_file_size(record_size, h->nb_records) <= file_size;
+}
+
+void ts_segment_init(ts_segment_t *seg, const int record_size) {
+    seg->map = NULL;
+    seg->map_len = 0;
+    seg->fn = NULL;
+    seg->start_ms = 0;
+    seg->nb_records = 0;
+    seg->capacity = 0;
+    seg->record_size = record_size;
+}
+
+static void ts_segment_unmap(ts_segment_t *seg) {
+    if (seg->map != NULL)
+        munmap(seg->map, seg->map_len);
+    seg->map = NULL;
+}
+
+//
+// Forget the segment, leaving its file as it is
+//
+static void ts_segment_drop(ts_segment_t *seg) {
+    ts_segment_unmap(seg);
+    if (seg->fn != NULL)
+        MYFREE(seg->fn);
+    ts_segment_init(seg, seg->record_size);
+}
+
+void ts_segment_close(ts_segment_t *seg) {
+    ts_segment_unmap(seg);
+    if (seg->fn != NULL) {
+        size_t used = ts_file_size(seg->record_size, seg->nb_records);
+        if (used < seg->map_len && truncate(seg->fn, (off_t)used) != 0) {
+            char s_err[ERR_STR_BUFSIZE];
+            my_logf(LL_WARNING, LP_DATETIME,
+                    "Time series: unable to truncate %s, %s",
+                    seg->fn, os_last_err_desc(s_err, sizeof(s_err)));
+        }
+    }
+    ts_segment_drop(seg);
+}
+
+//
+// (Re)map the segment file after its size has been set to map_len
+//
+static int ts_segment_map(ts_segment_t *seg, const int fd, const char *fn) {
+    seg->map = (char *)mmap(NULL, seg->map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+    if (seg->map == MAP_FAILED) {
+        char s_err[ERR_STR_BUFSIZE];
+        my_logf(LL_ERROR, LP_DATETIME, "Time series: unable to map %s, %s",
+                fn, os_last_err_desc(s_err, sizeof(s_err)));
+        seg->map = NULL;
+        return -1;
+    }
+    seg->capacity = (long long int)((seg->map_len - sizeof(struct ts_header_t))
+                                    / (size_t)seg->record_size);
+    return 0;
+}
+
+//
+// Map the file of the segment starting at start_ms, create it if need be
+//
+static int ts_segment_open(ts_segment_t *seg, const char *dir, const char *key,
+                           const long long int start_ms,
+                           const long long int duration_ms) {
+    char fn[BIGSTRSIZE];
+    char s_err[ERR_STR_BUFSIZE];
+    ts_file_name(fn, sizeof(fn), dir, key, start_ms);
+
+    int fd;
+    if ((fd = open(fn, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        my_logf(LL_ERROR, LP_DATETIME, "Time series: unable to open %s, %s",
+                fn, os_last_err_desc(s_err, sizeof(s_err)));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        my_logf(LL_ERROR, LP_DATETIME, "Time series: unable to stat %s, %s",
+                fn, os_last_err_desc(s_err, sizeof(s_err)));
+        close(fd);
+        return -1;
+    }
+
+    int is_new = (st.st_size == 0);
+    if (is_new) {
+        seg->map_len = ts_file_size(seg->record_size, TS_GROW_RECORDS);
+        if (ftruncate(fd, (off_t)seg->map_len) != 0) {
+            my_logf(LL_ERROR, LP_DATETIME, "Time series: unable to extend %s, %s",
+                    fn, os_last_err_desc(s_err, sizeof(s_err)));
+            close(fd);
+            return -1;
+        }
+    } else if ((size_t)st.st_size < sizeof(struct ts_header_t)) {
+        my_logf(LL_ERROR, LP_DATETIME, "Time series: %s is not a segment file",
+                fn);
+        close(fd);
+        return -1;
+    } else {
+        seg->map_len = (size_t)st.st_size;
+    }
+
+    int r = ts_segment_map(seg, fd, fn);
+    close(fd);
+    if (r != 0)
+        return -1;
+    struct ts_header_t *h = (struct ts_header_t *)seg->map;
+    if (is_new) {
+        memcpy(h->magic, TS_MAGIC, sizeof(h->magic));
+        h->version = TS_VERSION;
+        h->record_size = seg->record_size;
+        h->start_ms = start_ms;
+        h->duration_ms = duration_ms;
+        h->nb_records = 0;
+    } else if (!ts_header_is_valid(h, seg->record_size, seg->map_len)
+               || h->start_ms != start_ms) {
+        my_logf(LL_ERROR, LP_DATETIME, "Time series: %s is not a valid segment file",
+                fn);
+        ts_segment_unmap(seg);
+        return -1;
+    }
+    if (seg->fn == NULL) {
+        size_t fn_len = strlen(fn) + 1;
+        seg->fn = (char *)MYMALLOC(fn_len, seg->fn);
+        memcpy(seg->fn, fn, fn_len);
+    }
+    seg->start_ms = start_ms;
+    seg->nb_records = h->nb_records;
+    return 0;
+}
+
+//
+// Make room for TS_GROW_RECORDS more records, or twice as many records as
+// present, whichever is the greater.
+//
+static int ts_segment_grow(ts_segment_t *seg) {
+    long long int grow = seg->capacity > TS_GROW_RECORDS ? seg->capacity :
+                         TS_GROW_RECORDS;
+    size_t new_len = ts_file_size(seg->record_size, seg->capacity + grow);
+    char s_err[ERR_STR_BUFSIZE];
+
+    int fd;
+    if ((fd = open(seg->fn, O_RDWR | O_CLOEXEC)) < 0) {
+        my_logf(LL_ERROR, LP_DATETIME, "Time series: unable to open %s, %s",
+                seg->fn, os_last_err_desc(s_err, sizeof(s_err)));
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)new_len) != 0) {
+        my_logf(LL_ERROR, LP_DATETIME, "Time series: unable to extend %s, %s",
+                seg->fn, os_last_err_desc(s_err, sizeof(s_err)));
+        close(fd);
+        return -1;
+    }
+    munmap(seg->map, seg->map_len);
+    seg->map_len = new_len;
+    int r = ts_segment_map(seg, fd, seg->fn);
+    close(fd);
+    return r;
+}
+
+//
+// Append a record, switching to another segment when the record time is
+// outside the current one. Within a segment records are kept sorted: a
+// record older than the last one recorded (the clock went backwards) is
+// dropped.
+// Return 0 if the record got written, -1 otherwise.
+//
+int ts_append(ts_segment_t *seg, const char *dir, const char *key,
+              const long long int seg_duration_ms, const void *rec) {
+    long long int time_ms = *(const long long int *)rec;
+    long long int start_ms = time_ms - time_ms % seg_duration_ms;
+
+    if (seg->fn != NULL && seg->start_ms != start_ms)
+        ts_segment_close(seg);
+    if (ts_segment_open(seg, dir, key, start_ms, seg_duration_ms) != 0) {
+        ts_segment_drop(seg);
+        return -1;
+    }
+
+    const int rs = seg->record_size;
+    struct ts_header_t *h = (struct ts_header_t *)seg->map;
+    char *records = (char *)(h + 1);
+    if (h->nb_records >= 1
+            && ts_record_time(records, rs, h->nb_records - 1) > time_ms) {
+        my_logf(LL_WARNING, LP_DATETIME,
+                "Time series: record of %s older than the last one, dropped", key);
+        ts_segment_unmap(seg);
+        return -1;
+    }
+    if (h->nb_records >= seg->capacity) {
+        if (ts_segment_grow(seg) != 0) {
+            ts_segment_close(seg);
+            return -1;
+        }
+        h = (struct ts_header_t *)seg->map;
+        records = (char *)(h + 1);
+    }
+    memcpy(records + h->nb_records * rs, rec, (size_t)rs);
+    seg->nb_records = ++h->nb_records;
+    ts_segment_unmap(seg);
+    return 0;
+}
+
+static int ts_cmp_start(const void *a, const void *b) {
+    long long int x = *(const long long int *)a;
+    long long int y = *(const long long int *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+//
+// Call callback for each record of key such that from_ms <= time < to_ms,
+// in chronological order.
+// Return the number of records found, -1 if dir cannot be read.
+//
+long long int ts_query(const char *dir, const char *key, const int record_size,
+                       const long long int from_ms, const long long int to_ms,
+                       void (*callback)(const void *, void *), void *data) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        char s_err[ERR_STR_BUFSIZE];
+        my_logf(LL_ERROR, LP_DATETIME, "Time series: unable to read directory %s, %s",
+                dir, os_last_err_desc(s_err, sizeof(s_err)));
+        return -1;
+    }
+
+    // 1. List segments of key
+    int nb_alloc = 16;
+    int nb = 0;
+    long long int *starts = (long long int *)MYMALLOC(sizeof(long long int) *
+                            (unsigned long int)nb_alloc, starts);
+    size_t key_len = strlen(key);
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        const char *name = de->d_name;
+        if (strncmp(name, key, key_len) != 0 || name[key_len] != '.')
+            continue;
+        char *end;
+        long long int start_s = strtoll(name + key_len + 1, &end, 10);
+        if (end == name + key_len + 1 || strcmp(end, TS_FILE_EXT) != 0)
+            continue;
+        if (start_s * 1000 >= to_ms)
+            continue;
+        if (nb >= nb_alloc) {
+            nb_alloc *= 2;
+            starts = (long long int *)MYREALLOC(starts, sizeof(long long int) *
+                                                (unsigned long int)nb_alloc);
+        }
+        starts[nb++] = start_s * 1000;
+    }
+    closedir(d);
+    qsort(starts, (size_t)nb, sizeof(*starts), ts_cmp_start);
+
+    // 2. Read them
+    long long int nb_found = 0;
+    int i;
+    for (i = 0; i < nb; ++i) {
+        char fn[BIGSTRSIZE];
+        ts_file_name(fn, sizeof(fn), dir, key, starts[i]);
+        int fd = open(fn, O_RDONLY);
+        if (fd < 0)
+            continue;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct ts_header_t)) {
+            close(fd);
+            continue;
+        }
+        size_t len = (size_t)st.st_size;
+        char *map = (char *)mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            continue;
+
+        const struct ts_header_t *h = (const struct ts_header_t *)map;
+        if (!ts_header_is_valid(h, record_size, len)) {
+            my_logf(LL_WARNING, LP_DATETIME,
+                    "Time series: %s is not a valid segment file, ignored", fn);
+        } else if (h->start_ms + h->duration_ms > from_ms) {
+            const char *records = (const char *)(h + 1);
+            long long int n = h->nb_records;
+            long long int lo = 0;
+            long long int hi = n;
+            // First record such that time >= from_ms
+            while (lo < hi) {
+                long long int mid = lo + (hi - lo) / 2;
+                if (ts_record_time(records, record_size, mid) < from_ms)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            for (; lo < n && ts_record_time(records, record_size, lo) < to_ms;
+                    ++lo) {
+                callback(records + lo * record_size, data);
+                ++nb_found;
+            }
+        }
+        munmap(map, len);
+    }
+
+    MYFREE(starts);
+    return nb_found;
+}
+
+#endif
@@ -73,6 +73,8 @@ typedef int socklen_t;
 
 // Maximum size of an input line in the TCP connection
 #define MAX_READLINE_SIZE 10000
+// Size of the output buffer of a TCP connection
+#define CONN_WRITE_BUFSIZE 8192
 #define SMALLSTRSIZE  999
 #define BIGSTRSIZE    2000
 
@@ -92,6 +94,9 @@ enum {DF_FRENCH = 0, DF_ENGLISH = 1};
 
 #define DEFAULT_CONNECT_TIMEOUT 5
 #define DEFAULT_NETIO_TIMEOUT   10
+#define DEFAULT_DNS_TIMEOUT       5
+#define DEFAULT_DNS_CACHE_TTL     60
+#define DEFAULT_DNS_NEGATIVE_TTL  10
 #define DEFAULT_PRINT_LOG FALSE
 #define DEFAULT_LOG_USEC TRUE
 #define DEFAULT_PRINT_SUBST_ERROR FALSE
@@ -134,7 +139,8 @@ enum {
     CONNRES_CONNECTION_ERROR,
     CONNRES_SSL_CONNECTION_ERROR,
     CONNRES_CONNECTION_TIMEOUT,
-    CONNRES_INVALID_PORT_NUMBER
+    CONNRES_INVALID_PORT_NUMBER,
+    CONNRES_SOCKET_ERROR
 };
 
 struct subst_t {
@@ -168,7 +174,16 @@ typedef struct connection {
     int type;
     int sock;
     SSL *ssl;
-    SSL_CTX *ssl_context;
+    // Duration of SSL handshake in milliseconds, -1 if none
+    int handshake_ms;
+    // Data received and not yet returned by conn_read_line is
+    // rbuf[rbuf_start..rbuf_end[
+    char rbuf[MAX_READLINE_SIZE + 1];
+    size_t rbuf_start;
+    size_t rbuf_end;
+    // Data written and not yet sent
+    char wbuf[CONN_WRITE_BUFSIZE];
+    size_t wbuf_len;
     ssize_t (*sock_read) (connection_t *, void *, const size_t);
     const char *log_prefix_received;
     ssize_t (*sock_write) (connection_t *, void *, const size_t);
@@ -206,6 +221,8 @@ int find_string(const char **table, int n, const char *elem);
 ssize_t my_getline(char **lineptr, size_t *n, FILE *stream);
 void os_sleep(unsigned int seconds);
 void os_usleep(unsigned long int usec);
+long long int os_monotonic_ms();
+void os_sleep_until_ms(const long long int deadline);
 void fs_concatene(char *dst, const char *src, size_t dst_len);
 void set_current_tm(struct tm *ts);
 int add_reader_access_right(const char *f);
@@ -222,17 +239,34 @@ FILE *my_fopen(const char *filename, const char *mode,
                const int nb_retries, const unsigned long int usec_delay);
 
 void os_init_network();
+
+// Shared libraries (.so, .dll)
+void *os_lib_open(const char *file, char *err, const size_t err_len);
+void *os_lib_symbol(void *lib, const char *name);
+void os_lib_close(void *lib);
+#ifdef MY_LINUX
+int os_pipe_cloexec(int fds[2]);
+#endif
 int s_begins_with(const char *s, const char *begins_with);
 int os_setsock_timeout(int sock, int timeout_in_seconds);
 
 void win_get_exe_file(const char *argv0, char *p, size_t p_len);
 
+void conn_ssl_init();
+void ssl_get_stats(unsigned long int *full, unsigned long int *resumed);
+void ssl_add_stats(const unsigned long int full, const unsigned long int resumed);
+void ssl_log_stats();
 void conn_init(connection_t *conn, int type);
 void conn_close(connection_t *conn);
 int conn_is_closed(connection_t *conn);
+int conn_flush(void (*lp)(const loglevel_t, const logdisp_t,
+                          const char *, ...), connection_t *conn);
 int conn_line_sendf(void (*l)(const loglevel_t, const logdisp_t,
                               const char *, ...), connection_t *conn, int trace, const char *fmt, ...)
     __attribute__((format(printf, 4, 5)));
+int conn_read_line(void (*lp)(const loglevel_t, const logdisp_t,
+                              const char *, ...), connection_t *conn, char **line,
+                   size_t *len, int trace);
 int conn_read_line_alloc(void (*lp)(const loglevel_t, const logdisp_t,
                                     const char *, ...), connection_t *conn, char **out, int trace,
                          size_t *size);
@@ -243,10 +277,29 @@ int conn_round_trip(void (*l)(const loglevel_t, const logdisp_t,
                               const char *, ...), connection_t *conn, const char *expect, int trace,
                     const char *fmt, ...)
     __attribute__((format(printf, 5, 6)));
+int conn_expect(void (*lp)(const loglevel_t, const logdisp_t,
+                           const char *, ...), connection_t *conn, const char *expect, int trace);
+int conn_is_continuation_line(const char *line);
 int conn_establish_connection(connection_t *conn, const conn_def_t *srv,
                               const int default_port,
                               const char *expect, const char *prefix,
                               const int trace);
+
+// DNS cache
+enum {DNS_OK, DNS_FAILED, DNS_PENDING};
+int dns_lookup(const char *name, struct in_addr *addr, int *handle);
+int dns_status(const int handle, struct in_addr *addr);
+int dns_resolve(const char *name, struct in_addr *addr, int *handle);
+const char *dns_err_desc(const int handle);
+void dns_get_stats(unsigned long int *hits, unsigned long int *misses,
+                   int *nb_names);
+void dns_add_stats(const unsigned long int hits, const unsigned long int misses);
+void dns_log_stats(const int other_names);
+#ifdef MY_LINUX
+int dns_event_fd();
+void dns_poll();
+void dns_after_fork();
+#endif
 ssize_t conn_plain_read(connection_t *conn, void *buf,
                         const size_t buf_len);
 ssize_t conn_plain_write(connection_t *conn, void *buf,
@@ -255,6 +308,145 @@ ssize_t conn_ssl_read(connection_t *conn, void *buf, const size_t buf_len);
 ssize_t conn_ssl_write(connection_t *conn, void *buf,
                        const size_t buf_len);
 
+#ifdef MY_LINUX
+// TCP probe performed by conn_probe_multi: connection, optional check of
+// the first line received, optional line sent before disconnecting.
+typedef struct {
+    const conn_def_t *srv;
+    const char *expect;
+    const char *close;
+    char prefix[SMALLSTRSIZE];
+
+    // Set by conn_probe_multi
+    int multiplexed;
+    int cr;
+    int duration_ms;
+} conn_probe_t;
+void conn_probe_multi(conn_probe_t *probes, const int nb, const int trace);
+#endif
+
+// Program run by prg_run or prg_run_multi through "/bin/sh -c". Standard
+// output and standard error are captured, truncated to PRG_OUTPUT_SIZE - 1
+// bytes. When timeout_ms elapses, the process group of the program is
+// killed.
+#define PRG_OUTPUT_SIZE     4096
+typedef struct {
+    const char *command;
+    // 0 for no timeout
+    long int timeout_ms;
+
+    // Set by prg_run and prg_run_multi
+    // Exit status, -1 if the program could not be run or was killed
+    int exit_code;
+    int timed_out;
+    int duration_ms;
+    char out[PRG_OUTPUT_SIZE];
+    size_t out_len;
+    char err[PRG_OUTPUT_SIZE];
+    size_t err_len;
+
+#ifdef MY_LINUX
+    pid_t pid;
+    int fds[2];
+    // Readable once the program is terminated, -1 if not available
+    int pidfd;
+    long long int start;
+#endif
+} prg_run_t;
+void prg_run(prg_run_t *run);
+#ifdef MY_LINUX
+void prg_run_multi(prg_run_t *runs, const int nb, const int max_parallel);
+int prg_server_start();
+void prg_server_stop();
+void prg_server_after_fork();
+void prg_server_setup();
+#endif
+
+// Output of a Nagios plugin: the first line is "TEXT | PERFDATA", PERFDATA
+// being space separated items 'label'=value[UOM];[warn];[crit];[min];[max]
+#define NAGIOS_PERF_MAX         16
+#define NAGIOS_LABEL_SIZE       48
+#define NAGIOS_UOM_SIZE         8
+#define NAGIOS_RANGE_SIZE       24
+typedef struct {
+    char label[NAGIOS_LABEL_SIZE];
+    double value;
+    char uom[NAGIOS_UOM_SIZE];
+    // Ranges, kept as written by the plugin, empty if not provided
+    char warn[NAGIOS_RANGE_SIZE];
+    char crit[NAGIOS_RANGE_SIZE];
+    double min;
+    double max;
+    int has_min;
+    int has_max;
+} nagios_perf_t;
+int nagios_parse_output(const char *out, size_t *text_len, nagios_perf_t *perf,
+                        const int perf_max);
+
+unsigned int fnv1a_hash(const char *s);
+unsigned int fnv1a_hash_update(unsigned int h, const char *s);
+
+// Value of a check result that has none
+#define TS_VALUE_NONE       (-1)
+
+#ifdef MY_LINUX
+// Time series store: fixed-size records appended to per-key segment files.
+// A segment covers a fixed duration, records of a segment are sorted by
+// time, so that a time range is found by binary search.
+#define TS_MAGIC            "NMTS"
+#define TS_VERSION          1
+#define TS_FILE_EXT         ".nmts"
+
+struct ts_header_t {
+    char magic[4];
+    int version;
+    int record_size;
+    int reserved;
+    long long int start_ms;
+    long long int duration_ms;
+    // Updated once the record is written, so that a reader never sees a
+    // partially written record.
+    long long int nb_records;
+    char pad[24];
+};
+
+// Records of a given key all have the same size, and start with the time
+// in milliseconds since the epoch.
+struct ts_record_t {
+    long long int time_ms;
+    int duration_ms;
+    int value;
+    int status;
+    int method;
+};
+
+struct ts_metric_record_t {
+    long long int time_ms;
+    double value;
+};
+
+typedef struct {
+    // Mapping of the file, only while a record is appended
+    char *map;
+    // Size of the file
+    size_t map_len;
+    // File name, NULL if no segment is open
+    char *fn;
+    long long int start_ms;
+    long long int nb_records;
+    long long int capacity;
+    int record_size;
+} ts_segment_t;
+
+void ts_segment_init(ts_segment_t *seg, const int record_size);
+void ts_segment_close(ts_segment_t *seg);
+int ts_append(ts_segment_t *seg, const char *dir, const char *key,
+              const long long int seg_duration_ms, const void *rec);
+long long int ts_query(const char *dir, const char *key, const int record_size,
+                       const long long int from_ms, const long long int to_ms,
+                       void (*callback)(const void *, void *), void *data);
+#endif
+
 #ifdef DEBUG_DYNMEM
 void *debug_malloc(size_t size, const char *var, const char *source_file,
                    const long int line);
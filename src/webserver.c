@@ -86,6 +86,12 @@ const char *POEM =
 const char *POEM_URL = "poem";
 const char *POEM_TYPE = "text/html";
 
+const char *RUN_NOW_PAGE =
+    "<html><head>"
+    "<META HTTP-EQUIV=\"Refresh\" CONTENT=\"3; URL=/\">"
+    "</head><body><p>Checks will be done now.</p></body></html>\015\012";
+const char *RUN_NOW_TYPE = "text/html";
+
 char g_html_directory[BIGSTRSIZE] = DEFAULT_HTML_DIRECTORY;
 char g_html_file[SMALLSTRSIZE] = DEFAULT_HTML_FILE;
 char g_html_title[SMALLSTRSIZE] = PACKAGE_NAME;
@@ -517,6 +523,19 @@ void manage_web_transaction(connection_t *conn) {
         else if (strcasecmp(url, URL_LOG) == 0) {
             strncpy(path, g_log_file, sizeof(path));
             fflush(log_fd);
+#ifdef MY_LINUX
+        } else if (strcasecmp(url, URL_RUN_NOW) == 0) {
+            if (sched_request_run_now()) {
+                http_send_error_page(conn, "503 Service Unavailable",
+                                     "Unable to request checks to be done now");
+                conn_close(conn);
+                return;
+            }
+            wlogf(LL_NORMAL, LP_DATETIME, "client requested checks to be done now");
+            internal_content = RUN_NOW_PAGE;
+            size_internal_content = strlen(internal_content);
+            type_internal_content = RUN_NOW_TYPE;
+#endif
         } else if (strcasecmp(url, POEM_URL) == 0) {
             internal_content = POEM;
             size_internal_content = strlen(internal_content);
@@ -584,6 +603,8 @@ void manage_web_transaction(connection_t *conn) {
                     content_type = "text/html";
                 else if (strcasecmp(pos, "ini") == 0 || strcasecmp(pos, "log") == 0)
                     content_type = "text/ascii";
+                else if (strcasecmp(pos, "json") == 0)
+                    content_type = "application/json";
             }
         } else {
             strncpy(dt_fileupdate, dt_now, sizeof(dt_fileupdate));
@@ -0,0 +1,109 @@
+// bench-readline.c
+
+// Microbenchmark of conn_read_line_alloc, compiled and run by
+// bench-readline.sh.
+//
+// A child process writes lines looking like a POP3 answer to TOP over a
+// socket pair, the parent reads them. Calls to sock_read are counted, once
+// with reads limited to one byte (what netmon did before the connection got
+// an input buffer), once as netmon does now.
+
+#include "../src/util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define NB_MESSAGES        500
+#define LINES_PER_MESSAGE  20
+
+static unsigned long int nb_calls;
+
+static ssize_t counting_read(connection_t *conn, void *buf,
+                             const size_t buf_len) {
+    ++nb_calls;
+    return conn_plain_read(conn, buf, buf_len);
+}
+
+static ssize_t counting_read_one_byte(connection_t *conn, void *buf,
+                                      const size_t buf_len) {
+    ++nb_calls;
+    return conn_plain_read(conn, buf, buf_len >= 1 ? 1 : 0);
+}
+
+static void writer(int sock) {
+    char line[200];
+    int i;
+    int j;
+
+    for (i = 1; i <= NB_MESSAGES; ++i) {
+        snprintf(line, sizeof(line), "+OK message %d follows\r\n", i);
+        if (write(sock, line, strlen(line)) < 0)
+            _exit(EXIT_FAILURE);
+        for (j = 1; j <= LINES_PER_MESSAGE; ++j) {
+            snprintf(line, sizeof(line),
+                     "X-Header-%02d: from relay%d.example.com by mx.example.com; %d\r\n",
+                     j, j, i);
+            if (write(sock, line, strlen(line)) < 0)
+                _exit(EXIT_FAILURE);
+        }
+        if (write(sock, ".\r\n", 3) < 0)
+            _exit(EXIT_FAILURE);
+    }
+    close(sock);
+    _exit(EXIT_SUCCESS);
+}
+
+static void run(const char *desc,
+                ssize_t (*sock_read)(connection_t *, void *, const size_t)) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        writer(sv[1]);
+    }
+    close(sv[1]);
+
+    connection_t *conn = (connection_t *)malloc(sizeof(connection_t));
+    conn_init(conn, CONNTYPE_PLAIN);
+    conn->sock = sv[0];
+    conn->sock_read = sock_read;
+
+    nb_calls = 0;
+    unsigned long int nb_bytes = 0;
+    unsigned long int nb_lines = 0;
+    char *line = NULL;
+    size_t size;
+    struct timespec t0;
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (conn_read_line_alloc(my_logf, conn, &line, FALSE, &size) == 1) {
+        nb_bytes += strlen(line) + 2;
+        ++nb_lines;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double ms = (double)(t1.tv_sec - t0.tv_sec) * 1000.0
+                + (double)(t1.tv_nsec - t0.tv_nsec) / 1000000.0;
+    printf("%-16s %lu lines, %lu KB, %lu reads, %.2f reads per KB, %.1f ms\n",
+           desc, nb_lines, nb_bytes / 1024, nb_calls,
+           (double)nb_calls * 1024.0 / (double)nb_bytes, ms);
+
+    free(line);
+    conn_close(conn);
+    free(conn);
+    waitpid(pid, NULL, 0);
+}
+
+int main() {
+    run("byte at a time:", counting_read_one_byte);
+    run("buffered:", counting_read);
+    return 0;
+}
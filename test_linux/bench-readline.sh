@@ -0,0 +1,19 @@
+#!/bin/sh
+
+# Measure the number of reads per KB done by conn_read_line_alloc, with
+# reads of one byte (as netmon did before connections got an input buffer)
+# and as netmon does now.
+# Not part of tt.sh.
+#
+# Usage: ./bench-readline.sh
+# CC and CFLAGS can be set to choose the compiler and its options.
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+DIR=$(mktemp -d)
+
+$CC $CFLAGS -fcommon -o "$DIR/bench-readline" bench-readline.c ../src/util.c \
+	-lssl -lcrypto || exit 1
+"$DIR/bench-readline"
+
+rm -rf "$DIR"
@@ -0,0 +1,74 @@
+#!/bin/sh
+
+# Measure the cost of round bookkeeping (walking checks, recording
+# statuses, producing output) with a large number of checks.
+# Not part of tt.sh.
+#
+# Usage: ./bench-rounds.sh [NB_CHECKS]
+# Set KEEP to keep the generated ini and log files.
+#
+# Checks connect to a closed local port so that performing them costs
+# next to nothing. All of them are done in the first round, then a
+# single check is due in each of the following rounds (test mode 3 runs
+# 20 rounds).
+
+PRG=../src/netmon
+NB=${1:-100000}
+DIR=$(mktemp -d)
+INI="$DIR/netmon.ini"
+
+cat > "$INI" << EOT
+[General]
+check_interval=86400
+keep_last_status=15
+html_directory=$DIR
+webserver=no
+tcp_engine=epoll
+connect_timeout=2
+
+[Alert]
+name=mylog
+method=log
+log_file=$DIR/alert.log
+
+[Check]
+method=tcp
+display_name=every-round
+host_name=127.0.0.1
+tcp_port=1
+interval=1
+alerts=mylog
+EOT
+
+i=0
+while [ $i -lt $NB ]; do
+	printf "[Check]\nmethod=tcp\ndisplay_name=c%i\nhost_name=127.0.0.1\ntcp_port=1\nalerts=mylog\n" $i
+	i=$(($i + 1))
+done >> "$INI"
+
+START=$(date +%s%N)
+$PRG --laxist -t 3 -l "$DIR/netmon.log" -c "$INI" > /dev/null 2>&1
+END=$(date +%s%N)
+
+echo "Checks: $(($NB + 1)), total: $((($END - $START) / 1000000)) ms"
+
+# Duration of rounds, from log timestamps
+grep "Starting check\|Check done" "$DIR/netmon.log" | awk '
+	{ split($2, t, ":"); s = t[1] * 3600 + t[2] * 60 + t[3] }
+	/Starting check/ { start = s; next }
+	{ d[n++] = (s - start) * 1000 }
+	END {
+		printf "First round (all checks due): %.1f ms\n", d[0]
+		for (i = 2; i < n; ++i)
+			for (j = i; j > 1 && d[j] < d[j - 1]; --j) {
+				x = d[j]; d[j] = d[j - 1]; d[j - 1] = x
+			}
+		if (n >= 2)
+			printf "Next %i rounds (1 check due): median %.2f ms per round\n", n - 1, d[1 + int((n - 1) / 2)]
+	}'
+
+if [ -n "$KEEP" ]; then
+	echo "Files kept in $DIR"
+else
+	rm -rf "$DIR"
+fi
@@ -2,4 +2,6 @@
 
 find -regex ".*/[tu][0-9][0-9]/tmp-[^.]+.txt$" | while read f; do rm "$f"; done
 find -regex ".*/[tu][0-9][0-9]/tmp-[^.]+.log$" | while read f; do rm "$f"; done
+find -regex ".*/[tu][0-9][0-9]/tmp-[^.]+.so$" | while read f; do rm "$f"; done
 rm www/*.png www/netmon.html 2> /dev/null
+find -regex ".*/[tu][0-9][0-9]/tmp-hist$" | while read d; do rm -r "$d"; done
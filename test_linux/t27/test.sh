@@ -0,0 +1,3 @@
+#!/bin/sh
+
+../generic_simple.sh "TCP checks (epoll engine)" "tmp-output.txt" "expected-output.txt" netmon.ini $1
@@ -0,0 +1,10 @@
+#!/bin/sh
+
+# To be run as check program by netmon
+# Records each execution, to verify when checks are scheduled.
+
+NAGIOS_OK=0
+
+echo "check.sh: $@" >> tmp-out.log
+
+exit $NAGIOS_OK
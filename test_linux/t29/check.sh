@@ -0,0 +1,20 @@
+#!/bin/sh
+
+# To be run as check program by netmon
+# Records each execution, to verify which checks are performed.
+# Fails when loop count is a multiple of the third argument.
+
+NAGIOS_OK=0
+NAGIOS_CRITICAL=2
+
+LC=$1
+NAME=$2
+PERIOD=$3
+
+echo "check.sh: $LC $NAME" >> tmp-out.log
+
+if [ $(($LC % $PERIOD)) -eq 0 ]; then
+  exit $NAGIOS_CRITICAL
+else
+  exit $NAGIOS_OK
+fi
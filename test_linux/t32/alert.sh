@@ -0,0 +1,9 @@
+#!/bin/sh
+
+# To be run as alert program by netmon
+# Sébastien Millet, May, June 2013
+
+echo "alert.sh: $@" >> tmp-out.log
+
+exit 0
+
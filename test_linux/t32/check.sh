@@ -0,0 +1,21 @@
+#!/bin/sh
+
+# To be run as check program by netmon
+# Fails when loop count is a multiple of the third argument.
+# The second argument is a delay, so that checks complete in an order
+# that differs from their order in the ini file.
+
+NAGIOS_OK=0
+NAGIOS_CRITICAL=2
+
+LC=$1
+DELAY=$2
+PERIOD=$3
+
+sleep $DELAY
+
+if [ $(($LC % $PERIOD)) -eq 0 ]; then
+  exit $NAGIOS_CRITICAL
+else
+  exit $NAGIOS_OK
+fi
@@ -0,0 +1,5 @@
+#!/bin/sh
+
+LOG="tmp-out.log"
+echo "test.sh" > "$LOG"
+../generic_simple2.sh "Check processes" "$LOG" "expected-output.txt" netmon.ini $1 -t 3
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+# To be run as check program by netmon
+# Fails when loop count is a multiple of the second argument.
+
+NAGIOS_OK=0
+NAGIOS_CRITICAL=2
+
+LC=$1
+PERIOD=$2
+
+if [ $(($LC % $PERIOD)) -eq 0 ]; then
+  exit $NAGIOS_CRITICAL
+else
+  exit $NAGIOS_OK
+fi
@@ -0,0 +1,36 @@
+#!/bin/sh
+
+# Results recorded in history_directory, read back with --history.
+# Times and durations vary from one run to the next, only status and value
+# are compared.
+
+PRG=../../src/netmon
+LOG="tmp-out.log"
+HIST="tmp-hist"
+
+rm -rf "$HIST"
+mkdir "$HIST"
+echo "test.sh" > "$LOG"
+
+$PRG -l "" -c netmon.ini -t 3 > /dev/null
+for c in "Prog-1" "Prog 2/b" "PROG 2/B" "Unknown"; do
+  echo "$c" >> "$LOG"
+  $PRG -l "" -c netmon.ini --history "$c" | cut -f 2,4 >> "$LOG"
+done
+
+REP=$(pwd | sed 's/.*\///')
+
+if [ "$1" = "--batch" ]; then
+	cmp expected-output.txt $LOG 2>&1 > /dev/null
+	if [ "$?" -ne "0" ]; then
+		echo "$REP ** History: KO"
+		exit 1;
+	else
+		echo "$REP    History: OK"
+		exit 0;
+	fi
+fi
+
+cat $LOG
+md5sum expected-output.txt
+md5sum $LOG
@@ -0,0 +1,20 @@
+#!/bin/sh
+
+# To be run as check program by netmon
+# Counts its executions in a file, so that the count goes on from one run
+# of netmon to the next. Fails when count modulo the second argument is
+# greater than or equal to the third argument.
+
+NAGIOS_OK=0
+NAGIOS_CRITICAL=2
+
+F="tmp-count-$1.txt"
+N=$(cat "$F" 2> /dev/null || echo 0)
+N=$(($N + 1))
+echo $N > "$F"
+
+if [ $(($N % $2)) -ge $3 ]; then
+  exit $NAGIOS_CRITICAL
+else
+  exit $NAGIOS_OK
+fi
@@ -0,0 +1,31 @@
+#!/bin/sh
+
+# netmon is started for one round, ten times in a row: consecutive failures
+# and alerts must go on as if it had run without interruption.
+
+PRG=../../src/netmon
+LOG="tmp-out.log"
+
+rm -f tmp-state.txt tmp-count-*.txt
+echo "test.sh" > "$LOG"
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  $PRG -l "" -c netmon.ini -t 1 > /dev/null
+done
+
+REP=$(pwd | sed 's/.*\///')
+
+if [ "$1" = "--batch" ]; then
+	cmp expected-output.txt $LOG 2>&1 > /dev/null
+	if [ "$?" -ne "0" ]; then
+		echo "$REP ** Restart: KO"
+		exit 1;
+	else
+		echo "$REP    Restart: OK"
+		exit 0;
+	fi
+fi
+
+cat $LOG
+md5sum expected-output.txt
+md5sum $LOG
@@ -0,0 +1,18 @@
+#!/bin/sh
+
+# To be run as check program by netmon
+# Fails when loop count modulo the second argument is greater than or
+# equal to the third argument.
+
+NAGIOS_OK=0
+NAGIOS_CRITICAL=2
+
+LC=$1
+PERIOD=$2
+FROM=$3
+
+if [ $(($LC % $PERIOD)) -ge $FROM ]; then
+  exit $NAGIOS_CRITICAL
+else
+  exit $NAGIOS_OK
+fi
@@ -0,0 +1,18 @@
+#!/bin/sh
+
+# To be run as check program by netmon
+# When loop count is equal to the second argument, replaces the ini file
+# with the third argument and sends SIGHUP to netmon.
+
+NAGIOS_OK=0
+
+if [ $1 -eq $2 ]; then
+  cp "$3" tmp-config.txt
+  P=$PPID
+  while [ "$P" -gt 1 ] && [ "$(cat /proc/$P/comm)" != "netmon" ]; do
+    P=$(sed 's/.*) //' /proc/$P/stat | cut -d ' ' -f 2)
+  done
+  kill -HUP $P
+fi
+
+exit $NAGIOS_OK
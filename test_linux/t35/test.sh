@@ -0,0 +1,10 @@
+#!/bin/sh
+
+# The ini file is replaced and SIGHUP sent to netmon during round 5:
+# "Unchanged" keeps its consecutive failures, "Changed" and "Added" start
+# afresh, "Removed" is no longer performed.
+
+LOG="tmp-out.log"
+echo "test.sh" > "$LOG"
+cp netmon-1.ini tmp-config.txt
+../generic_simple2.sh "Reload on SIGHUP" "$LOG" "expected-output.txt" tmp-config.txt $1 -t 3
@@ -0,0 +1,20 @@
+#!/bin/sh
+
+# To be run as check program by netmon
+# Leaves a program running in the background, that keeps standard output
+# and standard error open, then fails when loop count is a multiple of the
+# first argument. netmon must not wait for the program in the background.
+
+NAGIOS_OK=0
+NAGIOS_CRITICAL=2
+
+LC=$1
+PERIOD=$2
+
+sleep 3 &
+
+if [ $(($LC % $PERIOD)) -eq 0 ]; then
+  exit $NAGIOS_CRITICAL
+else
+  exit $NAGIOS_OK
+fi
@@ -0,0 +1,18 @@
+#!/bin/sh
+
+# To be run as check program by netmon
+# Hangs when loop count is a multiple of the first argument, along with a
+# program started in the background, so that netmon has to kill the whole
+# process group once program_timeout is elapsed.
+
+NAGIOS_OK=0
+
+LC=$1
+PERIOD=$2
+
+if [ $(($LC % $PERIOD)) -eq 0 ]; then
+  sleep 30 &
+  sleep 30
+fi
+
+exit $NAGIOS_OK
@@ -0,0 +1,9 @@
+#!/bin/sh
+
+# To be run as check program by netmon
+# Prints the output of a Nagios plugin, with performance data
+
+echo "DISK OK - free space: / 3326 MB (56%) | '/ used'=2643MB;5948;5958;0;5968 'it''s'=56% time=0.003s;1;2 busy=U"
+echo "More text | not=1"
+
+exit 0
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+../generic_simple.sh "Nagios plugin output" "tmp-output.txt" "expected-output.txt" netmon.ini $1
@@ -0,0 +1,69 @@
+// plugin.c
+
+// Check plugin used by test t38, built by test.sh
+// plugin_args tells what to do:
+//   "fail-init"  init fails
+//   "crash"      run crashes
+//   "critical"   run returns CRITICAL
+//   otherwise    run returns OK
+
+#include "../../src/netmon-plugin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+struct state_t {
+    int nb_runs;
+};
+
+static int test_init(const char *args, void **state) {
+    if (args != NULL && strcmp(args, "fail-init") == 0)
+        return 1;
+    struct state_t *st = (struct state_t *)malloc(sizeof(struct state_t));
+    st->nb_runs = 0;
+    *state = st;
+    return 0;
+}
+
+static int test_run(void *state, const struct netmon_plugin_check_t *check,
+                    const struct netmon_plugin_subst_t *subst, int subst_len,
+                    char *output, size_t output_size) {
+    struct state_t *st = (struct state_t *)state;
+    const char *args = (check->args != NULL ? check->args : "");
+    const char *name = "";
+    int i;
+    for (i = 0; i < subst_len; ++i) {
+        if (strcmp(subst[i].name, "DISPLAY_NAME") == 0)
+            name = subst[i].value;
+    }
+
+    if (strcmp(args, "crash") == 0)
+        raise(SIGSEGV);
+
+    ++st->nb_runs;
+    int code = (strcmp(args, "critical") == 0 ? 2 : 0);
+    snprintf(output, output_size,
+             "TEST %s - %s on %s, args '%s' | runs=%i;;;0 size=12.5KB\nSecond line",
+             code == 0 ? "OK" : "CRITICAL", name,
+             check->host_name, args,
+             st->nb_runs);
+    return code;
+}
+
+static void test_destroy(void *state) {
+    free(state);
+}
+
+static const struct netmon_plugin_t plugin = {
+    NETMON_PLUGIN_ABI_VERSION,
+    "test",
+    test_init,
+    test_run,
+    test_destroy
+};
+
+const struct netmon_plugin_t *netmon_plugin_entry() {
+    return &plugin;
+}
@@ -0,0 +1,5 @@
+#!/bin/sh
+
+${CC:-cc} -shared -fPIC -o tmp-plugin.so plugin.c || exit 1
+
+../generic_simple.sh "Shared object plugins" "tmp-output.txt" "expected-output.txt" netmon.ini $1
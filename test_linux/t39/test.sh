@@ -0,0 +1,3 @@
+#!/bin/sh
+
+../generic_simple.sh "Spawn server" "tmp-output.txt" "expected-output.txt" netmon.ini $1
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+# To be run as check program by netmon
+# When loop count is equal to the second argument, stops the check process
+# that started it (the parent of sh -c), so that netmon has to kill and
+# restart this process.
+
+NAGIOS_OK=0
+
+LC=$1
+STOP_AT=$2
+
+if [ $LC -eq $STOP_AT ]; then
+  kill -STOP $(awk '{ print $4 }' /proc/$PPID/stat)
+fi
+
+exit $NAGIOS_OK
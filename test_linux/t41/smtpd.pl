@@ -0,0 +1,65 @@
+#!/usr/bin/perl
+
+# Minimal SMTP server used by test.sh
+# Announces PIPELINING and gives multi-line replies to the greeting, to
+# RCPT TO, to DATA and to the end of the message, so that netmon has to
+# read replies up to their last line. What netmon sends is written in
+# tmp-out.log.
+
+use strict;
+use warnings;
+use IO::Socket::INET;
+
+my $port = $ARGV[0];
+
+my $srv = IO::Socket::INET->new(LocalAddr => '127.0.0.1', LocalPort => $port,
+                                Listen => 5, ReuseAddr => 1)
+  or die "smtpd.pl: cannot listen on port $port: $!\n";
+
+open(my $log, '>>', 'tmp-out.log') or die;
+$log->autoflush(1);
+
+# Do not outlive the test
+alarm(60);
+
+while (my $c = $srv->accept()) {
+  $c->autoflush(1);
+  print $c "220-localhost test server\r\n220 ready\r\n";
+  my $in_data = 0;
+  my $nb_lines = 0;
+  while (my $l = <$c>) {
+    $l =~ s/\r?\n$//;
+    if ($in_data) {
+      if ($l eq '.') {
+        $in_data = 0;
+        print $log "smtpd.pl: message of $nb_lines line(s)\n";
+        print $c "250-message accepted\r\n250 ok queued as T41\r\n";
+      } else {
+        ++$nb_lines;
+        if ($l =~ /^subject:/i) {
+          $l =~ s/ since .*//;
+          print $log "smtpd.pl: $l\n";
+        }
+      }
+    } elsif ($l =~ /^EHLO /i) {
+      print $c "250-localhost\r\n250-PIPELINING\r\n250 8BITMIME\r\n";
+    } elsif ($l =~ /^MAIL FROM:/i) {
+      print $log "smtpd.pl: $l\n";
+      print $c "250 sender ok\r\n";
+    } elsif ($l =~ /^RCPT TO:/i) {
+      print $log "smtpd.pl: $l\n";
+      print $c "250-recipient\r\n250 ok\r\n";
+    } elsif ($l =~ /^DATA$/i) {
+      print $log "smtpd.pl: DATA\n";
+      $in_data = 1;
+      $nb_lines = 0;
+      print $c "354-go ahead\r\n354 end with <CRLF>.<CRLF>\r\n";
+    } elsif ($l =~ /^QUIT$/i) {
+      print $c "221 bye\r\n";
+      last;
+    } else {
+      print $c "500 unknown command\r\n";
+    }
+  }
+  close($c);
+}
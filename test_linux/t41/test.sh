@@ -0,0 +1,11 @@
+#!/bin/sh
+
+LOG="tmp-out.log"
+echo "test.sh" > "$LOG"
+./smtpd.pl 25241 &
+SMTPD=$!
+sleep 1
+../generic_simple2.sh "SMTP multi-line replies" "$LOG" "expected-output.txt" netmon.ini $1 -t 3
+R=$?
+kill $SMTPD
+exit $R